@@ -0,0 +1,52 @@
+#ifndef ACCOUNTING_HPP
+#define ACCOUNTING_HPP
+
+#include <string>
+#include <cstddef>
+
+// Live objects and bytes per subsystem, for STATS A and tools/soak. The
+// counters are atomic: fanout workers take buffer blocks too.
+namespace Accounting
+{
+    enum Subsystem
+    {
+        CLIENT,                          // Client objects
+        CHANNEL,                         // Channel objects
+        BUFFER,                          // pooled blocks held by connection buffers
+        PARSE,                           // heap strings of the command being parsed
+        SUBSYSTEMS
+    };
+
+    struct Counters
+    {
+        long live;
+        long liveBytes;
+        unsigned long long allocs;
+        unsigned long long frees;
+    };
+
+    void allocated(Subsystem s, size_t bytes);
+    void freed(Subsystem s, size_t bytes);
+    Counters get(Subsystem s);
+    const char *name(Subsystem s);
+    // block size behind a string, 0 while it fits in the object itself
+    size_t heapBytes(const std::string &s);
+
+    // books strings in for the lifetime of the scope
+    class Scope
+    {
+        Subsystem _s;
+        size_t _bytes;
+        size_t _count;
+
+        Scope(const Scope &);
+        Scope &operator=(const Scope &);
+
+      public:
+        explicit Scope(Subsystem s) : _s(s), _bytes(0), _count(0) {}
+        ~Scope();
+        void add(const std::string &s);  // only when its data is on the heap
+    };
+}
+
+#endif
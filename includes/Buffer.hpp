@@ -0,0 +1,62 @@
+#ifndef BUFFER_HPP
+#define BUFFER_HPP
+
+#include <cstddef>
+
+// Blocks for connection buffers, in power of two size classes. Drained
+// buffers hand their block back, so an idle connection owns no heap memory
+// and the next busy one reuses the block. Thread safe: fanout workers queue
+// output too. Each thread keeps up to 16 blocks per class (256 KiB at most)
+// of its own and moves them to or from the shared lists in batches; the
+// idle limit applies to the shared lists.
+namespace BufferPool
+{
+    static const size_t MIN_BLOCK = 256;
+    static const size_t MAX_POOLED = 64 * 1024;   // larger blocks go straight back to malloc
+
+    struct Stats
+    {
+        size_t inUse;                  // blocks held by buffers
+        size_t inUseBytes;
+        size_t idle;                   // blocks kept for reuse
+        size_t idleBytes;
+        unsigned long long hits;       // acquire() served from the pool
+        unsigned long long misses;     // acquire() had to malloc
+    };
+
+    // `cap` is raised to the block size actually returned
+    char *acquire(size_t &cap);
+    void release(char *block, size_t cap);
+    // bytes of idle blocks kept around (config buffer_pool_bytes), the rest is freed
+    void setIdleLimit(size_t bytes);
+    Stats stats();
+}
+
+// A byte queue: append at the back, consume from the front. Holds no
+// block while empty.
+class Buffer
+{
+    char *_data;
+    size_t _off;                       // consumed bytes at the front
+    size_t _len;                       // end of the data
+    size_t _cap;
+
+    Buffer(const Buffer &);
+    Buffer &operator=(const Buffer &);
+
+  public:
+    Buffer() : _data(NULL), _off(0), _len(0), _cap(0) {}
+    ~Buffer() { clear(); }
+
+    bool empty() const { return _off == _len; }
+    size_t size() const { return _len - _off; }
+    size_t capacity() const { return _cap; }
+    const char *data() const { return _data + _off; }
+    char *data() { return _data + _off; }
+
+    void append(const char *p, size_t n);
+    void consume(size_t n);
+    void clear();
+};
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#include <pthread.h>
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <map>
+
+// Records every inbound byte per connection, for tools/replay.
+// File layout: "IRCCAP1\n" then records
+//   u8 type, u32 conn, i64 usec since the epoch, u32 len, len bytes
+// conn ids count up per file and are never reused, unlike fds. A process
+// that opens an existing file appends a new header: replay starts a fresh
+// set of conn ids after each one.
+//
+// The loop thread only appends to memory; flush() hands the block to a
+// writer thread. If the disk falls more than MAX_QUEUED bytes behind, a
+// block is dropped whole (the file stays parseable) and counted instead.
+class Capture
+{
+  public:
+    enum Type { CONNECT = 1, DATA = 2, DISCONNECT = 3 };
+
+    static const size_t MAX_QUEUED = 16 << 20;
+
+  private:
+    int _fd;
+    std::string _buf;                  // written out in large blocks
+    std::map<int, unsigned int> _ids;  // fd => conn id
+    unsigned int _nextId;
+
+    // shared with the writer, under _lock
+    pthread_t _writer;
+    pthread_mutex_t _lock;
+    pthread_cond_t _work;
+    std::deque<std::string> _queue;
+    size_t _queued;                    // bytes in _queue and being written
+    unsigned long long _dropped;       // bytes never written
+    bool _quit;
+
+    static void *entry(void *arg);
+    void loop();
+    void record(unsigned char type, unsigned int conn, const char *data, size_t len);
+    unsigned int idFor(int fd);
+
+    Capture(const Capture &);
+    Capture &operator=(const Capture &);
+
+  public:
+    Capture();
+    ~Capture();
+
+    bool open(const std::string &path);
+    void close();
+    bool enabled() const { return _fd >= 0; }
+    void flush();
+    size_t queued();
+    unsigned long long dropped();
+
+    void connected(int fd);
+    void received(int fd, const char *data, size_t len);
+    void disconnected(int fd);
+};
+
+#endif
@@ -4,8 +4,12 @@
 #include <string>
 #include <set>
 #include <map>
+#include <ctime>
+#include <vector>
 #include <errno.h>
 
+#include "Mask.hpp"
+
 class Client;
 
 class Channel 
@@ -15,6 +19,8 @@ class Channel
     std::string _topic;
 
     std::map<int, Client*> _members;
+    mutable std::vector<Client*> _memberList; // flat copy for partitioned fanout
+    mutable bool _memberListDirty;
     std::set<int> _operators;          // fds with op status
 
     bool _inviteOnly;                  // +i
@@ -23,9 +29,21 @@ class Channel
     int _userLimit;                    // +l (-1 => unlimited)
 
     std::set<int> _invited;            // fds invited
+    std::set<std::string> _savedOps;   // folded nick!user@host of ops restored from a snapshot
+    time_t _savedOpsUntil;             // they are forgotten after this
+
+    std::vector<std::string> _bans;    // +b masks
+    std::vector<std::string> _excepts; // +e masks
+    mutable MaskMatcher _banMatcher;   // rebuilt lazily after a list change
+    mutable MaskMatcher _exceptMatcher;
+    mutable bool _masksDirty;
+
+    Channel(const Channel &);
+    Channel &operator=(const Channel &);
 
   public:
     Channel(const std::string &name);
+    ~Channel();
 
     void addMember(Client *client);
     void removeMember(int fd);
@@ -41,10 +59,24 @@ class Channel
     void removeOperator(int fd);
     bool isOperator(int fd) const;
 
+    // ops of a previous run, given back to the same nick!user@host rejoining
+    // before the deadline; the host is the resolved (forward-confirmed) name
+    // or the address, so a nick alone does not get them
+    void addSavedOperator(const std::string &mask);
+    bool takeSavedOperator(const std::string &mask, time_t now);
+    // unexpired saved ops left: nobody else is made op meanwhile
+    bool hasSavedOperators(time_t now);
+    const std::set<std::string> &getSavedOperators() const;
+    void setSavedOperatorsUntil(time_t until) { _savedOpsUntil = until; }
+    time_t getSavedOperatorsUntil() const { return _savedOpsUntil; }
+
     const std::map<int, Client*> &getMembers() const;
+    const std::vector<Client*> &getMemberList() const;
 
     void inviteUser(int fd);
     bool isInvited(int fd) const;
+    void forgetFd(int fd);             // the client is gone, its fd may be reused
+    const std::set<int> &getInvited() const;
 
     void setInviteOnly(bool invite);
     void setTopicRestricted(bool restricted);
@@ -58,6 +90,14 @@ class Channel
     const std::string &getKey() const;
     int getUserLimit() const;
     bool isFull() const;
+
+    bool addBan(const std::string &mask);
+    bool removeBan(const std::string &mask);
+    const std::vector<std::string> &getBans() const;
+    bool addExcept(const std::string &mask);
+    bool removeExcept(const std::string &mask);
+    const std::vector<std::string> &getExcepts() const;
+    bool isBanned(const std::string &nickUserHost) const;
 };
 
 #endif
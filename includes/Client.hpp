@@ -2,35 +2,110 @@
 #define CLIENT_HPP
 
 #include <string>
-#include <deque>
+#include <ctime>
+#include "Buffer.hpp"
+#include "WebSocket.hpp"
+#include "Latency.hpp"
 
 class Client 
 {
+  public:
+    enum Capability
+    {
+        CAP_NO_IMPLICIT_NAMES = 1 << 0,  // draft/no-implicit-names
+        CAP_BATCH = 1 << 1,              // batch
+        CAP_SERVER_TIME = 1 << 2,        // server-time
+        CAP_MESSAGE_TAGS = 1 << 3,       // message-tags
+        CAP_CHATHISTORY = 1 << 4         // draft/chathistory
+    };
+
+    // output lanes: control drains first, each lane keeps its own order
+    enum Lane
+    {
+        CONTROL = 0,                     // numerics, PONG, JOIN/PART/KICK/MODE...
+        BULK = 1                         // PRIVMSG chatter
+    };
+
   private:
     int _fd;
 
-    std::string _inbuf;
-    std::deque<std::string> _outq;
+    // both hold a pooled block only while they have data
+    Buffer _inbuf;
+    Buffer _outbuf;                   // CONTROL lane
+    Buffer _bulkbuf;                  // BULK lane
+    size_t _bulkInFlight;             // rest of a half-sent bulk line, goes out before any control
+    Buffer _outStamps;                // a Latency stamp per message queued in _outbuf, same order
+    Buffer _bulkStamps;               // the same for _bulkbuf
+    size_t _sendqMax;                 // cap on queued output, 0 => none
+    bool _sendqExceeded;              // over the cap: output is dropped until the server evicts us
+    bool _readPaused;                 // POLLIN off while our output is backed up
+    time_t _backlogSince;             // when the queue last went from empty to busy
 
+    // short values stay inside the string object (SSO), no heap block
     std::string _nickname;
     std::string _username;
     std::string _realname;
+    std::string _hostname;            // confirmed DNS name, else the address
+    std::string _address;             // numeric peer address, empty for unix sockets
+    std::string _mask;                // nick!user@host, rebuilt whenever one of them changes
 
     bool _passed;
     bool _hasNickname;
     bool _hasUsername;
     bool _registered;                 // after PASS+NICK+USER
 
+    unsigned int _caps;               // Capability bits acked by CAP REQ
+    bool _capNegotiating;             // between CAP LS/REQ and CAP END
+    bool _oper;                       // after a successful OPER
+    bool _resolving;                  // reverse DNS in flight, input waits
+
+    WebSocket *_ws;                   // NULL unless it came in on a "listen ws:" endpoint
+
+    Client(const Client &);
+    Client &operator=(const Client &);
+
+    void stampLane(Buffer &stamps, size_t bytes, const Latency::Stamp &st);
+    void settle(Buffer &stamps, size_t sent);
+    void refreshMask() { _mask = _nickname + "!" + _username + "@" + _hostname; }
+    bool admit();
+    void charge();
+
   public:
     Client(int clientFd);
     ~Client();
 
     void appendToInbuf(const char *data, size_t length);
     std::string popNextCommand();
-    bool hasPendingWrite() const;
-    const std::string &frontWrite() const;
-    void popFrontWrite();
-    void queueWrite(const std::string &msg);
+    bool hasPendingWrite() const { return !_outbuf.empty() || !_bulkbuf.empty(); }
+    size_t pendingBytes() const { return _outbuf.size() + _bulkbuf.size(); }
+    size_t laneBytes(Lane lane) const { return lane == BULK ? _bulkbuf.size() : _outbuf.size(); }
+    void nextWrite(const char *&p, size_t &n) const; // what to send now, never splits a line across lanes
+    void consumeWrite(size_t n);                     // n bytes of nextWrite() were sent
+    // `st` is when the message was produced, a reply is produced now
+    void queueWrite(const std::string &msg, Lane lane = CONTROL) { queueWrite(msg.data(), msg.size(), lane, Latency::stamp(Latency::DIRECT)); }
+    void queueWrite(const char *p, size_t n, Lane lane, const Latency::Stamp &st);
+    void queueUnsent(const char *p, size_t n, Lane lane, const Latency::Stamp &st); // tail of a line whose head went out directly
+    void queueRaw(const std::string &bytes);         // no framing, no latency recorded
+    // messages [first, last) of a batch, `ends` their end offsets in `p`; the
+    // first `from` bytes of message `first` already went out directly
+    void queueBatch(const char *p, const size_t *ends, const Latency::Stamp *st, size_t first, size_t last, size_t from, Lane lane);
+    std::string pendingInput() const { return std::string(_inbuf.data(), _inbuf.size()); }
+    std::string pendingOutput() const;               // both lanes, in the order they would be sent
+    size_t bufferCapacity() const
+    {
+        return _inbuf.capacity() + _outbuf.capacity() + _bulkbuf.capacity() + _outStamps.capacity() + _bulkStamps.capacity();
+    }
+    size_t footprint() const;          // this object plus the heap blocks it owns
+
+    // SendQ: queueing past the cap flags the client and drops the rest of
+    // its output, the loop evicts flagged clients at the end of the iteration
+    void setSendqMax(size_t bytes) { _sendqMax = bytes; }
+    size_t getSendqMax() const { return _sendqMax; }
+    bool sendqExceeded() const { return _sendqExceeded; }
+    void dropOutput();
+    time_t backlogSince() const { return _backlogSince; }
+    bool isReadPaused() const { return _readPaused; }
+    void setReadPaused(bool v) { _readPaused = v; }
 
     int getFd() const;
 
@@ -42,12 +117,37 @@ class Client
     const std::string &getNickname() const { return _nickname; }
     const std::string &getUsername() const { return _username; }
     const std::string &getRealname() const { return _realname; }
+    const std::string &getHostname() const { return _hostname; }
+    const std::string &getMask() const { return _mask; }
+    const std::string &getAddress() const { return _address; }
+    void setAddress(const std::string &address);
+    void setHostname(const std::string &hostname)
+    {
+        _hostname = hostname;
+        refreshMask();
+    }
+    bool isResolving() const { return _resolving; }
+    void setResolving(bool v) { _resolving = v; }
 
     bool hasNick() const { return _hasNickname; }
     bool hasUser() const { return _hasUsername; }
 
     bool isRegistered() const { return _registered; }
     void setRegistered(bool v) { _registered = v; }
+
+    bool hasCap(unsigned int cap) const { return (_caps & cap) != 0; }
+    unsigned int getCaps() const { return _caps; }
+    void setCaps(unsigned int caps) { _caps = caps; }
+    bool isNegotiatingCaps() const { return _capNegotiating; }
+    void setNegotiatingCaps(bool v) { _capNegotiating = v; }
+
+    bool isOper() const { return _oper; }
+    void setOper(bool v) { _oper = v; }
+
+    // output is framed from here on, and takes the control lane only: the
+    // lanes split on LF, which a frame header may contain
+    void startWebSocket() { if (!_ws) _ws = new WebSocket(); }
+    WebSocket *webSocket() const { return _ws; }
 };
 
 #endif
@@ -0,0 +1,27 @@
+#ifndef CONFIG_HPP
+#define CONFIG_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+
+// "key value..." lines, '#' starts a comment, keys may repeat
+class Config
+{
+  private:
+    std::map<std::string, std::vector<std::string> > _values;
+
+  public:
+    Config();
+
+    void load(const std::string &path);
+    void set(const std::string &key, const std::string &value); // replaces every earlier value
+
+    bool has(const std::string &key) const;
+    std::string getString(const std::string &key, const std::string &def) const;
+    long getInt(const std::string &key, long def) const;
+    bool getBool(const std::string &key, bool def) const;
+    const std::vector<std::string> &getAll(const std::string &key) const;
+};
+
+#endif
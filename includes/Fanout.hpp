@@ -0,0 +1,55 @@
+#ifndef FANOUT_HPP
+#define FANOUT_HPP
+
+#include <pthread.h>
+#include <cstddef>
+#include <vector>
+
+// A range of work the pool splits into contiguous chunks. runRange() is
+// called concurrently for disjoint ranges.
+class FanoutJob
+{
+  public:
+    virtual ~FanoutJob() {}
+    virtual void runRange(size_t begin, size_t end) = 0;
+};
+
+// Fork-join worker pool. run() wakes the workers and starts on the job
+// itself; everyone claims chunks until none are left, so the caller never
+// sits idle behind a worker that woke up late or got a slow part. It returns
+// once every chunk is done, at most one chunk after its own last one, so
+// the caller's state is never touched outside a run().
+class Fanout
+{
+  private:
+    std::vector<pthread_t> _threads;
+    pthread_mutex_t _lock;
+    pthread_cond_t _work;              // workers wait here for a generation
+    pthread_cond_t _done;              // run() waits here for _busy == 0
+    unsigned long _generation;
+    size_t _busy;                      // workers inside the current job
+    bool _quit;
+    FanoutJob *_job;                   // NULL once run() stops taking helpers
+    size_t _count;
+    size_t _chunk;
+    size_t _next;                      // first unclaimed index, atomic
+
+    static void *entry(void *arg);
+    void loop();
+    void drain(FanoutJob &job);
+
+    Fanout(const Fanout &);
+    Fanout &operator=(const Fanout &);
+
+  public:
+    Fanout();
+    ~Fanout();
+
+    bool start(size_t threads);        // extra threads besides the caller
+    void stop();
+    size_t threads() const;
+
+    void run(FanoutJob &job, size_t count);
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef FORMAT_HPP
+#define FORMAT_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+// Replies built in place: a Line is a fixed buffer the size of an IRC line
+// (512 bytes with the CRLF), filled without touching the heap and queued
+// with one copy. What does not fit is cut, end() always gets its CRLF in.
+namespace Format
+{
+    static const size_t LINE_MAX = 512;
+
+    // the fixed parts of a numeric, laid out once: ":localhost 366 " and
+    // " :End of /NAMES list"; an open text (" :") is the caller's to fill
+    struct Template
+    {
+        const char *head;
+        size_t headLen;
+        const char *tail;
+        size_t tailLen;
+    };
+
+#define FORMAT_NUMERIC(code, tail) {":localhost " code " ", sizeof(":localhost " code " ") - 1, tail, sizeof(tail) - 1}
+
+    extern const Template RPL_LISTEND;        // 323
+    extern const Template RPL_NOTOPIC;        // 331
+    extern const Template RPL_TOPIC;          // 332, topic follows
+    extern const Template RPL_ENDOFWHO;       // 315
+    extern const Template RPL_ENDOFEXCEPTLIST; // 349
+    extern const Template RPL_ENDOFNAMES;     // 366
+    extern const Template RPL_ENDOFBANLIST;   // 368
+    extern const Template RPL_YOUREOPER;      // 381
+    extern const Template ERR_PASSWDMISMATCH; // 464
+    extern const Template ERR_NOPRIVILEGES;   // 481
+
+    class Line
+    {
+        char _buf[LINE_MAX];
+        size_t _len;
+
+      public:
+        Line() : _len(0) {}
+        // "<head><nick>[ <param>]<tail>", end() still to come
+        Line(const Template &t, const std::string &nick);
+        Line(const Template &t, const std::string &nick, const std::string &param);
+
+        Line &put(const char *p, size_t n)
+        {
+            size_t room = _len < LINE_MAX - 2 ? LINE_MAX - 2 - _len : 0; // the CRLF always fits
+            if (n > room)
+                n = room;
+            std::memcpy(_buf + _len, p, n);
+            _len += n;
+            return *this;
+        }
+        Line &operator<<(const std::string &s) { return put(s.data(), s.size()); }
+        Line &operator<<(const char *s) { return put(s, std::strlen(s)); }
+        Line &operator<<(char ch) { return put(&ch, 1); }
+        Line &operator<<(unsigned long n);
+        Line &end();
+
+        const char *data() const { return _buf; }
+        size_t size() const { return _len; }
+        std::string str() const { return std::string(_buf, _len); }
+    };
+}
+
+#endif
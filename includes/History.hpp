@@ -0,0 +1,116 @@
+#ifndef HISTORY_HPP
+#define HISTORY_HPP
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <ctime>
+
+// Per-channel append-only log, split in fixed size segment files that are
+// memory-mapped. Appending is a memcpy into the mapped active segment, replay
+// reads straight out of the mapped pages.
+//
+// Logs are keyed by the folded channel name. Segments of earlier runs are
+// only listed at open(); their offsets are indexed on demand, newest first,
+// one segment per select() call as a query reaches back that far. Past the
+// newest indexSegments the index is dropped again once a minute. A run
+// never appends to an older run's segment, it starts the next one. Old
+// segments go once a channel holds more than maxBytes of them or they are
+// older than maxAge.
+//
+// At most maxMapped active segments stay mapped; the least recently
+// written one is cut to its size and mapped again on its next append.
+class History
+{
+  public:
+    enum Mode { LATEST, BEFORE, AFTER };
+
+    struct Entry
+    {
+        long long ts;       // ms since epoch
+        unsigned int seg;
+        unsigned int off;   // record offset inside the segment
+    };
+
+    History();
+    ~History();
+
+    // maxBytes 0 => no size cap, maxAge (seconds) 0 => kept forever,
+    // maxMapped / indexSegments 0 => unlimited
+    bool open(const std::string &dir, size_t segmentSize, size_t maxBytes, long maxAge,
+              size_t maxMapped, unsigned int indexSegments);
+    bool enabled() const { return _enabled; }
+
+    void append(const std::string &channel, long long ts, const std::string &line);
+
+    // picks at most `limit` entries, returns how many and the first index.
+    // Indexes at most one older segment per call; `more` => not final yet,
+    // call again (from a later loop iteration)
+    size_t select(const std::string &channel, Mode mode, long long ts, size_t limit, size_t &first, bool &more);
+    // pointer into the mapped segment, valid until the next History call
+    bool fetch(const std::string &channel, size_t idx, const char *&data, size_t &len, long long &ts);
+
+    // the channel is gone: unmap and drop its index, the files stay
+    void forget(const std::string &channel);
+    // age retention and index trimming for every channel, at most once a minute
+    void expire(time_t now);
+
+    static long long now();
+    static std::string formatTime(long long ms);
+    static bool parseTime(const std::string &s, long long &ms);
+
+  private:
+    // segments [first, next) exist on disk
+    struct Range
+    {
+        unsigned int first;
+        unsigned int next;
+    };
+
+    struct Log
+    {
+        std::string base;               // dir/<encoded folded name>
+        Range segs;
+        unsigned int indexedFrom;       // index covers [indexedFrom, segs.next)
+        std::vector<Entry> index;
+        unsigned int seg;               // active segment, mapped while map != NULL
+        char *map;
+        size_t size;
+        size_t used;                    // kept while unmapped, to append to it again
+        std::list<Log*>::iterator lru;  // in _mapped while map != NULL
+    };
+
+    bool _enabled;
+    std::string _dir;
+    size_t _segSize;
+    unsigned int _maxSegments;          // per channel, 0 => unlimited
+    long _maxAge;
+    time_t _lastExpire;
+    size_t _maxMapped;                  // 0 => unlimited
+    unsigned int _indexSegments;        // newest segments kept indexed, 0 => all
+    std::map<std::string, Log*> _logs;  // folded name => open log
+    std::list<Log*> _mapped;            // logs with a mapped segment, least recently written first
+    std::map<std::string, Range> _idle; // encoded name => segments of logs not open
+
+    // last old segment mapped for replay
+    std::string _roPath;
+    char *_roMap;
+    size_t _roSize;
+
+    History(const History &);
+    History &operator=(const History &);
+
+    Log *getLog(const std::string &key, bool create);
+    std::string segmentPath(const std::string &base, unsigned int seg) const;
+    bool mapSegment(Log *log, unsigned int seg, size_t used);
+    void unmapSegment(Log *log);
+    bool indexOlder(Log *log);
+    void trimIndex(Log *log);
+    void dropSegment(Log *log);
+    void expireRange(const std::string &base, Range &segs, unsigned int keep, time_t now);
+    const char *segmentData(Log *log, unsigned int seg, size_t &size);
+    static std::string encodeName(const std::string &channel);
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef LATENCY_HPP
+#define LATENCY_HPP
+
+#include <cstddef>
+
+// Delivery latency per recipient: from the moment a message is produced (a
+// reply, or a channel broadcast) to the send() that hands that copy to the
+// kernel. HDR style log-linear histograms, 16 buckets per power of two
+// (about 6% precision) up to ~36 minutes, one per size class; STATS L reads
+// them. Counters are atomic, fanout workers record too.
+namespace Latency
+{
+    enum Class
+    {
+        DIRECT,                          // replies and private messages
+        CHAN_1,                          // channel broadcasts by member count: 1-9
+        CHAN_10,                         // 10-99
+        CHAN_100,                        // 100-999
+        CHAN_1000,                       // 1000-9999
+        CHAN_10000,                      // 10000 and up
+        CLASSES,
+        NONE = CLASSES                   // bytes nobody waits for (handshakes, restored output)
+    };
+
+    struct Stamp
+    {
+        unsigned long long ns;
+        unsigned int cls;
+    };
+
+    static const size_t BUCKETS = 16 + 37 * 16;
+
+    struct Summary
+    {
+        unsigned long long count;
+        unsigned long long sumNs;
+        unsigned long long maxNs;
+        unsigned long long p50, p90, p99, p999; // ns, upper edge of the bucket
+    };
+
+    void setEnabled(bool on);            // config latency_stamps, before any client exists
+    bool enabled();
+    unsigned long long now();            // CLOCK_MONOTONIC, ns
+    Class classFor(size_t members);
+    Stamp stamp(Class c);                // now, for messages about to be queued
+
+    size_t bucketOf(unsigned long long ns);
+    void record(unsigned int cls, unsigned long long ns, unsigned long long copies = 1);
+    Summary summary(Class c);            // CLASSES => all classes together
+    const char *name(Class c);
+    void reset();
+
+    // records of one class, folded into one atomic add per run of equal
+    // buckets; copies sent in order have close latencies
+    class Batch
+    {
+        unsigned int _cls;
+        size_t _bucket;
+        unsigned long long _maxNs;
+        unsigned long long _sumNs;
+        unsigned long long _n;
+
+        Batch(const Batch &);
+        Batch &operator=(const Batch &);
+
+      public:
+        explicit Batch(unsigned int cls) : _cls(cls), _bucket(0), _maxNs(0), _sumNs(0), _n(0) {}
+        ~Batch() { flush(); }
+        void add(unsigned long long ns);
+        void flush();
+    };
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef MASK_HPP
+#define MASK_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+// glob match with '*' and '?', case-insensitive
+bool maskMatch(const std::string &mask, const std::string &str);
+
+// A set of masks compiled once and matched in a single pass over the subject.
+// Masks without wildcards go to a literal bucket. The others share one trie
+// where '*' is a self-looping node, walked as an NFA, so common prefixes
+// ("*!*@spam.*", "*!*@spam.net") are only scanned once. A mask ending in '*'
+// accepts as soon as its prefix is reached.
+class MaskMatcher
+{
+  public:
+    MaskMatcher();
+
+    void build(const std::vector<std::string> &masks);
+    bool matches(const std::string &subject) const;
+    bool empty() const { return _literals.empty() && _nodes.size() <= 1; }
+
+  private:
+    struct Node
+    {
+        std::map<char, int> next;   // literal edges
+        int any;                    // '?' edge, -1 => none
+        int star;                   // '*' edge, -1 => none
+        bool isStar;                // reached through '*', loops on any char
+        bool accept;
+        bool acceptRest;            // mask ended with '*'
+    };
+
+    std::set<std::string> _literals;
+    std::vector<Node> _nodes;
+
+    // scratch space for the NFA walk
+    mutable std::vector<int> _cur;
+    mutable std::vector<int> _nxt;
+    mutable std::vector<unsigned int> _seen;
+    mutable unsigned int _gen;
+
+    int newNode(bool isStar);
+    void insert(const std::string &mask);
+    void nextGeneration() const;
+    bool addState(int n, std::vector<int> &set) const;
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef PLUGINS_HPP
+#define PLUGINS_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "ircserv_plugin.h"
+
+// Loaded plugins and their hooks. Every hook keeps its own call count and
+// time spent, reported by STATS P.
+class Plugins
+{
+  public:
+    struct Hook
+    {
+        ircserv_hook fn;
+        void *ctx;
+        size_t plugin;                 // index in _names
+        std::string cmd;
+        int when;
+        unsigned long long calls;
+        unsigned long long drops;
+        unsigned long long totalNs;
+        unsigned long long maxNs;
+    };
+
+  private:
+    std::vector<void *> _handles;
+    std::vector<std::string> _names;
+    std::vector<Hook> _hooks;
+    std::map<std::string, std::vector<size_t> > _byCmd[2]; // [when] cmd => hooks, "*" included
+    size_t _loading;                   // plugin whose init is running
+
+    Plugins(const Plugins &);
+    Plugins &operator=(const Plugins &);
+
+  public:
+    Plugins();
+    ~Plugins();
+
+    bool load(const std::string &path, const ircserv_host *host);
+    void unloadAll();
+    bool empty() const;
+
+    int addHook(const char *cmd, int when, ircserv_hook fn, void *ctx);
+    // false when a BEFORE hook dropped the message
+    bool run(int when, const ircserv_msg &msg);
+
+    const std::vector<Hook> &getHooks() const;
+    const std::string &getName(size_t plugin) const;
+};
+
+#endif
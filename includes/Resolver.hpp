@@ -0,0 +1,124 @@
+#ifndef RESOLVER_HPP
+#define RESOLVER_HPP
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <ctime>
+#include <cstddef>
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+// Reverse DNS with forward confirmation, off the loop thread. Workers do
+// the blocking part and wake the loop through a pipe; everything else
+// (the cache, who waits for what, deadlines) belongs to the loop thread and
+// takes no lock. A name only counts if it resolves back to the address.
+// The workers are detached: stop() waits for them a bounded time, one stuck
+// in the system resolver finishes on its own and frees what it shares.
+class Resolver
+{
+  public:
+    struct Answer
+    {
+        int fd;
+        std::string addr;
+        std::string host;              // empty: no confirmed name, or timed out
+    };
+
+    static const size_t MAX_QUEUE = 1024; // beyond this a connection is not looked up
+
+  private:
+    struct CacheEntry
+    {
+        std::string host;
+        time_t expires;
+        std::list<std::string>::iterator lru;
+    };
+    struct Waiter
+    {
+        int fd;
+        unsigned long seq;
+    };
+    struct Deadline
+    {
+        long long atMs;
+        int fd;
+        unsigned long seq;
+        std::string addr;
+    };
+    // what the workers touch, under lock; freed by the last of the Resolver
+    // and its workers to let go of it
+    struct Shared
+    {
+        pthread_mutex_t lock;
+        pthread_cond_t work;
+        pthread_cond_t exited;
+        std::deque<std::string> queue;
+        std::vector<std::pair<std::string, std::string> > done; // addr => host
+        volatile size_t ready;         // done.size(), readable without the lock
+        bool quit;
+        size_t running;                // workers not yet gone
+        size_t refs;                   // running + the Resolver until stop()
+        int pipe[2];                   // wakes the loop, a byte per batch of answers
+        int random;                    // /dev/urandom, for query IDs and ports
+        sockaddr_storage server;       // dns_server, serverLen 0 => system resolver
+        socklen_t serverLen;
+        int timeoutMs;
+    };
+
+    // loop thread
+    std::map<std::string, CacheEntry> _cache;
+    std::list<std::string> _lru;       // most recently used first
+    size_t _cacheMax;
+    int _ttl;
+    int _negativeTtl;                  // for addresses without a confirmed name
+    // addr => waiters; stays, possibly empty, until the worker answers so
+    // a later connection joins the lookup in flight instead of repeating it
+    std::map<std::string, std::vector<Waiter> > _waiting;
+    std::deque<Deadline> _deadlines;   // in submit order, so also in deadline order
+    unsigned long _seq;
+    int _timeoutMs;
+    unsigned long long _hits;
+    unsigned long long _misses;
+
+    Shared *_shared;                   // NULL when not started
+
+    static void *entry(void *arg);
+    static void loop(Shared *s);
+    static void release(Shared *s);
+    static std::string resolve(const Shared &s, const std::string &addr);
+    static std::string resolveSystem(const std::string &addr);
+    static std::string resolveServer(const Shared &s, const std::string &addr);
+    static bool query(const Shared &s, const std::string &name, unsigned short type, std::string &reply);
+    void remember(const std::string &addr, const std::string &host, time_t now);
+
+    Resolver(const Resolver &);
+    Resolver &operator=(const Resolver &);
+
+  public:
+    Resolver();
+    ~Resolver();
+
+    // `server` is "" for the system resolver or addr[:port] of a DNS server
+    bool start(size_t threads, const std::string &server, int timeoutMs);
+    void stop();
+    bool running() const { return _shared != NULL; }
+    int wakeFd() const { return _shared ? _shared->pipe[0] : -1; }
+    void configureCache(size_t entries, int ttlSecs, int negativeTtlSecs);
+
+    // true if answered now (cache, or no room to queue), false if `fd`
+    // will get an Answer from collect()
+    bool lookup(int fd, const std::string &addr, std::string &host);
+    // finished lookups and expired waits
+    void collect(std::vector<Answer> &out);
+    // ms until the next wait expires, -1 if nobody waits
+    int nextDeadlineMs() const;
+
+    size_t cacheSize() const { return _cache.size(); }
+    unsigned long long hits() const { return _hits; }
+    unsigned long long misses() const { return _misses; }
+};
+
+#endif
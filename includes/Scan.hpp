@@ -0,0 +1,35 @@
+#ifndef SCAN_HPP
+#define SCAN_HPP
+
+#include <string>
+#include <cstddef>
+
+// Byte scanning kernels for the protocol hot paths. Every kernel has a scalar
+// version plus SSE2/AVX2 ones on x86; Scan::init() picks the widest level the
+// CPU supports, after checking it agrees with the scalar code.
+namespace Scan
+{
+    enum Level { SCALAR = 0, SSE2 = 1, AVX2 = 2 };
+
+    // `cap` limits the level (config scan_level), returns the level in use
+    Level init(Level cap);
+    Level level();
+    const char *levelName(Level l);
+
+    // index of the first `c` in p[0..n), n if absent
+    size_t findByte(const char *p, size_t n, char c);
+    // index of the first '\n', n if absent
+    size_t findNewline(const char *p, size_t n);
+    // 0x21..0x7E except ','
+    bool validNick(const char *p, size_t n);
+    // no NUL, BEL, CR, LF, space, ',' or ':'
+    bool validChannelChars(const char *p, size_t n);
+    // RFC 1459 casemapping, A-Z[\]^ => a-z{|}~, in place
+    void foldCase(char *p, size_t n);
+    // XOR with a repeating 4 byte key, key[0] on p[0] (WebSocket masking)
+    void xorMask(char *p, size_t n, const unsigned char key[4]);
+
+    std::string folded(const std::string &s);
+}
+
+#endif
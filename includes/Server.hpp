@@ -3,66 +3,262 @@
 
 #include <string>
 #include <vector>
+#include <deque>
 #include <map>
 #include <set>
 #include <poll.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <cstring>
 #include <cstdlib>
+#include <cerrno>
+#include <ctime>
+#include <csignal>
 #include <iostream>
 #include <sstream>
 
 #include "Channel.hpp"
 #include "Client.hpp"
+#include "Config.hpp"
+#include "History.hpp"
+#include "Snapshot.hpp"
+#include "Mask.hpp"
+#include "Scan.hpp"
+#include "Fanout.hpp"
+#include "Plugins.hpp"
+#include "Capture.hpp"
+#include "Transport.hpp"
+#include "Sketch.hpp"
+#include "Accounting.hpp"
+#include "Resolver.hpp"
+#include "Latency.hpp"
+#include "Format.hpp"
 
 class Server 
 {
   public:
-    Server(int port, const std::string &password);
+    Server(int port, const std::string &password, const Config &config, Transport *io = NULL);
     ~Server();
 
     void run();
     void stop();
+    // run() is start() then step() until it returns false; drivers of an
+    // in-memory transport call them directly
+    void start();
+    bool step(int maxWaitMs);
+
+    void setUpgradeCommand(char **argv);
+    void requestUpgrade();
+    void requestStop(int sig);
 
   private:
+    // an accepting socket: the main port or one of the config "listen" lines
+    struct Listener
+    {
+        int fd;
+        std::string spec;                  // as written in the config
+        std::string unixPath;              // unlinked on shutdown, empty for TCP
+        bool webSocket;                    // "ws:" spec, clients speak RFC 6455
+    };
+
+    // LIST/WHO/CHATHISTORY in progress, resumed a chunk at a time from the loop
+    struct ListCursor
+    {
+        enum Kind { LIST, WHO_CHANNEL, WHO_MASK, HISTORY };
+        Kind kind;
+        std::string target;                // WHO channel or mask, CHATHISTORY channel
+        std::string lastName;              // last channel / nick emitted
+        int lastFd;                        // last member emitted (WHO #chan)
+        bool started;
+        int minUsers;                      // LIST >n, -1 => none
+        int maxUsers;                      // LIST <n, -1 => none
+        std::vector<std::string> masks;    // LIST channel masks
+        std::string topicMask;             // LIST T:mask
+        History::Mode mode;                // CHATHISTORY
+        long long ts;
+        size_t limit;
+    };
+
     int _port;
     std::string _password;
 
+    Config _config;
+
+    SocketTransport _sockets;
+    Transport *_io;                    // _sockets unless a driver passed its own
     int _serverFd;
+    std::vector<Listener> _listeners;  // every accepting socket, _serverFd included
     bool _running;
 
     std::vector<pollfd> _pollFds;
+    std::vector<int> _pollIndex;       // fd => slot in _pollFds, -1 if none
+    size_t _pollHoles;                 // removed slots (fd -1) not compacted yet
     std::map<int, Client*> _clients;
     std::map<std::string, Channel*> _channels;
     std::map<std::string, Client*> _nicks;
 
+    History _history;
+    unsigned long _batchSeq;
+
+    std::string _snapshotPath;
+    int _snapshotInterval;             // seconds, 0 => only on shutdown
+    time_t _lastSnapshot;
+    pid_t _snapshotPid;                // child writing the current snapshot
+    bool _snapshotDirty;
+    std::set<std::string> _restored;   // channels holding saved ops, see expireRestored()
+    time_t _restoredUntil;             // earliest saved op deadline among them
+
+    std::string _execPath;
+    std::vector<std::string> _execArgs;
+    volatile sig_atomic_t _upgradeRequested;
+    volatile sig_atomic_t _stopRequested;   // signal number, 0 while running
+    int _signalPipe[2];                // a byte per signal, so poll() wakes for a flag set just before it
+
+    std::map<int, std::deque<ListCursor> > _cursors; // per client, run one after the other
+    size_t _cursorChunk;               // entries per loop iteration
+    size_t _cursorBacklog;             // pause while _outq holds more than this
+
+    size_t _maxListEntries;            // +b/+e entries per channel
+
+    Fanout _fanout;
+    size_t _fanoutThreshold;           // members before a broadcast goes to the pool
+
+    // channel PRIVMSGs of one loop iteration, fanned out per channel and lane
+    // by flushBroadcasts(): one pass over the members and one append per
+    // member instead of one per message. Anything that could reorder them
+    // (other commands, membership changes) flushes first.
+    struct Coalesced
+    {
+        Channel *ch;
+        Client::Lane lane;
+        std::string bytes;
+        std::vector<size_t> ends;          // end of each message in bytes
+        std::vector<int> senders;          // the fd each message skips
+        std::vector<Latency::Stamp> stamps;
+    };
+    bool _coalesce;                    // config coalesce_fanout
+    std::vector<Coalesced> _coalesced;
+    std::map<std::pair<Channel *, int>, size_t> _coalescedIndex; // (channel, lane) => slot
+    std::set<int> _coalescedSenders;
+    unsigned long long _coalescedMsgs; // STATS Q
+    unsigned long long _coalescedPasses;
+
+    HeavyHitters _hotChannels;         // fanout bytes per channel, STATS H
+    HeavyHitters _hotSenders;          // fanout bytes caused per nick
+
+    // MONITOR, see Monitor.cpp
+    std::map<std::string, std::set<Client *> > _watchers;                  // folded nick => watchers
+    std::map<int, std::map<std::string, std::string> > _monitoring;        // fd => folded => as given
+    size_t _monitorLimit;
+
+    Resolver _resolver;                // reverse DNS, not started with dns_lookups 0
+
+    Capture _capture;                  // inbound bytes for tools/replay, off unless capture_file
+
+    bool _busyPoll;                    // latency mode, see BusyPoll.cpp
+    unsigned long long _busyIdleNs;    // spin this long after the last event
+    unsigned long long _lastEventNs;
+    int _busySocketUs;                 // SO_BUSY_POLL value, 0 => not set
+
+    // SendQ limits, see SendQ.cpp
+    size_t _sendq;                     // per client default, 0 => unlimited
+    size_t _sendqOper;                 // for opers, 0 => the class/default
+    std::vector<std::pair<std::string, size_t> > _sendqClasses; // mask => bytes, first match wins
+    size_t _sendqPause;                // reads pause above this much queued output
+    size_t _sendqTotal;                // buffer memory before the worst backlogs go
+    unsigned long _sendqOverflows;     // clients flagged since the last enforceSendq(), workers add too
+    unsigned long long _sendqEvictions;
+    unsigned long long _pressureEvictions;
+
+    Plugins _plugins;
+    ircserv_host _pluginHost;
+
+    void loadPlugins();
+    static int pluginAddHook(void *server, const char *cmd, int when, ircserv_hook fn, void *ctx);
+    static int pluginSendFd(void *server, int fd, const char *line, size_t len);
+    static int pluginSendNick(void *server, const char *nick, const char *line, size_t len);
+    static int pluginSendChannel(void *server, const char *chan, const char *line, size_t len, int excludeFd);
+    static void pluginLog(void *server, const char *text);
+
     void setupServer();
+    void setupListeners();
+    bool openListener(const std::string &spec);
+    bool isListener(int fd) const;
+    bool isWebSocketListener(int fd) const;
+    static bool isWebSocketSpec(const std::string &spec);
+    void loadSnapshot();
+    void periodic();
+    void noteRestored(const std::string &key, time_t until);
+    void expireRestored(time_t now);
+    void setupBusyPoll();
+    void setupSendq();
+    void applySendq(Client *c);
+    void enforceSendq();
+    void evictClient(Client *c, const std::string &reason);
+    int busyPollTimeout(int timeout);
+    void busyPollEvents(int ready);
+    void tuneSocket(int fd);
+    void startSnapshot();
+
+    void performUpgrade();
+    bool resumeUpgrade();
+    std::string serializeState(std::vector<int> &fds);
+    bool restoreState(const std::string &blob, const std::vector<int> &fds);
     static void setNonBlocking(int fd);
     void serverNotice(Client *c, const std::string &msg);
 
     void addPollFd(int fd, short events);
     void modPollEvents(int fd, short eventsAdd, short eventsRemove);
     void removePollFd(int fd);
+    void compactPollFds();
+    void wakeLoop();
 
-    void acceptNewClient();
+    void acceptNewClient(int listenFd);
     void handleClientReadable(int fd);
     void handleClientWritable(int fd);
+    bool receiveWebSocket(Client *c, const char *data, size_t length);
+    void lookupHost(Client *c);
+    void handleResolved();
     void disconnectClient(int fd, const std::string &reason);
 
     void processClientCommands(Client *c);
     static void splitCommand(const std::string &line, std::string &cmd, std::string &args);
+    static std::vector<std::string> splitList(const std::string &list);
 
-    void reply(Client *c, const std::string &msg);
+    void reply(Client *c, const std::string &msg, Client::Lane lane = Client::CONTROL);
+    void reply(Client *c, const std::string &msg, Client::Lane lane, const Latency::Stamp &st);
+    void reply(Client *c, const Format::Line &line, Client::Lane lane = Client::CONTROL);
     void outputMessage(Client *c, const std::string &msg);
     void welcomeIfReady(Client *c);
 
     void ensureChannelHasOperator(Channel *ch);
-    void channelBroadcast(Channel *ch, const std::string &msg, int excludeFd);
+    void channelBroadcast(Channel *ch, const char *msg, size_t len, int excludeFd, Client::Lane lane = Client::CONTROL);
+    void channelBroadcast(Channel *ch, const std::string &msg, int excludeFd, Client::Lane lane = Client::CONTROL)
+    {
+        channelBroadcast(ch, msg.data(), msg.size(), excludeFd, lane);
+    }
+    void channelBroadcast(Channel *ch, const Format::Line &line, int excludeFd, Client::Lane lane = Client::CONTROL)
+    {
+        channelBroadcast(ch, line.data(), line.size(), excludeFd, lane);
+    }
+    void channelMessage(Channel *ch, const Format::Line &line, int excludeFd, Client::Lane lane);
+    void flushBroadcasts();
+    void fanOut(Channel *ch, const char *bytes, const size_t *ends, const int *senders, const Latency::Stamp *stamps,
+                size_t count, Client::Lane lane);
 
     Client* findByNick(const std::string &nick);
+    Channel* findChannel(const std::string &name);
+    static std::string normalizeMask(const std::string &mask);
+    void sendMaskList(Client *c, Channel *ch, char mode);
+
+    void joinChannel(Client *c, const std::string &chan, const std::string &key);
+    void partChannel(Client *c, const std::string &chan);
+    void deliverPrivmsg(Client *c, const std::string &target, const std::string &text);
+    void kickFromChannel(Client *c, const std::string &chan, const std::string &nick);
+    void sendNames(Client *c, Channel *ch);
 
     void handlePASS(Client *c, const std::string &args);
     void handleNICK(Client *c, const std::string &args);
@@ -76,6 +272,28 @@ class Server
     void handleINVITE(Client *c, const std::string &args);
     void handleTOPIC(Client *c, const std::string &args);
     void handleMODE(Client *c, const std::string &args);
+    void handleCHATHISTORY(Client *c, const std::string &args);
+    void handleCAP(Client *c, const std::string &args);
+    void handleNAMES(Client *c, const std::string &args);
+    void handleLIST(Client *c, const std::string &args);
+    void handleWHO(Client *c, const std::string &args);
+    void handleOPER(Client *c, const std::string &args);
+    void handleSTATS(Client *c, const std::string &args);
+    void handleMONITOR(Client *c, const std::string &args);
+
+    bool addMonitor(Client *c, const std::string &target);
+    void removeMonitor(Client *c, const std::string &key);
+    void clearMonitors(Client *c);
+    void monitorPresence(Client *who, const std::string &nick, bool online);
+
+    void queueCursor(Client *c, const ListCursor &cur, const char *cmd);
+    bool hasRunnableCursor() const;
+    void pumpCursors();
+    bool stepCursor(Client *c, ListCursor &cur);
+    bool stepHistory(Client *c, const ListCursor &cur);
+    bool listMatches(const ListCursor &cur, const Channel *ch) const;
+    void sendListEntry(Client *c, const Channel *ch);
+    void sendWhoEntry(Client *c, const std::string &chan, Client *who, bool op);
 };
 
 #endif
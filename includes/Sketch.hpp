@@ -0,0 +1,68 @@
+#ifndef SKETCH_HPP
+#define SKETCH_HPP
+
+#include <string>
+#include <vector>
+#include <ctime>
+#include <cstddef>
+
+// Heavy hitters over a sliding window, in fixed memory: a count-min sketch
+// per time bucket, their running sum, and the top keys by bytes. The window
+// moves in tick(), never in add(). add() samples: about one call in
+// `sample` is counted, scaled up by `sample`, and the others cost a
+// decrement. Estimates are then within sampling error instead of upper
+// bounds; sample 1 counts every call and never underestimates.
+class HeavyHitters
+{
+  public:
+    static const size_t DEPTH = 4;
+    static const size_t WIDTH_BITS = 10;
+    static const size_t WIDTH = (size_t)1 << WIDTH_BITS;
+    static const size_t BUCKETS = 6;   // the window slides a bucket at a time
+
+    struct Entry
+    {
+        unsigned long long hash;
+        std::string key;               // as first seen
+        unsigned int msgs;             // window estimates
+        unsigned long long bytes;
+    };
+
+  private:
+    struct Cell
+    {
+        unsigned long long bytes;
+        unsigned long long msgs;
+    };
+
+    // [row][column][bucket]: a key's buckets share cache lines, and slot
+    // BUCKETS holds the sum of the others
+    std::vector<Cell> _cells;
+    size_t _current;
+    time_t _bucketStart;
+    int _bucketSecs;
+    size_t _maxTop;
+    std::vector<Entry> _top;           // unordered, at most _maxTop
+    unsigned int _sample;              // count about 1 add() in _sample
+    unsigned int _skip;                // add() calls until the next counted one
+    unsigned int _rng;                 // xorshift state for the gaps
+
+    void record(const char *key, size_t len, unsigned long long msgs, unsigned long long bytes);
+
+    static size_t column(size_t row, unsigned long long hash);
+    void estimate(unsigned long long hash, unsigned int &msgs, unsigned long long &bytes) const;
+    void rotate();
+
+  public:
+    HeavyHitters();
+
+    void configure(size_t top, int windowSecs, unsigned int sample);
+    // one message from/to `key` that cost `bytes` of fanout; case-insensitive
+    void add(const char *key, size_t len, unsigned long long bytes);
+    void tick(time_t now);
+    std::vector<Entry> top() const;    // heaviest first
+    int windowSecs() const { return _bucketSecs * (int)BUCKETS; }
+    unsigned int sample() const { return _sample; }
+};
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <string>
+#include <map>
+
+class Channel;
+
+// Compact binary image of the channel registry (topic, key, +i/+t/+l, +b/+e
+// and operator masks). Written to <path>.tmp then renamed, loaded through mmap.
+class Snapshot
+{
+  public:
+    static bool write(const std::string &path, const std::map<std::string, Channel*> &channels);
+    static bool load(const std::string &path, std::map<std::string, Channel*> &channels);
+};
+
+#endif
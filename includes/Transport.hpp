@@ -0,0 +1,87 @@
+#ifndef TRANSPORT_HPP
+#define TRANSPORT_HPP
+
+#include <poll.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+// Everything Server does to a connection goes through a Transport. Listening
+// sockets are still opened directly, accept() only receives their fd.
+// send() may be called from fanout workers, for disjoint fds at a time.
+class Transport
+{
+  public:
+    virtual ~Transport() {}
+
+    virtual int poll(pollfd *fds, size_t n, int timeoutMs) = 0;
+    virtual int accept(int listenFd) = 0;          // -1 with errno EAGAIN when none is waiting
+    virtual ssize_t recv(int fd, char *buf, size_t len) = 0;
+    virtual ssize_t send(int fd, const char *buf, size_t len) = 0;
+    virtual void close(int fd) = 0;
+    virtual std::string peerAddress(int fd) = 0;   // numeric, "" if it has none (unix sockets)
+};
+
+// The kernel: poll(2), accept(2), recv(2), send(2), close(2).
+class SocketTransport : public Transport
+{
+  public:
+    int poll(pollfd *fds, size_t n, int timeoutMs);
+    int accept(int listenFd);
+    ssize_t recv(int fd, char *buf, size_t len);
+    ssize_t send(int fd, const char *buf, size_t len);
+    void close(int fd);
+    std::string peerAddress(int fd);
+};
+
+// Connections that only exist in memory, for benchmarks and tests: the
+// driver injects client bytes and reads back what the server wrote. poll()
+// never blocks. Its fds start at FIRST_FD so they never clash with the real
+// listening sockets; any fd it does not know counts as a listener.
+class MemoryTransport : public Transport
+{
+  public:
+    static const int FIRST_FD = 1 << 20;
+
+  private:
+    struct Conn
+    {
+        std::string in;                // injected, not read by the server yet
+        std::string out;               // written by the server
+        bool hungUp;                   // the client side closed
+        bool closed;                   // the server side closed
+        size_t window;                 // max bytes in out before send() blocks, 0 = no limit
+        std::string peer;              // what peerAddress() reports
+    };
+
+    std::vector<Conn> _conns;          // fd - FIRST_FD, fds are never reused
+    std::deque<int> _acceptQueue;      // connected, not accepted yet
+    int _nextFd;
+    size_t _unread;                    // injected bytes the server has not read
+
+    Conn *find(int fd);
+    const Conn *find(int fd) const;
+
+  public:
+    MemoryTransport();
+
+    int poll(pollfd *fds, size_t n, int timeoutMs);
+    int accept(int listenFd);
+    ssize_t recv(int fd, char *buf, size_t len);
+    ssize_t send(int fd, const char *buf, size_t len);
+    void close(int fd);
+    std::string peerAddress(int fd);
+
+    // driver side
+    int connect(const std::string &peer = "");     // fd the server will get from accept()
+    void inject(int fd, const std::string &bytes);
+    void hangUp(int fd);
+    void setWindow(int fd, size_t bytes);          // simulate a slow reader, take() makes room
+    std::string take(int fd);                      // output so far, cleared
+    size_t outputSize(int fd) const;
+    bool isClosed(int fd) const;
+    size_t unread() const { return _unread + _acceptQueue.size(); }
+};
+
+#endif
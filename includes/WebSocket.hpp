@@ -0,0 +1,52 @@
+#ifndef WEBSOCKET_HPP
+#define WEBSOCKET_HPP
+
+#include <string>
+#include <cstddef>
+
+class Buffer;
+
+// Server side of RFC 6455 for IRC over WebSocket (ircv3): the HTTP upgrade,
+// then one IRC line per message in both directions, without CRLF. Only
+// clients of a "listen ws:" endpoint have one.
+class WebSocket
+{
+  public:
+    enum Flags                         // state() bits, also what an upgrade carries
+    {
+        OPEN = 1 << 0,                 // handshake done
+        BINARY = 1 << 1,               // binary.ircv3.net, frames go out as binary
+        FRAGMENTED = 1 << 2            // inside a fragmented message
+    };
+
+    static const size_t MAX_MESSAGE = 16 * 1024;
+    static const size_t MAX_HANDSHAKE = 8 * 1024;
+
+  private:
+    unsigned int _state;
+    std::string _raw;                  // handshake or frame bytes not decoded yet
+    std::string _message;              // fragments of the current message
+
+    bool handshake(std::string &reply);
+    bool decode(std::string &text, std::string &reply);
+
+  public:
+    WebSocket() : _state(0) {}
+
+    // bytes off the socket: IRC lines (CRLF terminated) go to `text`, what
+    // has to go back raw (101, pongs, close) to `reply`. false => close the
+    // connection once `reply` is out
+    bool receive(const char *p, size_t n, std::string &text, std::string &reply);
+    // one frame per line of p[0..n), CR/LF dropped
+    void frame(const char *p, size_t n, Buffer &out) const;
+
+    unsigned int state() const { return _state; }
+    const std::string &unread() const { return _raw; }
+    const std::string &partial() const { return _message; }
+    void restore(unsigned int state, const std::string &unread, const std::string &partial);
+    size_t footprint() const;
+
+    static std::string closeFrame(unsigned short code);
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef IRCSERV_PLUGIN_H
+#define IRCSERV_PLUGIN_H
+
+/*
+ * ircserv plugin ABI. A plugin is a shared object listed with a
+ * "plugin <path>" config line. It exports ircserv_plugin_init(), which gets
+ * the host table and registers its hooks, and optionally
+ * ircserv_plugin_fini(), called before it is unloaded.
+ *
+ * Hooks run on the loop thread, before and after the server handles a
+ * command. The message fields point into the server's own buffers: they are
+ * not NUL terminated and are only valid during the call. A BEFORE hook
+ * returning IRCSERV_DROP stops the command, the handler and the remaining
+ * hooks are skipped. The return value of AFTER hooks is ignored.
+ *
+ * Only append fields at the end of these structs and bump
+ * IRCSERV_PLUGIN_ABI when an existing field changes meaning.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IRCSERV_PLUGIN_ABI 1
+
+enum
+{
+    IRCSERV_BEFORE = 0,
+    IRCSERV_AFTER = 1
+};
+
+enum
+{
+    IRCSERV_CONTINUE = 0,
+    IRCSERV_DROP = 1
+};
+
+typedef struct ircserv_msg
+{
+    int fd;                  /* connection the command came from */
+    const char *nick;        /* sender nick, may be empty before NICK */
+    size_t nick_len;
+    const char *cmd;         /* "PRIVMSG" */
+    size_t cmd_len;
+    const char *args;        /* everything after the command */
+    size_t args_len;
+} ircserv_msg;
+
+typedef int (*ircserv_hook)(void *ctx, const ircserv_msg *msg);
+
+typedef struct ircserv_host
+{
+    unsigned int abi;        /* IRCSERV_PLUGIN_ABI of the server */
+    void *server;            /* pass back as the first argument below */
+
+    /* cmd is a command name or "*" for every command, returns 0 on success */
+    int (*add_hook)(void *server, const char *cmd, int when, ircserv_hook fn, void *ctx);
+
+    /* line must be a full IRC line including "\r\n", returns 0 on success */
+    int (*send_fd)(void *server, int fd, const char *line, size_t len);
+    int (*send_nick)(void *server, const char *nick, const char *line, size_t len);
+    int (*send_channel)(void *server, const char *chan, const char *line, size_t len, int exclude_fd);
+
+    void (*log)(void *server, const char *text);
+} ircserv_host;
+
+/* returns 0 on success, anything else unloads the plugin */
+typedef int (*ircserv_plugin_init_fn)(const ircserv_host *host);
+typedef void (*ircserv_plugin_fini_fn)(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,61 @@
+#include "Accounting.hpp"
+
+namespace
+{
+    Accounting::Counters g_counters[Accounting::SUBSYSTEMS];
+}
+
+void Accounting::allocated(Subsystem s, size_t bytes)
+{
+    Counters &c = g_counters[s];
+    __sync_fetch_and_add(&c.live, 1L);
+    __sync_fetch_and_add(&c.liveBytes, (long)bytes);
+    __sync_fetch_and_add(&c.allocs, 1ULL);
+}
+
+void Accounting::freed(Subsystem s, size_t bytes)
+{
+    Counters &c = g_counters[s];
+    __sync_fetch_and_sub(&c.live, 1L);
+    __sync_fetch_and_sub(&c.liveBytes, (long)bytes);
+    __sync_fetch_and_add(&c.frees, 1ULL);
+}
+
+Accounting::Counters Accounting::get(Subsystem s)
+{
+    Counters c;
+    c.live = __sync_fetch_and_add(&g_counters[s].live, 0L);
+    c.liveBytes = __sync_fetch_and_add(&g_counters[s].liveBytes, 0L);
+    c.allocs = __sync_fetch_and_add(&g_counters[s].allocs, 0ULL);
+    c.frees = __sync_fetch_and_add(&g_counters[s].frees, 0ULL);
+    return c;
+}
+
+const char *Accounting::name(Subsystem s)
+{
+    static const char *names[SUBSYSTEMS] = {"client", "channel", "buffer", "parse"};
+    return s < SUBSYSTEMS ? names[s] : "?";
+}
+
+size_t Accounting::heapBytes(const std::string &s)
+{
+    const char *p = s.data();
+    const char *self = reinterpret_cast<const char *>(&s);
+    return (p >= self && p < self + sizeof(s)) ? 0 : s.capacity() + 1;
+}
+
+void Accounting::Scope::add(const std::string &s)
+{
+    size_t bytes = heapBytes(s);
+    if (!bytes)
+        return;
+    allocated(_s, bytes);
+    _bytes += bytes;
+    ++_count;
+}
+
+Accounting::Scope::~Scope()
+{
+    for (size_t i = 0; i < _count; ++i)
+        freed(_s, i + 1 < _count ? 0 : _bytes);
+}
@@ -0,0 +1,273 @@
+#include "Buffer.hpp"
+#include "Accounting.hpp"
+#include <pthread.h>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+namespace
+{
+    const size_t CLASSES = 9;          // 256 B .. 64 KiB
+    const size_t CACHE_BLOCKS = 16;    // per thread and class, beyond it half goes back
+    const size_t CACHE_BYTES = 256 * 1024; // per thread, same
+    const size_t REFILL = 8;           // blocks taken from the shared lists at once
+
+    // blocks and counters of one thread, touched without g_lock by their
+    // owner: fanout workers queueing output to thousands of members no
+    // longer take turns on a mutex for every buffer. Counters are deltas,
+    // a block may be acquired on one thread and released on another.
+    struct Cache
+    {
+        std::vector<char *> free[CLASSES];
+        long inUse;
+        long inUseBytes;
+        long idle;
+        long idleBytes;
+        unsigned long long hits;
+        unsigned long long misses;
+    };
+
+    pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<char *> g_free[CLASSES];
+    size_t g_idleLimit = 8 * 1024 * 1024;
+    BufferPool::Stats g_stats = {0, 0, 0, 0, 0, 0}; // the shared lists, plus caches of exited threads
+    std::vector<Cache *> g_caches;
+    pthread_key_t g_cacheKey;
+    pthread_once_t g_cacheOnce = PTHREAD_ONCE_INIT;
+
+    size_t classOf(size_t cap)
+    {
+        size_t k = 0;
+        while ((BufferPool::MIN_BLOCK << k) < cap)
+            ++k;
+        return k;
+    }
+
+    void trimLocked()
+    {
+        for (size_t k = CLASSES; k-- > 0 && g_stats.idleBytes > g_idleLimit;)
+        {
+            while (!g_free[k].empty() && g_stats.idleBytes > g_idleLimit)
+            {
+                std::free(g_free[k].back());
+                g_free[k].pop_back();
+                --g_stats.idle;
+                g_stats.idleBytes -= BufferPool::MIN_BLOCK << k;
+            }
+        }
+    }
+
+    // the last `n` blocks of a thread's list go to the shared one, or to
+    // free() past the idle limit
+    void spill(Cache *c, size_t k, size_t n)
+    {
+        std::vector<char *> &list = c->free[k];
+        size_t size = BufferPool::MIN_BLOCK << k;
+        pthread_mutex_lock(&g_lock);
+        for (size_t i = list.size() - n; i < list.size(); ++i)
+        {
+            if (g_stats.idleBytes + size > g_idleLimit)
+                std::free(list[i]);
+            else
+            {
+                g_free[k].push_back(list[i]);
+                ++g_stats.idle;
+                g_stats.idleBytes += size;
+            }
+        }
+        pthread_mutex_unlock(&g_lock);
+        list.resize(list.size() - n);
+        c->idle -= (long)n;
+        c->idleBytes -= (long)(n * size);
+    }
+
+    void refill(Cache *c, size_t k)
+    {
+        std::vector<char *> &list = c->free[k];
+        size_t size = BufferPool::MIN_BLOCK << k;
+        pthread_mutex_lock(&g_lock);
+        size_t n = g_free[k].size() < REFILL ? g_free[k].size() : REFILL;
+        list.insert(list.end(), g_free[k].end() - n, g_free[k].end());
+        g_free[k].resize(g_free[k].size() - n);
+        g_stats.idle -= n;
+        g_stats.idleBytes -= n * size;
+        pthread_mutex_unlock(&g_lock);
+        c->idle += (long)n;
+        c->idleBytes += (long)(n * size);
+    }
+
+    void dropCache(void *arg)
+    {
+        Cache *c = static_cast<Cache *>(arg);
+        for (size_t k = 0; k < CLASSES; ++k)
+            if (!c->free[k].empty())
+                spill(c, k, c->free[k].size());
+        pthread_mutex_lock(&g_lock);
+        g_stats.inUse += c->inUse;
+        g_stats.inUseBytes += c->inUseBytes;
+        g_stats.hits += c->hits;
+        g_stats.misses += c->misses;
+        for (size_t i = 0; i < g_caches.size(); ++i)
+        {
+            if (g_caches[i] == c)
+            {
+                g_caches[i] = g_caches.back();
+                g_caches.pop_back();
+                break;
+            }
+        }
+        pthread_mutex_unlock(&g_lock);
+        delete c;
+    }
+
+    void makeKey()
+    {
+        pthread_key_create(&g_cacheKey, &dropCache);
+    }
+
+    Cache *cache()
+    {
+        pthread_once(&g_cacheOnce, &makeKey);
+        Cache *c = static_cast<Cache *>(pthread_getspecific(g_cacheKey));
+        if (!c)
+        {
+            c = new Cache;
+            c->inUse = c->inUseBytes = c->idle = c->idleBytes = 0;
+            c->hits = c->misses = 0;
+            pthread_mutex_lock(&g_lock);
+            g_caches.push_back(c);
+            pthread_mutex_unlock(&g_lock);
+            pthread_setspecific(g_cacheKey, c);
+        }
+        return c;
+    }
+}
+
+char *BufferPool::acquire(size_t &cap)
+{
+    size_t k = classOf(cap < MIN_BLOCK ? MIN_BLOCK : cap);
+    cap = MIN_BLOCK << k;
+    Cache *c = cache();
+    char *block = NULL;
+    if (k < CLASSES)
+    {
+        if (c->free[k].empty())
+            refill(c, k);
+        if (!c->free[k].empty())
+        {
+            block = c->free[k].back();
+            c->free[k].pop_back();
+            --c->idle;
+            c->idleBytes -= (long)cap;
+        }
+    }
+    if (block)
+        ++c->hits;
+    else
+        ++c->misses;
+    ++c->inUse;
+    c->inUseBytes += (long)cap;
+    if (!block)
+        block = static_cast<char *>(std::malloc(cap));
+    if (!block)
+        throw std::bad_alloc();
+    Accounting::allocated(Accounting::BUFFER, cap);
+    return block;
+}
+
+void BufferPool::release(char *block, size_t cap)
+{
+    if (!block)
+        return;
+    Accounting::freed(Accounting::BUFFER, cap);
+    Cache *c = cache();
+    --c->inUse;
+    c->inUseBytes -= (long)cap;
+    if (cap > MAX_POOLED)
+    {
+        std::free(block);
+        return;
+    }
+    size_t k = classOf(cap);
+    c->free[k].push_back(block);
+    ++c->idle;
+    c->idleBytes += (long)cap;
+    if (c->free[k].size() > CACHE_BLOCKS || (size_t)c->idleBytes > CACHE_BYTES)
+        spill(c, k, (c->free[k].size() + 1) / 2);
+}
+
+void BufferPool::setIdleLimit(size_t bytes)
+{
+    pthread_mutex_lock(&g_lock);
+    g_idleLimit = bytes;
+    trimLocked();
+    pthread_mutex_unlock(&g_lock);
+}
+
+// other threads' counters are read as they change: a snapshot, not a sum at one instant
+BufferPool::Stats BufferPool::stats()
+{
+    pthread_mutex_lock(&g_lock);
+    Stats s = g_stats;
+    for (size_t i = 0; i < g_caches.size(); ++i)
+    {
+        const volatile Cache *c = g_caches[i];
+        s.inUse += c->inUse;
+        s.inUseBytes += c->inUseBytes;
+        s.idle += c->idle;
+        s.idleBytes += c->idleBytes;
+        s.hits += c->hits;
+        s.misses += c->misses;
+    }
+    pthread_mutex_unlock(&g_lock);
+    return s;
+}
+
+void Buffer::append(const char *p, size_t n)
+{
+    if (n == 0)
+        return;
+    if (_len + n > _cap)
+    {
+        size_t used = size();
+        if (_data && _off >= used && used + n <= _cap)
+        {
+            // more than half the block is consumed front, slide instead of growing
+            std::memmove(_data, _data + _off, used);
+        }
+        else
+        {
+            size_t cap = used + n;
+            if (cap < _cap * 2)
+                cap = _cap * 2;
+            char *block = BufferPool::acquire(cap);
+            if (used)
+                std::memcpy(block, _data + _off, used);
+            BufferPool::release(_data, _cap);
+            _data = block;
+            _cap = cap;
+        }
+        _off = 0;
+        _len = used;
+    }
+    std::memcpy(_data + _len, p, n);
+    _len += n;
+}
+
+void Buffer::consume(size_t n)
+{
+    if (n >= size())
+    {
+        clear();
+        return;
+    }
+    _off += n;
+}
+
+void Buffer::clear()
+{
+    BufferPool::release(_data, _cap);
+    _data = NULL;
+    _off = _len = _cap = 0;
+}
@@ -0,0 +1,68 @@
+#include "Server.hpp"
+#include <sched.h>
+#include <pthread.h>
+
+// Latency mode, off unless "busy_poll 1":
+//   busy_poll_cpu 3          pin the loop thread to one core (-1 leaves it)
+//   busy_poll_idle_us 2000   spin this long after the last event, then block
+//   busy_poll_socket_us 50   SO_BUSY_POLL on client sockets, needs CAP_NET_ADMIN
+//                            above net.core.busy_read
+// While spinning the loop polls with a zero timeout, so a message never waits
+// for the scheduler to wake the thread. Fanout workers keep their own cores.
+
+static unsigned long long nowNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+void Server::setupBusyPoll()
+{
+    _busyPoll = _config.getInt("busy_poll", 0) != 0;
+    if (!_busyPoll)
+        return;
+    _busyIdleNs = (unsigned long long)_config.getInt("busy_poll_idle_us", 2000) * 1000ULL;
+    _busySocketUs = (int)_config.getInt("busy_poll_socket_us", 50);
+    _lastEventNs = nowNs();
+    long cpu = _config.getInt("busy_poll_cpu", -1);
+    if (cpu >= 0 && cpu < CPU_SETSIZE)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET((int)cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            std::cerr << "busy poll: cannot pin to cpu " << cpu << std::endl;
+        else
+            std::cout << "busy poll: loop pinned to cpu " << cpu << std::endl;
+    }
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+        std::cerr << "busy poll: single cpu, spinning competes with every other process" << std::endl;
+    std::cout << "busy poll: spinning up to " << _busyIdleNs / 1000 << "us after each event" << std::endl;
+}
+
+// zero while the last event is recent enough, `timeout` once the loop went idle
+int Server::busyPollTimeout(int timeout)
+{
+    if (!_busyPoll || timeout == 0)
+        return timeout;
+    return nowNs() - _lastEventNs < _busyIdleNs ? 0 : timeout;
+}
+
+void Server::busyPollEvents(int ready)
+{
+    if (_busyPoll && ready > 0)
+        _lastEventNs = nowNs();
+}
+
+void Server::tuneSocket(int fd)
+{
+    if (!_busyPoll || _busySocketUs <= 0 || _io != &_sockets)
+        return;
+#ifdef SO_BUSY_POLL
+    // best effort: EPERM without CAP_NET_ADMIN, ENOPROTOOPT on unix sockets
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &_busySocketUs, sizeof(_busySocketUs));
+#else
+    (void)fd;
+#endif
+}
@@ -0,0 +1,180 @@
+#include "Capture.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <cerrno>
+
+static const char MAGIC[8] = {'I', 'R', 'C', 'C', 'A', 'P', '1', '\n'};
+static const size_t FLUSH_AT = 64 * 1024;
+
+Capture::Capture() : _fd(-1), _nextId(1), _queued(0), _dropped(0), _quit(false)
+{
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_work, NULL);
+}
+
+Capture::~Capture()
+{
+    close();
+    pthread_cond_destroy(&_work);
+    pthread_mutex_destroy(&_lock);
+}
+
+bool Capture::open(const std::string &path)
+{
+    close();
+    _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (_fd < 0)
+        return false;
+    _quit = false;
+    if (pthread_create(&_writer, NULL, entry, this) != 0)
+    {
+        ::close(_fd);
+        _fd = -1;
+        return false;
+    }
+    _buf.append(MAGIC, sizeof(MAGIC));
+    flush();
+    return true;
+}
+
+void Capture::close()
+{
+    if (_fd < 0)
+        return;
+    flush();
+    pthread_mutex_lock(&_lock);
+    _quit = true;
+    pthread_cond_signal(&_work);
+    pthread_mutex_unlock(&_lock);
+    pthread_join(_writer, NULL); // writes what is queued first
+    ::close(_fd);
+    _fd = -1;
+    _ids.clear();
+}
+
+void Capture::flush()
+{
+    if (_buf.empty())
+        return;
+    pthread_mutex_lock(&_lock);
+    if (_queued + _buf.size() > MAX_QUEUED)
+        _dropped += _buf.size(); // a capture is best effort, never stall the loop on it
+    else
+    {
+        _queued += _buf.size();
+        _queue.push_back(std::string());
+        _queue.back().swap(_buf);
+        pthread_cond_signal(&_work);
+    }
+    pthread_mutex_unlock(&_lock);
+    _buf.clear();
+}
+
+size_t Capture::queued()
+{
+    pthread_mutex_lock(&_lock);
+    size_t n = _queued;
+    pthread_mutex_unlock(&_lock);
+    return n;
+}
+
+unsigned long long Capture::dropped()
+{
+    pthread_mutex_lock(&_lock);
+    unsigned long long n = _dropped;
+    pthread_mutex_unlock(&_lock);
+    return n;
+}
+
+void *Capture::entry(void *arg)
+{
+    static_cast<Capture *>(arg)->loop();
+    return NULL;
+}
+
+void Capture::loop()
+{
+    pthread_mutex_lock(&_lock);
+    for (;;)
+    {
+        if (_queue.empty())
+        {
+            if (_quit)
+                break;
+            pthread_cond_wait(&_work, &_lock);
+            continue;
+        }
+        std::string block;
+        block.swap(_queue.front());
+        _queue.pop_front();
+        pthread_mutex_unlock(&_lock);
+        size_t off = 0;
+        while (off < block.size())
+        {
+            ssize_t n = ::write(_fd, block.data() + off, block.size() - off);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            off += (size_t)n;
+        }
+        pthread_mutex_lock(&_lock);
+        _queued -= block.size();
+        _dropped += block.size() - off;
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+void Capture::record(unsigned char type, unsigned int conn, const char *data, size_t len)
+{
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    long long usec = (long long)tv.tv_sec * 1000000LL + tv.tv_usec;
+    unsigned int n = (unsigned int)len;
+    _buf.append((const char *)&type, sizeof(type));
+    _buf.append((const char *)&conn, sizeof(conn));
+    _buf.append((const char *)&usec, sizeof(usec));
+    _buf.append((const char *)&n, sizeof(n));
+    if (len)
+        _buf.append(data, len);
+    if (_buf.size() >= FLUSH_AT)
+        flush();
+}
+
+unsigned int Capture::idFor(int fd)
+{
+    // connections handed over by an upgrade show up without a CONNECT
+    std::map<int, unsigned int>::iterator it = _ids.find(fd);
+    if (it != _ids.end())
+        return it->second;
+    unsigned int id = _nextId++;
+    _ids[fd] = id;
+    return id;
+}
+
+void Capture::connected(int fd)
+{
+    if (_fd < 0)
+        return;
+    _ids.erase(fd);
+    record(CONNECT, idFor(fd), NULL, 0);
+}
+
+void Capture::received(int fd, const char *data, size_t len)
+{
+    if (_fd < 0)
+        return;
+    record(DATA, idFor(fd), data, len);
+}
+
+void Capture::disconnected(int fd)
+{
+    if (_fd < 0)
+        return;
+    std::map<int, unsigned int>::iterator it = _ids.find(fd);
+    if (it == _ids.end())
+        return;
+    record(DISCONNECT, it->second, NULL, 0);
+    _ids.erase(it);
+}
@@ -1,14 +1,30 @@
 #include "Channel.hpp"
 #include "Client.hpp"
+#include "Accounting.hpp"
+#include "Scan.hpp"
 
 Channel::Channel(const std::string &name)
-    : _name(name), _topic(""),
+    : _name(name), _topic(""), _memberListDirty(false),
       _inviteOnly(false), _topicRestricted(false),
-      _key(""), _userLimit(-1) {}
+      _key(""), _userLimit(-1), _savedOpsUntil(0), _masksDirty(false)
+{
+    Accounting::allocated(Accounting::CHANNEL, sizeof(*this));
+}
+
+Channel::~Channel()
+{
+    Accounting::freed(Accounting::CHANNEL, sizeof(*this));
+}
+
+void Channel::forgetFd(int fd)
+{
+    _invited.erase(fd);
+}
 
 void Channel::addMember(Client *client)
 {
     _members[client->getFd()] = client;
+    _memberListDirty = true;
     std::set<int>::iterator it = _invited.find(client->getFd());
     if (it != _invited.end())
         _invited.erase(it);
@@ -16,7 +32,8 @@ void Channel::addMember(Client *client)
 
 void Channel::removeMember(int fd)
 {
-    _members.erase(fd);
+    if (_members.erase(fd))
+        _memberListDirty = true;
     _operators.erase(fd);
 }
 
@@ -62,11 +79,53 @@ bool Channel::isOperator(int fd) const
     return _operators.find(fd) != _operators.end();
 }
 
+void Channel::addSavedOperator(const std::string &mask)
+{
+    _savedOps.insert(Scan::folded(mask));
+}
+
+bool Channel::takeSavedOperator(const std::string &mask, time_t now)
+{
+    if (_savedOps.empty())
+        return false;
+    if (now >= _savedOpsUntil)
+    {
+        _savedOps.clear();
+        return false;
+    }
+    return _savedOps.erase(Scan::folded(mask)) > 0;
+}
+
+bool Channel::hasSavedOperators(time_t now)
+{
+    if (now >= _savedOpsUntil)
+        _savedOps.clear();
+    return !_savedOps.empty();
+}
+
+const std::set<std::string> &Channel::getSavedOperators() const
+{
+    return _savedOps;
+}
+
 const std::map<int, Client *> &Channel::getMembers() const
 {
     return _members;
 }
 
+const std::vector<Client *> &Channel::getMemberList() const
+{
+    if (_memberListDirty)
+    {
+        _memberList.clear();
+        _memberList.reserve(_members.size());
+        for (std::map<int, Client *>::const_iterator it = _members.begin(); it != _members.end(); ++it)
+            _memberList.push_back(it->second);
+        _memberListDirty = false;
+    }
+    return _memberList;
+}
+
 void Channel::inviteUser(int fd)
 {
     _invited.insert(fd);
@@ -76,6 +135,11 @@ bool Channel::isInvited(int fd) const
     return _invited.find(fd) != _invited.end();
 }
 
+const std::set<int> &Channel::getInvited() const
+{
+    return _invited;
+}
+
 void Channel::setInviteOnly(bool invite)
 {
     _inviteOnly = invite;
@@ -113,3 +177,76 @@ bool Channel::isFull() const
         return false;
     return (int)_members.size() >= _userLimit;
 }
+
+static bool addMask(std::vector<std::string> &list, const std::string &mask)
+{
+    for (size_t i = 0; i < list.size(); ++i)
+    {
+        if (list[i] == mask)
+            return false;
+    }
+    list.push_back(mask);
+    return true;
+}
+
+static bool removeMask(std::vector<std::string> &list, const std::string &mask)
+{
+    for (size_t i = 0; i < list.size(); ++i)
+    {
+        if (list[i] == mask)
+        {
+            list.erase(list.begin() + i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Channel::addBan(const std::string &mask)
+{
+    if (!addMask(_bans, mask))
+        return false;
+    _masksDirty = true;
+    return true;
+}
+
+bool Channel::removeBan(const std::string &mask)
+{
+    if (!removeMask(_bans, mask))
+        return false;
+    _masksDirty = true;
+    return true;
+}
+
+const std::vector<std::string> &Channel::getBans() const { return _bans; }
+
+bool Channel::addExcept(const std::string &mask)
+{
+    if (!addMask(_excepts, mask))
+        return false;
+    _masksDirty = true;
+    return true;
+}
+
+bool Channel::removeExcept(const std::string &mask)
+{
+    if (!removeMask(_excepts, mask))
+        return false;
+    _masksDirty = true;
+    return true;
+}
+
+const std::vector<std::string> &Channel::getExcepts() const { return _excepts; }
+
+bool Channel::isBanned(const std::string &nickUserHost) const
+{
+    if (_bans.empty())
+        return false;
+    if (_masksDirty)
+    {
+        _banMatcher.build(_bans);
+        _exceptMatcher.build(_excepts);
+        _masksDirty = false;
+    }
+    return _banMatcher.matches(nickUserHost) && !_exceptMatcher.matches(nickUserHost);
+}
@@ -1,23 +1,56 @@
 #include "Client.hpp"
+#include "Scan.hpp"
+#include "Accounting.hpp"
 #include <iostream>
+#include <cstring>
+
+namespace
+{
+    // a queued message: its bytes still unsent and when it was produced
+    struct Pending
+    {
+        unsigned int bytes;
+        unsigned int cls;
+        unsigned long long ns;
+    };
+}
 
 Client::Client(int clientFd)
     : _fd(clientFd),
-      _inbuf(""),
-      _outq(),
+      _inbuf(),
+      _outbuf(),
+      _bulkbuf(),
+      _bulkInFlight(0),
+      _outStamps(),
+      _bulkStamps(),
+      _sendqMax(0),
+      _sendqExceeded(false),
+      _readPaused(false),
+      _backlogSince(0),
       _nickname(""),
       _username(""),
       _realname(""),
+      _hostname("localhost"),
+      _address(""),
+      _mask("!@localhost"),
       _passed(false),
       _hasNickname(false),
       _hasUsername(false),
-      _registered(false)
+      _registered(false),
+      _caps(0),
+      _capNegotiating(false),
+      _oper(false),
+      _resolving(false),
+      _ws(NULL)
 {
+    Accounting::allocated(Accounting::CLIENT, sizeof(*this));
     std::cout << "Client created fd=" << _fd << std::endl;
 }
 
 Client::~Client()
 {
+    Accounting::freed(Accounting::CLIENT, sizeof(*this));
+    delete _ws;
     std::cout << "Client destroyed fd=" << _fd << std::endl;
 }
 
@@ -25,53 +58,200 @@ void Client::appendToInbuf(const char *data, size_t length)
 {
     _inbuf.append(data, length);
     if (_inbuf.size() > 8192)
-        _inbuf.erase(0, _inbuf.size() - 8192); // to remove potential garbage value LOL
+        _inbuf.consume(_inbuf.size() - 8192); // to remove potential garbage value LOL
 }
 
 std::string Client::popNextCommand()
 {
-    std::string::size_type pos = _inbuf.find("\r\n");
-    bool hadCRLF = true;
-    if (pos == std::string::npos)
+    // a line ends at LF, a CR right before it is dropped
+    size_t pos = Scan::findNewline(_inbuf.data(), _inbuf.size());
+    if (pos == _inbuf.size())
+        return "";
+    size_t end = pos;
+    if (end > 0 && _inbuf.data()[end - 1] == '\r')
+        --end;
+    std::string line(_inbuf.data(), end);
+    _inbuf.consume(pos + 1); // hands the block back once the last line is out
+    return line;
+}
+
+void Client::stampLane(Buffer &stamps, size_t bytes, const Latency::Stamp &st)
+{
+    if (!Latency::enabled() || bytes == 0)
+        return;
+    Pending p;
+    p.bytes = (unsigned int)bytes;
+    p.cls = st.cls;
+    p.ns = st.ns;
+    stamps.append((const char *)&p, sizeof(p));
+}
+
+// `sent` bytes of this lane went out: every message they complete is delivered
+void Client::settle(Buffer &stamps, size_t sent)
+{
+    if (stamps.empty())
+        return;
+    unsigned long long now = Latency::now();
+    while (sent && !stamps.empty())
     {
-        pos = _inbuf.find('\n');
-        hadCRLF = false;
-        if (pos == std::string::npos)
-            return "";
+        Pending p;
+        std::memcpy(&p, stamps.data(), sizeof(p));
+        if (sent < p.bytes)
+        {
+            p.bytes -= (unsigned int)sent;
+            std::memcpy(stamps.data(), &p, sizeof(p));
+            return;
+        }
+        sent -= p.bytes;
+        stamps.consume(sizeof(p));
+        Latency::record(p.cls, now - p.ns);
+    }
+}
+
+// false once the client is over its SendQ: nothing more is queued for it
+bool Client::admit()
+{
+    if (_sendqExceeded)
+        return false;
+    if (!hasPendingWrite())
+        _backlogSince = time(NULL);
+    return true;
+}
+
+void Client::charge()
+{
+    if (_sendqMax && pendingBytes() > _sendqMax)
+        _sendqExceeded = true;
+}
+
+void Client::queueWrite(const char *p, size_t n, Lane lane, const Latency::Stamp &st)
+{
+    if (!admit())
+        return;
+    if (_ws)
+    {
+        size_t before = _outbuf.size();
+        _ws->frame(p, n, _outbuf);
+        stampLane(_outStamps, _outbuf.size() - before, st);
     }
-    size_t endlen;
-    if (hadCRLF)
-        endlen = 2;
     else
-        endlen = 1;
-    std::string line = _inbuf.substr(0, pos + endlen);
-    _inbuf.erase(0, pos + endlen);
-    if (line.size() >= 2 && line.substr(line.size() - 2) == "\r\n")
-        line = line.substr(0, line.size() - 2);
-    else if (!line.empty() && line[line.size() - 1] == '\n')
-        line = line.substr(0, line.size() - 1);
-    return line;
+    {
+        (lane == BULK ? _bulkbuf : _outbuf).append(p, n);
+        stampLane(lane == BULK ? _bulkStamps : _outStamps, n, st);
+    }
+    charge();
 }
 
-bool Client::hasPendingWrite() const
+void Client::queueUnsent(const char *p, size_t n, Lane lane, const Latency::Stamp &st)
 {
-    return !_outq.empty();
+    if (_sendqExceeded)
+        return;
+    if (lane == BULK && _bulkbuf.empty())
+    {
+        size_t eol = Scan::findNewline(p, n);
+        _bulkInFlight = eol < n ? eol + 1 : n;
+    }
+    queueWrite(p, n, lane, st);
 }
 
-const std::string &Client::frontWrite() const
+void Client::queueBatch(const char *p, const size_t *ends, const Latency::Stamp *st, size_t first, size_t last, size_t from, Lane lane)
 {
-    return _outq.front();
+    size_t begin = (first ? ends[first - 1] : 0) + from;
+    if (_ws)
+    {
+        for (size_t i = first; i < last; ++i)
+        {
+            size_t start = i == first ? begin : ends[i - 1];
+            queueWrite(p + start, ends[i] - start, lane, st[i]);
+        }
+        return;
+    }
+    if (!admit())
+        return;
+    if (from && lane == BULK && _bulkbuf.empty())
+        _bulkInFlight = ends[first] - begin;
+    Buffer &buf = lane == BULK ? _bulkbuf : _outbuf;
+    Buffer &stamps = lane == BULK ? _bulkStamps : _outStamps;
+    buf.append(p + begin, ends[last - 1] - begin);
+    for (size_t i = first; i < last; ++i)
+        stampLane(stamps, ends[i] - (i == first ? begin : ends[i - 1]), st[i]);
+    charge();
+}
+
+void Client::queueRaw(const std::string &bytes)
+{
+    Latency::Stamp none = {0, Latency::NONE};
+    if (!admit())
+        return;
+    _outbuf.append(bytes.data(), bytes.size());
+    stampLane(_outStamps, bytes.size(), none);
+    charge();
+}
+
+void Client::dropOutput()
+{
+    _outbuf.clear();
+    _bulkbuf.clear();
+    _outStamps.clear();
+    _bulkStamps.clear();
+    _bulkInFlight = 0;
+    _sendqExceeded = false;
+}
+
+void Client::nextWrite(const char *&p, size_t &n) const
+{
+    if (_bulkInFlight)
+    {
+        p = _bulkbuf.data();
+        n = _bulkInFlight;
+    }
+    else if (!_outbuf.empty())
+    {
+        p = _outbuf.data();
+        n = _outbuf.size();
+    }
+    else
+    {
+        p = _bulkbuf.data();
+        n = _bulkbuf.size();
+    }
 }
 
-void Client::popFrontWrite()
+void Client::consumeWrite(size_t n)
 {
-    if (!_outq.empty())
-        _outq.pop_front();
+    if (n == 0)
+        return;
+    if (_bulkInFlight || _outbuf.empty())
+    {
+        // a bulk send that stops mid-line pins the rest of that line to the front
+        bool midLine = _bulkbuf.data()[n - 1] != '\n';
+        _bulkbuf.consume(n);
+        settle(_bulkStamps, n);
+        _bulkInFlight = _bulkInFlight > n ? _bulkInFlight - n : 0;
+        if (midLine && !_bulkInFlight && !_bulkbuf.empty())
+        {
+            size_t eol = Scan::findNewline(_bulkbuf.data(), _bulkbuf.size());
+            _bulkInFlight = eol < _bulkbuf.size() ? eol + 1 : _bulkbuf.size();
+        }
+        return;
+    }
+    _outbuf.consume(n); // a control remainder stays at the front, control goes first anyway
+    settle(_outStamps, n);
 }
 
-void Client::queueWrite(const std::string &msg)
+std::string Client::pendingOutput() const
 {
-    _outq.push_back(msg);
+    std::string out(_bulkbuf.data(), _bulkInFlight);
+    out.append(_outbuf.data(), _outbuf.size());
+    out.append(_bulkbuf.data() + _bulkInFlight, _bulkbuf.size() - _bulkInFlight);
+    return out;
+}
+
+size_t Client::footprint() const
+{
+    return sizeof(*this) + bufferCapacity() + Accounting::heapBytes(_nickname) + Accounting::heapBytes(_username)
+           + Accounting::heapBytes(_realname) + Accounting::heapBytes(_hostname) + Accounting::heapBytes(_address)
+           + Accounting::heapBytes(_mask) + (_ws ? _ws->footprint() : 0);
 }
 
 int Client::getFd() const { return _fd; }
@@ -80,6 +260,16 @@ void Client::setNickname(const std::string &nickname)
 {
     _nickname = nickname;
     _hasNickname = true;
+    refreshMask();
+}
+
+void Client::setAddress(const std::string &address)
+{
+    _address = address;
+    // a prefix cannot have a host starting with ':', so "::1" shows as "0::1"
+    if (!address.empty())
+        _hostname = address[0] == ':' ? "0" + address : address;
+    refreshMask();
 }
 
 void Client::setUsername(const std::string &username, const std::string &realname)
@@ -87,4 +277,5 @@ void Client::setUsername(const std::string &username, const std::string &realnam
     _username = username;
     _realname = realname;
     _hasUsername = true;
+    refreshMask();
 }
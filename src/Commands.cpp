@@ -1,4 +1,20 @@
 #include "Server.hpp"
+#include <algorithm>
+
+struct CapEntry
+{
+    const char *name;
+    unsigned int bit;
+};
+
+static const CapEntry CAPS[] = {
+    {"draft/no-implicit-names", Client::CAP_NO_IMPLICIT_NAMES},
+    {"batch", Client::CAP_BATCH},
+    {"server-time", Client::CAP_SERVER_TIME},
+    {"message-tags", Client::CAP_MESSAGE_TAGS},
+    {"draft/chathistory", Client::CAP_CHATHISTORY},
+};
+static const size_t CAP_COUNT = sizeof(CAPS) / sizeof(CAPS[0]);
 
 void Server::handlePASS(Client *c, const std::string &args)
 {
@@ -41,14 +57,11 @@ void Server::handleNICK(Client *c, const std::string &args)
     while (!nick.empty() && (nick[nick.size() - 1] == ' '))
         nick.erase(nick.size() - 1, 1);
 
-    // no spaces, commas
-    for (size_t i = 0; i < nick.size(); ++i)
+    // no spaces, commas or control bytes
+    if (!Scan::validNick(nick.data(), nick.size()))
     {
-        if (nick[i] <= 0x20 || nick[i] == ',' || nick[i] == 0x7F)
-        {
-            outputMessage(c, nick + " :Erroneous nickname");
-            return;
-        }
+        outputMessage(c, nick + " :Erroneous nickname");
+        return;
     }
     Client *conflict = findByNick(nick);
     if (conflict && conflict != c)
@@ -57,14 +70,21 @@ void Server::handleNICK(Client *c, const std::string &args)
         return;
     }
 
-    if (!c->getNickname().empty())
+    std::string old = c->getNickname();
+    if (!old.empty())
     {
-        std::map<std::string, Client *>::iterator it = _nicks.find(c->getNickname());
+        std::map<std::string, Client *>::iterator it = _nicks.find(Scan::folded(old));
         if (it != _nicks.end() && it->second == c)
             _nicks.erase(it);
     }
     c->setNickname(nick);
-    _nicks[nick] = c;
+    _nicks[Scan::folded(nick)] = c;
+    // a case-only change is the same nick to MONITOR
+    if (c->isRegistered() && Scan::folded(old) != Scan::folded(nick))
+    {
+        monitorPresence(c, old, false);
+        monitorPresence(c, nick, true);
+    }
 }
 
 void Server::handleUSER(Client *c, const std::string &args)
@@ -102,28 +122,31 @@ void Server::handleJOIN(Client *c, const std::string &args)
         outputMessage(c, "JOIN :Not enough parameters");
         return;
     }
+    // JOIN #a,#b,#c keyA,keyB
     std::istringstream iss(args);
-    std::string chan;
-    iss >> chan;
-    std::string key;
-    iss >> key;
+    std::string chans, keys;
+    iss >> chans >> keys;
+    std::vector<std::string> chanList = splitList(chans);
+    std::vector<std::string> keyList = splitList(keys);
+    for (size_t i = 0; i < chanList.size(); ++i)
+        joinChannel(c, chanList[i], i < keyList.size() ? keyList[i] : "");
+}
 
-    if (chan.empty() || chan[0] != '#')
+void Server::joinChannel(Client *c, const std::string &chan, const std::string &key)
+{
+    if (chan.empty() || chan[0] != '#' || chan.size() > 50 || !Scan::validChannelChars(chan.data(), chan.size()))
     {
-        outputMessage(c, ":Bad Channel Mask");
+        outputMessage(c, chan + " :Bad Channel Mask");
         return;
     }
 
-    Channel *ch = NULL;
-    std::map<std::string, Channel *>::iterator it = _channels.find(chan);
-    if (it == _channels.end())
+    Channel *ch = findChannel(chan);
+    if (!ch)
     {
         ch = new Channel(chan);
-        _channels[chan] = ch;
+        _channels[Scan::folded(chan)] = ch;
         ch->addOperator(c->getFd()); // creator gets op
     }
-    else
-        ch = it->second;
 
     if (ch->isMember(c->getFd()))
     {
@@ -132,6 +155,12 @@ void Server::handleJOIN(Client *c, const std::string &args)
         return;
     }
 
+    if (ch->isBanned(c->getMask()) && !ch->isInvited(c->getFd()))
+    {
+        serverNotice(c, "JOIN " + chan + " failed: You are banned");
+        outputMessage(c, chan + " :Cannot join channel (+b)");
+        return;
+    }
     if (ch->isInviteOnly() && !ch->isInvited(c->getFd()))
     {
         serverNotice(c, "JOIN " + chan + " failed: Invite only channel");
@@ -155,47 +184,76 @@ void Server::handleJOIN(Client *c, const std::string &args)
     }
 
     ch->addMember(c);
-    std::string joinMsg = ":" + c->getNickname() + "!" + c->getUsername() + "@localhost JOIN :" + chan + "\r\n";
-    channelBroadcast(ch, joinMsg, -1);
+    // operators restored from a snapshot get their op back, nothing more
+    if (ch->takeSavedOperator(c->getMask(), time(NULL)))
+        ch->addOperator(c->getFd());
+    _snapshotDirty = true;
+    Format::Line joinMsg;
+    channelBroadcast(ch, (joinMsg << ':' << c->getMask() << " JOIN :" << chan).end(), -1);
 
+    ensureChannelHasOperator(ch);
     serverNotice(c, "You have joined channel " + chan + ".");
 
     if (ch->getTopic().empty())
     {
-        reply(c, ":localhost 331 " + c->getNickname() + " " + chan + " :No topic is set\r\n");
+        reply(c, Format::Line(Format::RPL_NOTOPIC, c->getNickname(), chan).end());
     }
     else
     {
-        reply(c, ":localhost 332 " + c->getNickname() + " " + chan + " :" + ch->getTopic() + "\r\n");
+        reply(c, (Format::Line(Format::RPL_TOPIC, c->getNickname(), chan) << ch->getTopic()).end());
     }
+    // big channels cost hundreds of KB here, some clients ask for NAMES on demand instead
+    if (!c->hasCap(Client::CAP_NO_IMPLICIT_NAMES))
+        sendNames(c, ch);
+}
 
-    std::ostringstream namesline;
-    namesline << ":localhost 353 " << c->getNickname() << " = " << chan << " :";
+void Server::sendNames(Client *c, Channel *ch)
+{
+    // as many nicks per 353 as fit in 512 bytes, CRLF included
+    Format::Line head;
+    head << ":localhost 353 " << c->getNickname() << " = " << ch->getName() << " :";
+    Format::Line line = head;
 
     const std::map<int, Client *> &m = ch->getMembers();
     for (std::map<int, Client *>::const_iterator mi = m.begin(); mi != m.end(); ++mi)
     {
+        const std::string &nick = mi->second->getNickname();
+        size_t add = nick.size() + (ch->isOperator(mi->first) ? 1 : 0) + (line.size() > head.size() ? 1 : 0);
+        if (line.size() > head.size() && line.size() + add + 2 > Format::LINE_MAX)
+        {
+            reply(c, line.end());
+            line = head;
+        }
+        if (line.size() > head.size())
+            line << ' ';
         if (ch->isOperator(mi->first))
-            namesline << "@";
-        namesline << mi->second->getNickname() << " ";
+            line << '@';
+        line << nick;
     }
-    namesline << "\r\n";
-    reply(c, namesline.str());
+    if (line.size() > head.size())
+        reply(c, line.end());
 
-    reply(c, ":localhost 366 " + c->getNickname() + " " + chan + " :End of /NAMES list\r\n");
+    reply(c, Format::Line(Format::RPL_ENDOFNAMES, c->getNickname(), ch->getName()).end());
 }
 
 void Server::handlePART(Client *c, const std::string &args)
 {
     std::istringstream iss(args);
-    std::string chan;
-    iss >> chan;
-    if (chan.empty())
+    std::string chans;
+    iss >> chans;
+    if (chans.empty())
     {
         outputMessage(c, "PART :Not enough parameters");
         return;
     }
-    std::map<std::string, Channel *>::iterator it = _channels.find(chan);
+    std::vector<std::string> chanList = splitList(chans);
+    for (size_t i = 0; i < chanList.size(); ++i)
+        partChannel(c, chanList[i]);
+}
+
+void Server::partChannel(Client *c, const std::string &chan)
+{
+    std::map<std::string, Channel *>::iterator it = _channels.find(Scan::folded(chan));
     if (it == _channels.end())
     {
         outputMessage(c, chan + " :No such channel");
@@ -207,11 +265,13 @@ void Server::handlePART(Client *c, const std::string &args)
         outputMessage(c, chan + " :You're not on that channel");
         return;
     }
-    std::string msg = ":" + c->getNickname() + " PART " + chan + "\r\n";
-    channelBroadcast(ch, msg, -1);
+    Format::Line msg;
+    channelBroadcast(ch, (msg << ':' << c->getMask() << " PART " << chan).end(), -1);
     ch->removeMember(c->getFd());
+    _snapshotDirty = true;
     if (ch->isEmpty())
     {
+        _history.forget(ch->getName());
         delete ch;
         // ch = NULL;
         _channels.erase(it);
@@ -229,37 +289,46 @@ void Server::handlePRIVMSG(Client *c, const std::string &args)
         outputMessage(c, ":You have not registered");
         return;
     }
-    // target :trailing text
+    // target[,target...] :trailing text
     std::istringstream iss(args);
-    std::string target;
-    iss >> target;
+    std::string targets;
+    iss >> targets;
     std::string trailing;
     std::getline(iss, trailing);
     if (!trailing.empty() && trailing[0] == ' ')
         trailing.erase(0, 1);
     if (!trailing.empty() && trailing[0] == ':')
         trailing.erase(0, 1);
-    if (target.empty() || trailing.empty())
+    if (targets.empty() || trailing.empty())
     {
         outputMessage(c, "PRIVMSG :Not enough parameters");
         return;
     }
-    std::string full = ":" + c->getNickname() + " PRIVMSG " + target + " :" + trailing + "\r\n";
+    std::vector<std::string> targetList = splitList(targets);
+    for (size_t i = 0; i < targetList.size(); ++i)
+        deliverPrivmsg(c, targetList[i], trailing);
+}
+
+void Server::deliverPrivmsg(Client *c, const std::string &target, const std::string &text)
+{
+    Format::Line full;
+    (full << ':' << c->getMask() << " PRIVMSG " << target << " :" << text).end();
     if (!target.empty() && target[0] == '#')
     {
-        std::map<std::string, Channel *>::iterator it = _channels.find(target);
-        if (it == _channels.end())
+        Channel *ch = findChannel(target);
+        if (!ch)
         {
             outputMessage(c, target + " :No such channel");
             return;
         }
-        Channel *ch = it->second;
-        if (!ch->isMember(c->getFd()))
+        if (!ch->isMember(c->getFd()) || (ch->isBanned(c->getMask()) && !ch->isOperator(c->getFd())))
         {
             outputMessage(c, target + " :Cannot send to channel");
             return;
         }
-        channelBroadcast(ch, full, c->getFd());
+        channelMessage(ch, full, c->getFd(), Client::BULK);
+        _hotSenders.add(c->getNickname().data(), c->getNickname().size(), (unsigned long long)full.size() * (ch->getMembers().size() - 1));
+        _history.append(ch->getName(), History::now(), std::string(full.data(), full.size() - 2));
     }
     else
     {
@@ -269,7 +338,10 @@ void Server::handlePRIVMSG(Client *c, const std::string &args)
             outputMessage(c, target + " :No such nick");
             return;
         }
-        reply(to, full);
+        if (_coalescedSenders.count(c->getFd()))
+            flushBroadcasts(); // keeps this sender's order
+        reply(to, full, Client::BULK);
+        _hotSenders.add(c->getNickname().data(), c->getNickname().size(), full.size());
     }
 }
 
@@ -291,14 +363,13 @@ void Server::handleQUIT(Client *c, const std::string &args)
     if (reason.empty())
         reason = "Client Quit";
     // Inform channels
+    Format::Line msg;
+    (msg << ':' << c->getMask() << " QUIT :" << reason).end();
     for (std::map<std::string, Channel *>::iterator ct = _channels.begin(); ct != _channels.end(); ++ct)
     {
         Channel *ch = ct->second;
         if (ch->isMember(c->getFd()))
-        {
-            std::string msg = ":" + c->getNickname() + " QUIT :" + reason + "\r\n";
             channelBroadcast(ch, msg, c->getFd());
-        }
     }
     disconnectClient(c->getFd(), reason);
 }
@@ -306,14 +377,28 @@ void Server::handleQUIT(Client *c, const std::string &args)
 void Server::handleKICK(Client *c, const std::string &args)
 {
     std::istringstream iss(args);
-    std::string chan, nick;
-    iss >> chan >> nick;
-    if (chan.empty() || nick.empty())
+    std::string chans, nicks;
+    iss >> chans >> nicks;
+    if (chans.empty() || nicks.empty())
+    {
+        outputMessage(c, "KICK :Not enough parameters");
+        return;
+    }
+    // one channel and many nicks, or channel/nick pairs
+    std::vector<std::string> chanList = splitList(chans);
+    std::vector<std::string> nickList = splitList(nicks);
+    if (chanList.size() != 1 && chanList.size() != nickList.size())
     {
         outputMessage(c, "KICK :Not enough parameters");
         return;
     }
-    std::map<std::string, Channel *>::iterator it = _channels.find(chan);
+    for (size_t i = 0; i < nickList.size(); ++i)
+        kickFromChannel(c, chanList.size() == 1 ? chanList[0] : chanList[i], nickList[i]);
+}
+
+void Server::kickFromChannel(Client *c, const std::string &chan, const std::string &nick)
+{
+    std::map<std::string, Channel *>::iterator it = _channels.find(Scan::folded(chan));
     if (it == _channels.end())
     {
         outputMessage(c, chan + " :No such channel");
@@ -337,13 +422,14 @@ void Server::handleKICK(Client *c, const std::string &args)
         outputMessage(c, nick + " " + chan + " :They aren't on that channel");
         return;
     }
-    std::string msg = ":" + c->getNickname() + " KICK " + chan + " " + nick + "\r\n";
-    channelBroadcast(ch, msg, -1);
+    Format::Line msg;
+    channelBroadcast(ch, (msg << ':' << c->getMask() << " KICK " << chan << ' ' << nick).end(), -1);
     ch->removeMember(victim->getFd());
+    _snapshotDirty = true;
     if (ch->isEmpty())
     {
-        // delete ch;
-        // ch = NULL;
+        _history.forget(ch->getName());
+        delete ch;
         _channels.erase(it);
     }
     else
@@ -363,7 +449,7 @@ void Server::handleINVITE(Client *c, const std::string &args)
         return;
     }
 
-    std::map<std::string, Channel *>::iterator it = _channels.find(chan);
+    std::map<std::string, Channel *>::iterator it = _channels.find(Scan::folded(chan));
     if (it == _channels.end())
     {
         outputMessage(c, chan + " :No such channel");
@@ -389,8 +475,8 @@ void Server::handleINVITE(Client *c, const std::string &args)
         return;
     }
     ch->inviteUser(t->getFd());
-    std::string msg = ":" + c->getNickname() + " INVITE " + nick + " :" + chan + "\r\n";
-    reply(t, msg);
+    Format::Line msg;
+    reply(t, (msg << ':' << c->getMask() << " INVITE " << nick << " :" << chan).end());
     outputMessage(c, nick + " " + chan);
 }
 
@@ -404,7 +490,7 @@ void Server::handleTOPIC(Client *c, const std::string &args)
         outputMessage(c, "TOPIC :Not enough parameters");
         return;
     }
-    std::map<std::string, Channel *>::iterator it = _channels.find(chan);
+    std::map<std::string, Channel *>::iterator it = _channels.find(Scan::folded(chan));
     if (it == _channels.end())
     {
         outputMessage(c, chan + " :No such channel");
@@ -439,6 +525,418 @@ void Server::handleTOPIC(Client *c, const std::string &args)
         return;
     }
     ch->setTopic(trailing);
-    std::string msg = ":" + c->getNickname() + " TOPIC " + chan + " :" + trailing + "\r\n";
-    channelBroadcast(ch, msg, -1);
+    _snapshotDirty = true;
+    Format::Line msg;
+    channelBroadcast(ch, (msg << ':' << c->getMask() << " TOPIC " << chan << " :" << trailing).end(), -1);
+    _history.append(ch->getName(), History::now(), std::string(msg.data(), msg.size() - 2));
+}
+
+void Server::handleCHATHISTORY(Client *c, const std::string &args)
+{
+    if (!c->isRegistered())
+    {
+        outputMessage(c, ":You have not registered");
+        return;
+    }
+    std::istringstream iss(args);
+    std::string sub, target, point, limitStr;
+    iss >> sub >> target >> point >> limitStr;
+    if (sub.empty() || target.empty() || point.empty())
+    {
+        outputMessage(c, "CHATHISTORY :Not enough parameters");
+        return;
+    }
+    for (size_t i = 0; i < sub.size(); ++i)
+        sub[i] = (char)std::toupper((unsigned char)sub[i]);
+
+    History::Mode mode;
+    if (sub == "LATEST")
+        mode = History::LATEST;
+    else if (sub == "BEFORE")
+        mode = History::BEFORE;
+    else if (sub == "AFTER")
+        mode = History::AFTER;
+    else
+    {
+        reply(c, "FAIL CHATHISTORY INVALID_PARAMS " + sub + " :Unknown subcommand\r\n");
+        return;
+    }
+
+    long long ts = 0;
+    if (point == "*" && mode == History::LATEST)
+        ts = 0;
+    else if (point.compare(0, 10, "timestamp=") != 0 || !History::parseTime(point.substr(10), ts))
+    {
+        reply(c, "FAIL CHATHISTORY INVALID_PARAMS " + point + " :Invalid message reference\r\n");
+        return;
+    }
+
+    long maxFetch = _config.getInt("history_fetch_max", 100);
+    long limit = std::atol(limitStr.c_str());
+    if (limit <= 0 || limit > maxFetch)
+        limit = maxFetch;
+
+    if (!_history.enabled())
+    {
+        reply(c, "FAIL CHATHISTORY MESSAGE_ERROR " + target + " :History is disabled\r\n");
+        return;
+    }
+    std::map<std::string, Channel *>::iterator it = _channels.find(Scan::folded(target));
+    if (it == _channels.end())
+    {
+        outputMessage(c, target + " :No such channel");
+        return;
+    }
+    if (!it->second->isMember(c->getFd()))
+    {
+        outputMessage(c, target + " :You're not on that channel");
+        return;
+    }
+
+    // answered from the loop: reaching back into older segments indexes
+    // one of them per iteration
+    ListCursor cur;
+    cur.kind = ListCursor::HISTORY;
+    cur.target = it->second->getName();
+    cur.lastFd = -1;
+    cur.started = false;
+    cur.minUsers = -1;
+    cur.maxUsers = -1;
+    cur.mode = mode;
+    cur.ts = ts;
+    cur.limit = (size_t)limit;
+    queueCursor(c, cur, "CHATHISTORY");
+}
+
+// true once the answer went out
+bool Server::stepHistory(Client *c, const ListCursor &cur)
+{
+    size_t first = 0;
+    bool more = false;
+    const std::string &name = cur.target;
+    size_t n = _history.select(name, cur.mode, cur.ts, cur.limit, first, more);
+    if (more)
+        return false;
+
+    // BATCH and the batch/time tags only go to clients that asked for them
+    bool batch = c->hasCap(Client::CAP_BATCH);
+    bool stamp = c->hasCap(Client::CAP_SERVER_TIME);
+    std::ostringstream ref;
+    if (batch)
+    {
+        ref << "hist" << ++_batchSeq;
+        reply(c, ":localhost BATCH +" + ref.str() + " chathistory " + name + "\r\n");
+    }
+    // one line at a time straight out of the mapped segment
+    for (size_t i = first; i < first + n; ++i)
+    {
+        const char *data;
+        size_t len;
+        long long at;
+        if (!_history.fetch(name, i, data, len, at))
+            break;
+        std::string line;
+        if (batch)
+            line = "@batch=" + ref.str();
+        if (stamp)
+            line += (batch ? ";time=" : "@time=") + History::formatTime(at);
+        if (!line.empty())
+            line += ' ';
+        line.append(data, len);
+        line += "\r\n";
+        reply(c, line);
+    }
+    if (batch)
+        reply(c, ":localhost BATCH -" + ref.str() + "\r\n");
+    return true;
+}
+
+void Server::handleCAP(Client *c, const std::string &args)
+{
+    std::istringstream iss(args);
+    std::string sub;
+    iss >> sub;
+    for (size_t i = 0; i < sub.size(); ++i)
+        sub[i] = (char)std::toupper((unsigned char)sub[i]);
+    std::string nick = c->getNickname().empty() ? "*" : c->getNickname();
+
+    if (sub == "LS" || sub == "LIST")
+    {
+        // registration waits for CAP END once the client started negotiating
+        if (sub == "LS" && !c->isRegistered())
+            c->setNegotiatingCaps(true);
+        std::string list;
+        for (size_t i = 0; i < CAP_COUNT; ++i)
+        {
+            if (sub == "LIST" && !c->hasCap(CAPS[i].bit))
+                continue;
+            if (!list.empty())
+                list += ' ';
+            list += CAPS[i].name;
+        }
+        reply(c, ":localhost CAP " + nick + " " + sub + " :" + list + "\r\n");
+    }
+    else if (sub == "REQ")
+    {
+        if (!c->isRegistered())
+            c->setNegotiatingCaps(true);
+        std::string wanted;
+        std::getline(iss, wanted);
+        if (!wanted.empty() && wanted[0] == ' ')
+            wanted.erase(0, 1);
+        if (!wanted.empty() && wanted[0] == ':')
+            wanted.erase(0, 1);
+
+        // all or nothing
+        unsigned int caps = c->getCaps();
+        std::istringstream ws(wanted);
+        std::string name;
+        bool ok = !wanted.empty();
+        while (ok && ws >> name)
+        {
+            bool remove = name[0] == '-';
+            if (remove)
+                name.erase(0, 1);
+            size_t i = 0;
+            while (i < CAP_COUNT && name != CAPS[i].name)
+                ++i;
+            if (i == CAP_COUNT)
+                ok = false;
+            else if (remove)
+                caps &= ~CAPS[i].bit;
+            else
+                caps |= CAPS[i].bit;
+        }
+        if (ok)
+            c->setCaps(caps);
+        reply(c, ":localhost CAP " + nick + (ok ? " ACK :" : " NAK :") + wanted + "\r\n");
+    }
+    else if (sub == "END")
+    {
+        c->setNegotiatingCaps(false);
+    }
+    else
+        outputMessage(c, (sub.empty() ? "CAP" : sub) + " :Invalid CAP command");
+}
+
+void Server::handleNAMES(Client *c, const std::string &args)
+{
+    if (!c->isRegistered())
+    {
+        outputMessage(c, ":You have not registered");
+        return;
+    }
+    std::istringstream iss(args);
+    std::string chans;
+    iss >> chans;
+    std::vector<std::string> chanList = splitList(chans);
+    if (chanList.empty())
+    {
+        reply(c, Format::Line(Format::RPL_ENDOFNAMES, c->getNickname(), "*").end());
+        return;
+    }
+    for (size_t i = 0; i < chanList.size(); ++i)
+    {
+        Channel *ch = findChannel(chanList[i]);
+        if (ch)
+            sendNames(c, ch);
+        else
+            reply(c, Format::Line(Format::RPL_ENDOFNAMES, c->getNickname(), chanList[i]).end());
+    }
+}
+
+void Server::handleOPER(Client *c, const std::string &args)
+{
+    if (!c->isRegistered())
+    {
+        outputMessage(c, ":You have not registered");
+        return;
+    }
+    std::istringstream iss(args);
+    std::string name, pass;
+    iss >> name >> pass;
+    if (name.empty() || pass.empty())
+    {
+        outputMessage(c, "OPER :Not enough parameters");
+        return;
+    }
+    // config lines: oper <name> <password>
+    const std::vector<std::string> &opers = _config.getAll("oper");
+    for (size_t i = 0; i < opers.size(); ++i)
+    {
+        std::istringstream line(opers[i]);
+        std::string n, p;
+        line >> n >> p;
+        if (n == name && p == pass && !p.empty())
+        {
+            c->setOper(true);
+            applySendq(c);
+            reply(c, Format::Line(Format::RPL_YOUREOPER, c->getNickname()).end());
+            return;
+        }
+    }
+    reply(c, Format::Line(Format::ERR_PASSWDMISMATCH, c->getNickname()).end());
+}
+
+void Server::handleSTATS(Client *c, const std::string &args)
+{
+    if (!c->isRegistered())
+    {
+        outputMessage(c, ":You have not registered");
+        return;
+    }
+    std::istringstream iss(args);
+    std::string query;
+    iss >> query;
+    if (query.empty())
+    {
+        outputMessage(c, "STATS :Not enough parameters");
+        return;
+    }
+    if (!c->isOper())
+    {
+        reply(c, Format::Line(Format::ERR_NOPRIVILEGES, c->getNickname()).end());
+        return;
+    }
+    const std::string head = ":localhost 249 " + c->getNickname() + " " + query[0] + " :";
+    switch (query[0])
+    {
+    case 'P': // plugin hooks: calls, drops, time spent
+    {
+        const std::vector<Plugins::Hook> &hooks = _plugins.getHooks();
+        for (size_t i = 0; i < hooks.size(); ++i)
+        {
+            const Plugins::Hook &h = hooks[i];
+            std::ostringstream oss;
+            oss << head << _plugins.getName(h.plugin) << " " << h.cmd << (h.when == IRCSERV_BEFORE ? " before" : " after")
+                << " calls=" << h.calls << " drops=" << h.drops
+                << " avg_ns=" << (h.calls ? h.totalNs / h.calls : 0) << " max_ns=" << h.maxNs
+                << " total_us=" << h.totalNs / 1000 << "\r\n";
+            reply(c, oss.str());
+        }
+        break;
+    }
+    case 'M': // memory held per connection and by the buffer pool
+    {
+        // rb-tree node header: color and three links
+        const size_t node = sizeof(int) + 3 * sizeof(void *);
+        size_t clientBytes = 0, tableBytes = 0, bufferBytes = 0;
+        std::vector<std::pair<size_t, Client *> > top;
+        for (std::map<int, Client *>::iterator it = _clients.begin(); it != _clients.end(); ++it)
+        {
+            Client *cl = it->second;
+            clientBytes += cl->footprint();
+            bufferBytes += cl->bufferCapacity();
+            tableBytes += node + sizeof(*it) + sizeof(pollfd) + sizeof(int);
+            if (cl->bufferCapacity())
+                top.push_back(std::make_pair(cl->bufferCapacity(), cl));
+        }
+        for (std::map<std::string, Client *>::iterator it = _nicks.begin(); it != _nicks.end(); ++it)
+            tableBytes += node + sizeof(*it);
+        size_t n = _clients.size();
+        std::ostringstream oss;
+        oss << head << "clients=" << n << " client_bytes=" << clientBytes << " table_bytes=" << tableBytes
+            << " per_client=" << (n ? (clientBytes + tableBytes) / n : 0) << " buffer_bytes=" << bufferBytes << "\r\n";
+        BufferPool::Stats ps = BufferPool::stats();
+        oss << head << "pool in_use=" << ps.inUse << " in_use_bytes=" << ps.inUseBytes << " idle=" << ps.idle
+            << " idle_bytes=" << ps.idleBytes << " hits=" << ps.hits << " misses=" << ps.misses << "\r\n";
+        oss << head << "dns cache=" << _resolver.cacheSize() << " hits=" << _resolver.hits()
+            << " misses=" << _resolver.misses() << "\r\n";
+        if (_capture.enabled())
+            oss << head << "capture queued_bytes=" << _capture.queued() << " dropped_bytes=" << _capture.dropped() << "\r\n";
+        std::sort(top.begin(), top.end());
+        for (size_t i = top.size(); i-- > 0 && top.size() - i <= 5;)
+            oss << head << "fd=" << top[i].second->getFd() << " nick=" << top[i].second->getNickname()
+                << " buffer_bytes=" << top[i].first << " queued=" << top[i].second->pendingBytes() << "\r\n";
+        reply(c, oss.str());
+        break;
+    }
+    case 'Q': // output lane depths, deepest queues first
+    {
+        size_t control = 0, bulk = 0, backed = 0, paused = 0;
+        std::vector<std::pair<size_t, Client *> > top;
+        for (std::map<int, Client *>::iterator it = _clients.begin(); it != _clients.end(); ++it)
+        {
+            Client *cl = it->second;
+            control += cl->laneBytes(Client::CONTROL);
+            bulk += cl->laneBytes(Client::BULK);
+            paused += cl->isReadPaused();
+            if (cl->hasPendingWrite())
+            {
+                ++backed;
+                top.push_back(std::make_pair(cl->pendingBytes(), cl));
+            }
+        }
+        std::ostringstream oss;
+        oss << head << "clients=" << _clients.size() << " backed_up=" << backed << " control_bytes=" << control
+            << " bulk_bytes=" << bulk << " coalesced_msgs=" << _coalescedMsgs << " coalesced_passes=" << _coalescedPasses << "\r\n";
+        oss << head << "read_paused=" << paused << " sendq_evictions=" << _sendqEvictions
+            << " pressure_evictions=" << _pressureEvictions << " buffer_bytes=" << BufferPool::stats().inUseBytes
+            << " sendq_total=" << _sendqTotal << "\r\n";
+        std::sort(top.begin(), top.end());
+        for (size_t i = top.size(); i-- > 0 && top.size() - i <= 10;)
+            oss << head << "fd=" << top[i].second->getFd() << " nick=" << top[i].second->getNickname()
+                << " control=" << top[i].second->laneBytes(Client::CONTROL)
+                << " bulk=" << top[i].second->laneBytes(Client::BULK)
+                << " sendq=" << top[i].second->getSendqMax() << "\r\n";
+        reply(c, oss.str());
+        break;
+    }
+    case 'H': // heaviest channels and senders by fanout bytes over the sketch window
+    {
+        const HeavyHitters *tables[2] = {&_hotChannels, &_hotSenders};
+        const char *names[2] = {"channel", "sender"};
+        std::ostringstream oss;
+        for (int t = 0; t < 2; ++t)
+        {
+            std::vector<HeavyHitters::Entry> top = tables[t]->top();
+            for (size_t i = 0; i < top.size(); ++i)
+                oss << head << names[t] << " " << top[i].key << " msgs=" << top[i].msgs << " bytes=" << top[i].bytes
+                    << " window=" << tables[t]->windowSecs() << "s sample=1/" << tables[t]->sample() << "\r\n";
+        }
+        reply(c, oss.str());
+        break;
+    }
+    case 'A': // live objects and bytes per subsystem
+    {
+        std::ostringstream oss;
+        for (int i = 0; i < Accounting::SUBSYSTEMS; ++i)
+        {
+            Accounting::Counters a = Accounting::get((Accounting::Subsystem)i);
+            oss << head << Accounting::name((Accounting::Subsystem)i) << " live=" << a.live << " live_bytes=" << a.liveBytes
+                << " allocs=" << a.allocs << " frees=" << a.frees << "\r\n";
+        }
+        BufferPool::Stats ps = BufferPool::stats();
+        oss << head << "pool idle=" << ps.idle << " idle_bytes=" << ps.idleBytes << "\r\n";
+        oss << head << "tables clients=" << _clients.size() << " nicks=" << _nicks.size() << " channels=" << _channels.size()
+            << " pollfds=" << _pollFds.size() << "\r\n";
+        reply(c, oss.str());
+        break;
+    }
+    case 'L': // delivery latency, produced to handed to the kernel, per copy; "STATS L reset" starts a new window
+    {
+        std::string op;
+        iss >> op;
+        std::ostringstream oss;
+        for (int k = 0; k <= Latency::CLASSES; ++k)
+        {
+            int i = k ? k - 1 : Latency::CLASSES; // everything first, then per class
+            Latency::Summary s = Latency::summary((Latency::Class)i);
+            if (!s.count && i != Latency::CLASSES)
+                continue;
+            oss << head << Latency::name((Latency::Class)i) << " count=" << s.count
+                << " avg_ns=" << (s.count ? s.sumNs / s.count : 0) << " p50_ns=" << s.p50 << " p90_ns=" << s.p90
+                << " p99_ns=" << s.p99 << " p999_ns=" << s.p999 << " max_ns=" << s.maxNs << "\r\n";
+        }
+        if (!Latency::enabled())
+            oss << head << "disabled, latency_stamps 0\r\n";
+        if (op == "reset")
+            Latency::reset();
+        reply(c, oss.str());
+        break;
+    }
+    default:
+        break;
+    }
+    reply(c, ":localhost 219 " + c->getNickname() + " " + query[0] + " :End of /STATS report\r\n");
 }
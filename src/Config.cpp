@@ -0,0 +1,86 @@
+#include "Config.hpp"
+#include <fstream>
+#include <stdexcept>
+#include <cstdlib>
+
+Config::Config() {}
+
+static std::string trim(const std::string &s)
+{
+    std::string::size_type b = s.find_first_not_of(" \t\r");
+    if (b == std::string::npos)
+        return "";
+    std::string::size_type e = s.find_last_not_of(" \t\r");
+    return s.substr(b, e - b + 1);
+}
+
+void Config::load(const std::string &path)
+{
+    std::ifstream in(path.c_str());
+    if (!in)
+        throw std::runtime_error("cannot open config " + path);
+
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::string::size_type hash = line.find('#');
+        if (hash != std::string::npos)
+            line.erase(hash);
+        line = trim(line);
+        if (line.empty())
+            continue;
+        std::string::size_type sp = line.find_first_of(" \t");
+        std::string key = line.substr(0, sp);
+        std::string value;
+        if (sp != std::string::npos)
+            value = trim(line.substr(sp));
+        _values[key].push_back(value);
+    }
+}
+
+void Config::set(const std::string &key, const std::string &value)
+{
+    _values[key].assign(1, value);
+}
+
+bool Config::has(const std::string &key) const
+{
+    return _values.find(key) != _values.end();
+}
+
+std::string Config::getString(const std::string &key, const std::string &def) const
+{
+    std::map<std::string, std::vector<std::string> >::const_iterator it = _values.find(key);
+    if (it == _values.end() || it->second.empty())
+        return def;
+    return it->second.back(); // last one wins
+}
+
+long Config::getInt(const std::string &key, long def) const
+{
+    std::string v = getString(key, "");
+    if (v.empty())
+        return def;
+    char *end = NULL;
+    long n = std::strtol(v.c_str(), &end, 10);
+    if (!end || *end != '\0')
+        throw std::runtime_error("config: " + key + " expects a number");
+    return n;
+}
+
+bool Config::getBool(const std::string &key, bool def) const
+{
+    std::string v = getString(key, "");
+    if (v.empty())
+        return def;
+    return v == "on" || v == "yes" || v == "true" || v == "1";
+}
+
+const std::vector<std::string> &Config::getAll(const std::string &key) const
+{
+    static const std::vector<std::string> none;
+    std::map<std::string, std::vector<std::string> >::const_iterator it = _values.find(key);
+    if (it == _values.end())
+        return none;
+    return it->second;
+}
@@ -0,0 +1,124 @@
+#include "Fanout.hpp"
+#include <csignal>
+
+// chunks per thread: small enough to even out, big enough that claiming
+// one is noise next to queueing output for its members
+static const size_t CHUNKS_PER_THREAD = 4;
+static const size_t MIN_CHUNK = 64;
+
+Fanout::Fanout() : _generation(0), _busy(0), _quit(false), _job(NULL), _count(0), _chunk(1), _next(0)
+{
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_work, NULL);
+    pthread_cond_init(&_done, NULL);
+}
+
+Fanout::~Fanout()
+{
+    stop();
+    pthread_cond_destroy(&_done);
+    pthread_cond_destroy(&_work);
+    pthread_mutex_destroy(&_lock);
+}
+
+bool Fanout::start(size_t threads)
+{
+    // workers never take signals, the loop thread has to see EINTR
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    _quit = false;
+    for (size_t i = 0; i < threads; ++i)
+    {
+        pthread_t t;
+        if (pthread_create(&t, NULL, &Fanout::entry, this) != 0)
+            break;
+        _threads.push_back(t);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return _threads.size() == threads;
+}
+
+void Fanout::stop()
+{
+    if (_threads.empty())
+        return;
+    pthread_mutex_lock(&_lock);
+    _quit = true;
+    pthread_cond_broadcast(&_work);
+    pthread_mutex_unlock(&_lock);
+    for (size_t i = 0; i < _threads.size(); ++i)
+        pthread_join(_threads[i], NULL);
+    _threads.clear();
+}
+
+size_t Fanout::threads() const
+{
+    return _threads.size();
+}
+
+void *Fanout::entry(void *arg)
+{
+    static_cast<Fanout *>(arg)->loop();
+    return NULL;
+}
+
+void Fanout::drain(FanoutJob &job)
+{
+    size_t begin;
+    while ((begin = __sync_fetch_and_add(&_next, _chunk)) < _count)
+        job.runRange(begin, begin + _chunk < _count ? begin + _chunk : _count);
+}
+
+void Fanout::loop()
+{
+    unsigned long seen = 0;
+    pthread_mutex_lock(&_lock);
+    while (true)
+    {
+        while (!_quit && _generation == seen)
+            pthread_cond_wait(&_work, &_lock);
+        if (_quit)
+            break;
+        seen = _generation;
+        FanoutJob *job = _job;
+        if (!job)
+            continue; // woke after run() had finished it alone
+        ++_busy;
+        pthread_mutex_unlock(&_lock);
+
+        drain(*job);
+
+        pthread_mutex_lock(&_lock);
+        if (--_busy == 0)
+            pthread_cond_signal(&_done);
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+void Fanout::run(FanoutJob &job, size_t count)
+{
+    if (_threads.empty())
+    {
+        job.runRange(0, count);
+        return;
+    }
+    size_t chunk = count / ((_threads.size() + 1) * CHUNKS_PER_THREAD);
+    pthread_mutex_lock(&_lock);
+    _job = &job;
+    _count = count;
+    _chunk = chunk < MIN_CHUNK ? MIN_CHUNK : chunk;
+    _next = 0;
+    ++_generation;
+    pthread_cond_broadcast(&_work);
+    pthread_mutex_unlock(&_lock);
+
+    drain(job);
+
+    // every chunk is claimed: late workers must not join, busy ones finish theirs
+    pthread_mutex_lock(&_lock);
+    _job = NULL;
+    while (_busy > 0)
+        pthread_cond_wait(&_done, &_lock);
+    pthread_mutex_unlock(&_lock);
+}
@@ -0,0 +1,43 @@
+#include "Format.hpp"
+
+const Format::Template Format::RPL_LISTEND = FORMAT_NUMERIC("323", " :End of /LIST");
+const Format::Template Format::RPL_NOTOPIC = FORMAT_NUMERIC("331", " :No topic is set");
+const Format::Template Format::RPL_TOPIC = FORMAT_NUMERIC("332", " :");
+const Format::Template Format::RPL_ENDOFWHO = FORMAT_NUMERIC("315", " :End of /WHO list");
+const Format::Template Format::RPL_ENDOFEXCEPTLIST = FORMAT_NUMERIC("349", " :End of channel exception list");
+const Format::Template Format::RPL_ENDOFNAMES = FORMAT_NUMERIC("366", " :End of /NAMES list");
+const Format::Template Format::RPL_ENDOFBANLIST = FORMAT_NUMERIC("368", " :End of channel ban list");
+const Format::Template Format::RPL_YOUREOPER = FORMAT_NUMERIC("381", " :You are now an IRC operator");
+const Format::Template Format::ERR_PASSWDMISMATCH = FORMAT_NUMERIC("464", " :Password incorrect");
+const Format::Template Format::ERR_NOPRIVILEGES = FORMAT_NUMERIC("481", " :Permission Denied- You're not an IRC operator");
+
+Format::Line::Line(const Template &t, const std::string &nick) : _len(0)
+{
+    put(t.head, t.headLen).put(nick.data(), nick.size()).put(t.tail, t.tailLen);
+}
+
+Format::Line::Line(const Template &t, const std::string &nick, const std::string &param) : _len(0)
+{
+    put(t.head, t.headLen).put(nick.data(), nick.size()).put(" ", 1).put(param.data(), param.size()).put(t.tail, t.tailLen);
+}
+
+Format::Line &Format::Line::operator<<(unsigned long n)
+{
+    char tmp[24];
+    size_t i = sizeof(tmp);
+    do
+    {
+        tmp[--i] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n);
+    return put(tmp + i, sizeof(tmp) - i);
+}
+
+Format::Line &Format::Line::end()
+{
+    if (_len + 2 > LINE_MAX)
+        return *this;
+    _buf[_len++] = '\r';
+    _buf[_len++] = '\n';
+    return *this;
+}
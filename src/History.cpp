@@ -0,0 +1,509 @@
+#include "History.hpp"
+#include "Scan.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+
+// record layout: [int64 ts][uint32 len][payload][pad to 8], len 0 => end
+static const size_t RECORD_HEADER = 12;
+
+static size_t recordSize(size_t len)
+{
+    return (RECORD_HEADER + len + 7) & ~(size_t)7;
+}
+
+History::History()
+    : _enabled(false), _segSize(0), _maxSegments(0), _maxAge(0), _lastExpire(0), _maxMapped(0), _indexSegments(0),
+      _roMap(NULL), _roSize(0) {}
+
+History::~History()
+{
+    for (std::map<std::string, Log *>::iterator it = _logs.begin(); it != _logs.end(); ++it)
+    {
+        unmapSegment(it->second);
+        delete it->second;
+    }
+    _logs.clear();
+    if (_roMap)
+        munmap(_roMap, _roSize);
+}
+
+bool History::open(const std::string &dir, size_t segmentSize, size_t maxBytes, long maxAge,
+                   size_t maxMapped, unsigned int indexSegments)
+{
+    if (dir.empty() || segmentSize < 4096)
+        return false;
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+        return false;
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+        return false;
+    _dir = dir;
+    _segSize = segmentSize;
+    _maxSegments = maxBytes ? (unsigned int)std::max(maxBytes / segmentSize, (size_t)1) : 0;
+    _maxAge = maxAge;
+    _maxMapped = maxMapped;
+    _indexSegments = indexSegments;
+    _enabled = true;
+
+    // "<name>.<seg>.log": what earlier runs left, nothing is read yet
+    while (struct dirent *ent = readdir(d))
+    {
+        std::string file = ent->d_name;
+        size_t ext = file.size() >= 4 ? file.size() - 4 : 0;
+        size_t dot = ext ? file.rfind('.', ext - 1) : std::string::npos;
+        if (!ext || file.compare(ext, 4, ".log") != 0 || dot == std::string::npos || dot == 0 || dot + 1 == ext)
+            continue;
+        char *stop;
+        unsigned long seg = std::strtoul(file.c_str() + dot + 1, &stop, 10);
+        if (stop != file.c_str() + ext)
+            continue;
+        std::map<std::string, Range>::iterator it = _idle.find(file.substr(0, dot));
+        if (it == _idle.end())
+        {
+            Range r = {(unsigned int)seg, (unsigned int)seg + 1};
+            _idle[file.substr(0, dot)] = r;
+            continue;
+        }
+        it->second.first = std::min(it->second.first, (unsigned int)seg);
+        it->second.next = std::max(it->second.next, (unsigned int)seg + 1);
+    }
+    closedir(d);
+    expire(time(NULL));
+    return true;
+}
+
+std::string History::encodeName(const std::string &channel)
+{
+    static const char hex[] = "0123456789abcdef";
+    std::string out;
+    for (size_t i = 0; i < channel.size(); ++i)
+    {
+        unsigned char ch = (unsigned char)channel[i];
+        if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '-' || ch == '_')
+            out += (char)ch;
+        else
+        {
+            out += '%';
+            out += hex[ch >> 4];
+            out += hex[ch & 15];
+        }
+    }
+    return out;
+}
+
+std::string History::segmentPath(const std::string &base, unsigned int seg) const
+{
+    char num[16];
+    std::snprintf(num, sizeof(num), ".%u.log", seg);
+    return base + num;
+}
+
+// a fresh segment, or with `used` the active one again after it was cut
+// down to its size; the mapping outlives the fd
+bool History::mapSegment(Log *log, unsigned int seg, size_t used)
+{
+    std::string path = segmentPath(log->base, seg);
+    int fd = ::open(path.c_str(), used ? O_RDWR | O_CLOEXEC : O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    // sparse file, pages are only backed once written
+    void *p = ftruncate(fd, (off_t)_segSize) == 0
+                  ? mmap(NULL, _segSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                  : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        if (!used)
+            unlink(path.c_str());
+        return false;
+    }
+    if (_roMap && _roPath == path)
+    {
+        // mapped for replay at its old, shorter size
+        munmap(_roMap, _roSize);
+        _roMap = NULL;
+        _roPath.clear();
+    }
+    log->seg = seg;
+    log->map = (char *)p;
+    log->size = _segSize;
+    log->used = used;
+    if (log->segs.first == log->segs.next)
+        log->segs.first = seg;
+    log->segs.next = seg + 1;
+    log->lru = _mapped.insert(_mapped.end(), log);
+    while (_maxMapped && _mapped.size() > _maxMapped)
+        unmapSegment(_mapped.front());
+    return true;
+}
+
+// cut the active segment down to what it holds, an empty one goes
+void History::unmapSegment(Log *log)
+{
+    if (!log->map)
+        return;
+    _mapped.erase(log->lru);
+    munmap(log->map, log->size);
+    std::string path = segmentPath(log->base, log->seg);
+    if (log->used)
+    {
+        if (truncate(path.c_str(), (off_t)log->used) < 0)
+            std::perror("history truncate");
+    }
+    else if (log->seg + 1 == log->segs.next)
+    {
+        unlink(path.c_str());
+        log->segs.next = log->seg;
+        if (log->indexedFrom > log->segs.next)
+            log->indexedFrom = log->segs.next;
+        if (log->segs.first > log->segs.next)
+            log->segs.first = log->segs.next;
+    }
+    log->map = NULL;
+    log->size = 0;
+}
+
+// scan the segment before the indexed ones into the front of the index
+bool History::indexOlder(Log *log)
+{
+    if (log->indexedFrom <= log->segs.first)
+        return false;
+    unsigned int seg = --log->indexedFrom;
+    size_t size = 0;
+    const char *base = segmentData(log, seg, size);
+    std::vector<Entry> older;
+    size_t off = 0;
+    while (base && off + RECORD_HEADER <= size)
+    {
+        long long ts;
+        unsigned int len;
+        std::memcpy(&ts, base + off, sizeof(ts));
+        std::memcpy(&len, base + off + 8, sizeof(len));
+        if (len == 0 || off + recordSize(len) > size)
+            break;
+        Entry e;
+        e.ts = ts;
+        e.seg = seg;
+        e.off = (unsigned int)off;
+        older.push_back(e);
+        off += recordSize(len);
+    }
+    log->index.insert(log->index.begin(), older.begin(), older.end());
+    return true;
+}
+
+// back to the newest _indexSegments segments, the memory goes too
+void History::trimIndex(Log *log)
+{
+    if (!_indexSegments || log->segs.next - log->indexedFrom <= _indexSegments)
+        return;
+    unsigned int from = log->segs.next - _indexSegments;
+    size_t n = 0;
+    while (n < log->index.size() && log->index[n].seg < from)
+        ++n;
+    std::vector<Entry>(log->index.begin() + n, log->index.end()).swap(log->index);
+    log->indexedFrom = from;
+}
+
+// the oldest segment of a log, and its entries
+void History::dropSegment(Log *log)
+{
+    std::string path = segmentPath(log->base, log->segs.first);
+    unlink(path.c_str());
+    if (_roMap && _roPath == path)
+    {
+        munmap(_roMap, _roSize);
+        _roMap = NULL;
+        _roPath.clear();
+    }
+    ++log->segs.first;
+    size_t n = 0;
+    while (n < log->index.size() && log->index[n].seg < log->segs.first)
+        ++n;
+    log->index.erase(log->index.begin(), log->index.begin() + n);
+    if (log->indexedFrom < log->segs.first)
+        log->indexedFrom = log->segs.first;
+}
+
+History::Log *History::getLog(const std::string &key, bool create)
+{
+    std::map<std::string, Log *>::iterator it = _logs.find(key);
+    if (it != _logs.end())
+        return it->second;
+
+    std::string name = encodeName(key);
+    std::map<std::string, Range>::iterator idle = _idle.find(name);
+    if (!create && idle == _idle.end())
+        return NULL; // never written, reading it creates nothing
+    Log *log = new Log();
+    log->base = _dir + "/" + name;
+    log->segs.first = log->segs.next = 0;
+    if (idle != _idle.end())
+    {
+        log->segs = idle->second;
+        _idle.erase(idle);
+    }
+    log->indexedFrom = log->segs.next;
+    log->seg = 0;
+    log->map = NULL;
+    log->size = 0;
+    log->used = 0;
+    _logs[key] = log;
+    return log;
+}
+
+void History::append(const std::string &channel, long long ts, const std::string &line)
+{
+    if (!_enabled || line.empty())
+        return;
+    Log *log = getLog(Scan::folded(channel), true);
+    size_t rec = recordSize(line.size());
+    if (rec > _segSize)
+        return;
+    if (log->map && log->used + rec <= log->size)
+        _mapped.splice(_mapped.end(), _mapped, log->lru);
+    else
+    {
+        // unmapped to stay under _maxMapped: carry on where it stopped
+        bool resumed = !log->map && log->used && log->used + rec <= _segSize && log->seg + 1 == log->segs.next
+                       && log->seg >= log->segs.first && mapSegment(log, log->seg, log->used);
+        if (!resumed)
+        {
+            unsigned int next = log->segs.next;
+            unmapSegment(log);
+            if (!mapSegment(log, next, 0))
+                return;
+            while (_maxSegments && log->segs.next - log->segs.first > _maxSegments)
+                dropSegment(log);
+            trimIndex(log);
+        }
+    }
+    char *p = log->map + log->used;
+    unsigned int len = (unsigned int)line.size();
+    std::memcpy(p, &ts, sizeof(ts));
+    std::memcpy(p + 8, &len, sizeof(len));
+    std::memcpy(p + RECORD_HEADER, line.data(), line.size());
+
+    Entry e;
+    e.ts = ts;
+    e.seg = log->seg;
+    e.off = (unsigned int)log->used;
+    log->index.push_back(e);
+    log->used += rec;
+}
+
+void History::forget(const std::string &channel)
+{
+    std::map<std::string, Log *>::iterator it = _logs.find(Scan::folded(channel));
+    if (it == _logs.end())
+        return;
+    Log *log = it->second;
+    unmapSegment(log);
+    if (log->segs.first != log->segs.next)
+        _idle[log->base.substr(_dir.size() + 1)] = log->segs;
+    delete log;
+    _logs.erase(it);
+}
+
+// unlinks the oldest segments below `keep` while they are past the max age
+void History::expireRange(const std::string &base, Range &segs, unsigned int keep, time_t now)
+{
+    while (segs.first < keep)
+    {
+        struct stat st;
+        if (stat(segmentPath(base, segs.first).c_str(), &st) == 0 && now - st.st_mtime < _maxAge)
+            break;
+        unlink(segmentPath(base, segs.first).c_str());
+        ++segs.first;
+    }
+}
+
+void History::expire(time_t now)
+{
+    if (!_enabled || now - _lastExpire < 60)
+        return;
+    _lastExpire = now;
+    // older segments indexed for a query that reached back
+    for (std::map<std::string, Log *>::iterator it = _logs.begin(); it != _logs.end(); ++it)
+        trimIndex(it->second);
+    if (_maxAge <= 0)
+        return;
+    for (std::map<std::string, Range>::iterator it = _idle.begin(); it != _idle.end();)
+    {
+        expireRange(_dir + "/" + it->first, it->second, it->second.next, now);
+        if (it->second.first == it->second.next)
+            _idle.erase(it++);
+        else
+            ++it;
+    }
+    for (std::map<std::string, Log *>::iterator it = _logs.begin(); it != _logs.end(); ++it)
+    {
+        Log *log = it->second;
+        // the active segment is being written, it is not old
+        unsigned int keep = log->map ? log->seg : log->segs.next;
+        Range r = log->segs;
+        expireRange(log->base, r, keep, now);
+        while (log->segs.first < r.first)
+            dropSegment(log);
+    }
+}
+
+static bool entryBefore(const History::Entry &e, long long ts) { return e.ts < ts; }
+static bool entryAfter(long long ts, const History::Entry &e) { return ts < e.ts; }
+
+size_t History::select(const std::string &channel, Mode mode, long long ts, size_t limit, size_t &first, bool &more)
+{
+    first = 0;
+    more = false;
+    if (!_enabled)
+        return 0;
+    Log *log = getLog(Scan::folded(channel), false);
+    if (!log)
+        return 0;
+    const std::vector<Entry> &idx = log->index;
+    // reach back into older segments only as far as the answer needs, one
+    // segment per call so a deep query does not hold up the loop
+    bool older;
+    if (mode == BEFORE)
+        older = (size_t)(std::lower_bound(idx.begin(), idx.end(), ts, entryBefore) - idx.begin()) < limit;
+    else if (mode == AFTER)
+        older = idx.empty() || idx.front().ts > ts;
+    else
+        older = idx.size() < limit && (idx.empty() || idx.front().ts > ts);
+    if (older && indexOlder(log))
+    {
+        more = true;
+        return 0;
+    }
+    size_t n;
+    if (mode == BEFORE)
+    {
+        size_t pos = std::lower_bound(idx.begin(), idx.end(), ts, entryBefore) - idx.begin();
+        n = pos < limit ? pos : limit;
+        first = pos - n;
+    }
+    else if (mode == AFTER)
+    {
+        first = std::upper_bound(idx.begin(), idx.end(), ts, entryAfter) - idx.begin();
+        n = idx.size() - first;
+        if (n > limit)
+            n = limit;
+    }
+    else
+    {
+        n = idx.size() < limit ? idx.size() : limit;
+        first = idx.size() - n;
+        if (ts > 0)
+        {
+            size_t pos = std::upper_bound(idx.begin(), idx.end(), ts, entryAfter) - idx.begin();
+            if (pos > first)
+            {
+                first = pos;
+                n = idx.size() - pos;
+            }
+        }
+    }
+    return n;
+}
+
+const char *History::segmentData(Log *log, unsigned int seg, size_t &size)
+{
+    if (log->map && seg == log->seg)
+    {
+        size = log->used;
+        return log->map;
+    }
+    std::string path = segmentPath(log->base, seg);
+    if (_roMap && _roPath == path)
+    {
+        size = _roSize;
+        return _roMap;
+    }
+    if (_roMap)
+        munmap(_roMap, _roSize);
+    _roMap = NULL;
+    _roPath.clear();
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    _roMap = (char *)p;
+    _roSize = (size_t)st.st_size;
+    _roPath = path;
+    size = _roSize;
+    return _roMap;
+}
+
+bool History::fetch(const std::string &channel, size_t idx, const char *&data, size_t &len, long long &ts)
+{
+    std::map<std::string, Log *>::iterator it = _logs.find(Scan::folded(channel));
+    if (it == _logs.end() || idx >= it->second->index.size())
+        return false;
+    const Entry &e = it->second->index[idx];
+    size_t size = 0;
+    const char *base = segmentData(it->second, e.seg, size);
+    unsigned int l;
+    if (!base || e.off + RECORD_HEADER > size)
+        return false;
+    std::memcpy(&l, base + e.off + 8, sizeof(l));
+    if (e.off + RECORD_HEADER + l > size)
+        return false;
+    data = base + e.off + RECORD_HEADER;
+    len = l;
+    ts = e.ts;
+    return true;
+}
+
+long long History::now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+std::string History::formatTime(long long ms)
+{
+    time_t sec = (time_t)(ms / 1000);
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+    char buf[32];
+    size_t n = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+    std::snprintf(buf + n, sizeof(buf) - n, ".%03dZ", (int)(ms % 1000));
+    return buf;
+}
+
+bool History::parseTime(const std::string &s, long long &ms)
+{
+    struct tm tm;
+    std::memset(&tm, 0, sizeof(tm));
+    int frac = 0;
+    int n = std::sscanf(s.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d.%3d",
+                        &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                        &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &frac);
+    if (n < 6)
+        return false;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    ms = (long long)timegm(&tm) * 1000 + (n == 7 ? frac : 0);
+    return true;
+}
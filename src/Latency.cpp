@@ -0,0 +1,185 @@
+#include "Latency.hpp"
+#include <time.h>
+
+namespace
+{
+    const unsigned long long MAX_NS = (1ULL << 41) - 1; // last bucket holds anything slower
+
+    struct Histogram
+    {
+        unsigned long long counts[Latency::BUCKETS];
+        unsigned long long sumNs;
+        unsigned long long maxNs;
+    };
+
+    Histogram g_hist[Latency::CLASSES];
+    bool g_enabled = true;
+
+    void raiseMax(unsigned long long *slot, unsigned long long v)
+    {
+        unsigned long long cur = *slot;
+        while (v > cur)
+        {
+            unsigned long long seen = __sync_val_compare_and_swap(slot, cur, v);
+            if (seen == cur)
+                return;
+            cur = seen;
+        }
+    }
+
+    // highest value that lands in bucket `b`
+    unsigned long long upperEdge(size_t b)
+    {
+        if (b < 16)
+            return b;
+        size_t shift = (b - 16) / 16;
+        return ((17ULL + (b - 16) % 16) << shift) - 1;
+    }
+
+    unsigned long long percentile(const unsigned long long *counts, unsigned long long total, unsigned long long basisPoints)
+    {
+        unsigned long long want = (total * basisPoints + 9999) / 10000; // rank, rounded up
+        if (want == 0)
+            want = 1;
+        unsigned long long seen = 0;
+        for (size_t b = 0; b < Latency::BUCKETS; ++b)
+        {
+            seen += counts[b];
+            if (seen >= want)
+                return upperEdge(b);
+        }
+        return upperEdge(Latency::BUCKETS - 1);
+    }
+}
+
+void Latency::setEnabled(bool on)
+{
+    g_enabled = on;
+}
+
+bool Latency::enabled()
+{
+    return g_enabled;
+}
+
+unsigned long long Latency::now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+Latency::Class Latency::classFor(size_t members)
+{
+    if (members < 10)
+        return CHAN_1;
+    if (members < 100)
+        return CHAN_10;
+    if (members < 1000)
+        return CHAN_100;
+    if (members < 10000)
+        return CHAN_1000;
+    return CHAN_10000;
+}
+
+Latency::Stamp Latency::stamp(Class c)
+{
+    Stamp s;
+    s.cls = g_enabled ? (unsigned int)c : (unsigned int)NONE;
+    s.ns = g_enabled ? now() : 0;
+    return s;
+}
+
+size_t Latency::bucketOf(unsigned long long ns)
+{
+    if (ns < 16)
+        return (size_t)ns;
+    if (ns > MAX_NS)
+        ns = MAX_NS;
+    size_t msb = 63 - (size_t)__builtin_clzll(ns);
+    return 16 + (msb - 4) * 16 + (size_t)((ns >> (msb - 4)) & 15);
+}
+
+void Latency::record(unsigned int cls, unsigned long long ns, unsigned long long copies)
+{
+    if (cls >= CLASSES || copies == 0)
+        return;
+    Histogram &h = g_hist[cls];
+    __sync_fetch_and_add(&h.counts[bucketOf(ns)], copies);
+    __sync_fetch_and_add(&h.sumNs, ns * copies);
+    raiseMax(&h.maxNs, ns);
+}
+
+void Latency::Batch::add(unsigned long long ns)
+{
+    size_t b = bucketOf(ns);
+    if (_n && b != _bucket)
+        flush();
+    _bucket = b;
+    _sumNs += ns;
+    if (ns > _maxNs)
+        _maxNs = ns;
+    ++_n;
+}
+
+void Latency::Batch::flush()
+{
+    if (!_n || _cls >= CLASSES)
+    {
+        _n = 0;
+        return;
+    }
+    Histogram &h = g_hist[_cls];
+    __sync_fetch_and_add(&h.counts[_bucket], _n);
+    __sync_fetch_and_add(&h.sumNs, _sumNs);
+    raiseMax(&h.maxNs, _maxNs);
+    _n = 0;
+    _sumNs = 0;
+    _maxNs = 0;
+}
+
+Latency::Summary Latency::summary(Class c)
+{
+    unsigned long long counts[BUCKETS] = {0};
+    Summary s = Summary();
+    for (unsigned int k = 0; k < CLASSES; ++k)
+    {
+        if (c != CLASSES && k != (unsigned int)c)
+            continue;
+        Histogram &h = g_hist[k];
+        for (size_t b = 0; b < BUCKETS; ++b)
+            counts[b] += __sync_fetch_and_add(&h.counts[b], 0ULL);
+        s.sumNs += __sync_fetch_and_add(&h.sumNs, 0ULL);
+        unsigned long long m = __sync_fetch_and_add(&h.maxNs, 0ULL);
+        if (m > s.maxNs)
+            s.maxNs = m;
+    }
+    for (size_t b = 0; b < BUCKETS; ++b)
+        s.count += counts[b];
+    if (!s.count)
+        return s;
+    s.p50 = percentile(counts, s.count, 5000);
+    s.p90 = percentile(counts, s.count, 9000);
+    s.p99 = percentile(counts, s.count, 9900);
+    s.p999 = percentile(counts, s.count, 9990);
+    return s;
+}
+
+const char *Latency::name(Class c)
+{
+    static const char *names[CLASSES + 1] = {"direct", "chan_1-9", "chan_10-99", "chan_100-999", "chan_1k-9k", "chan_10k+", "all"};
+    return c <= CLASSES ? names[c] : "?";
+}
+
+void Latency::reset()
+{
+    // racing records may survive or vanish, fine for a measurement window
+    for (unsigned int k = 0; k < CLASSES; ++k)
+    {
+        Histogram &h = g_hist[k];
+        for (size_t b = 0; b < BUCKETS; ++b)
+            __sync_fetch_and_and(&h.counts[b], 0ULL);
+        __sync_fetch_and_and(&h.sumNs, 0ULL);
+        __sync_fetch_and_and(&h.maxNs, 0ULL);
+    }
+}
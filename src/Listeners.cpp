@@ -0,0 +1,142 @@
+#include "Server.hpp"
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+// Extra endpoints from the config, one per "listen" line:
+//   listen 6668                      all interfaces
+//   listen 127.0.0.1:6668            one address
+//   listen unix:/run/ircserv.sock 0660
+//   listen ws:8080                   WebSocket, also ws:<addr>:<port>
+// A unix socket is only as open as its file mode, that is the access control.
+// There is no TLS here, browsers reach a ws: port as ws:// or through a
+// terminating proxy.
+
+static int bindTcp(const std::string &addr, int port)
+{
+    sockaddr_in sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    if (addr.empty())
+        sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    else if (inet_pton(AF_INET, addr.c_str(), &sa.sin_addr) != 1)
+        return -1;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (bind(fd, (sockaddr *)&sa, sizeof(sa)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int bindUnix(const std::string &path, mode_t mode)
+{
+    sockaddr_un sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(sa.sun_path))
+        return -1;
+    std::memcpy(sa.sun_path, path.c_str(), path.size());
+
+    // a socket file left by a crash would make bind() fail, anything else stays
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    mode_t old = umask(0177); // never reachable by others between bind and chmod
+    int rc = bind(fd, (sockaddr *)&sa, sizeof(sa));
+    umask(old);
+    if (rc < 0 || chmod(path.c_str(), mode) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool Server::openListener(const std::string &spec)
+{
+    std::istringstream iss(spec);
+    std::string where, modeStr;
+    iss >> where >> modeStr;
+
+    Listener l;
+    l.spec = spec;
+    l.fd = -1;
+    l.webSocket = isWebSocketSpec(spec);
+    if (l.webSocket)
+        where.erase(0, 3);
+    if (where.compare(0, 5, "unix:") == 0)
+    {
+        mode_t mode = modeStr.empty() ? 0660 : (mode_t)std::strtol(modeStr.c_str(), NULL, 8);
+        l.unixPath = where.substr(5);
+        l.fd = bindUnix(l.unixPath, mode);
+    }
+    else
+    {
+        std::string::size_type colon = where.rfind(':');
+        std::string addr = colon == std::string::npos ? "" : where.substr(0, colon);
+        int port = std::atoi(where.c_str() + (colon == std::string::npos ? 0 : colon + 1));
+        if (port > 0 && port < 65536)
+            l.fd = bindTcp(addr, port);
+    }
+    if (l.fd < 0 || listen(l.fd, SOMAXCONN) < 0)
+    {
+        if (l.fd >= 0)
+            close(l.fd);
+        std::cerr << "listen " << spec << " failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    setNonBlocking(l.fd);
+    _listeners.push_back(l);
+    return true;
+}
+
+void Server::setupListeners()
+{
+    const std::vector<std::string> &specs = _config.getAll("listen");
+    for (size_t i = 0; i < specs.size(); ++i)
+    {
+        // after an upgrade the sockets we were handed are already open
+        bool open = false;
+        for (size_t j = 0; j < _listeners.size() && !open; ++j)
+            open = _listeners[j].spec == specs[i];
+        if (!open)
+            openListener(specs[i]);
+    }
+}
+
+bool Server::isListener(int fd) const
+{
+    for (size_t i = 0; i < _listeners.size(); ++i)
+    {
+        if (_listeners[i].fd == fd)
+            return true;
+    }
+    return false;
+}
+
+bool Server::isWebSocketSpec(const std::string &spec)
+{
+    return spec.compare(0, 3, "ws:") == 0;
+}
+
+bool Server::isWebSocketListener(int fd) const
+{
+    for (size_t i = 0; i < _listeners.size(); ++i)
+    {
+        if (_listeners[i].fd == fd)
+            return _listeners[i].webSocket;
+    }
+    return false;
+}
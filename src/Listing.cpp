@@ -0,0 +1,240 @@
+#include "Server.hpp"
+
+// LIST and WHO never format the whole answer at once: the request becomes a
+// cursor that emits at most _cursorChunk entries per loop iteration, and only
+// while the client's own backlog is below _cursorBacklog. The cursor resumes
+// from the last key it emitted, so channels or members coming and going
+// in between are fine. CHATHISTORY rides the same cursors, indexing one
+// older history segment per iteration until it can answer.
+
+// requests a client may have waiting behind the running one
+static const size_t MAX_QUEUED_CURSORS = 8;
+
+static bool hasWildcard(const std::string &s)
+{
+    return s.find_first_of("*?") != std::string::npos;
+}
+
+void Server::handleLIST(Client *c, const std::string &args)
+{
+    if (!c->isRegistered())
+    {
+        outputMessage(c, ":You have not registered");
+        return;
+    }
+    // LIST [#chan,#mask*,>n,<n,T:topicmask]
+    std::istringstream iss(args);
+    std::string params;
+    iss >> params;
+
+    ListCursor cur;
+    cur.kind = ListCursor::LIST;
+    cur.lastFd = -1;
+    cur.started = false;
+    cur.minUsers = -1;
+    cur.maxUsers = -1;
+
+    std::vector<std::string> exact;
+    std::vector<std::string> items = splitList(params);
+    for (size_t i = 0; i < items.size(); ++i)
+    {
+        const std::string &p = items[i];
+        if (p[0] == '>')
+            cur.minUsers = std::atoi(p.c_str() + 1);
+        else if (p[0] == '<')
+            cur.maxUsers = std::atoi(p.c_str() + 1);
+        else if (p.compare(0, 2, "T:") == 0)
+            cur.topicMask = p.substr(2);
+        else if (hasWildcard(p))
+            cur.masks.push_back(p);
+        else
+            exact.push_back(p);
+    }
+
+    // plain names are direct lookups, no need to walk the registry
+    if (!exact.empty() && cur.masks.empty())
+    {
+        for (size_t i = 0; i < exact.size(); ++i)
+        {
+            Channel *ch = findChannel(exact[i]);
+            if (ch && listMatches(cur, ch))
+                sendListEntry(c, ch);
+        }
+        reply(c, Format::Line(Format::RPL_LISTEND, c->getNickname()).end());
+        return;
+    }
+    cur.masks.insert(cur.masks.end(), exact.begin(), exact.end());
+    queueCursor(c, cur, "LIST");
+}
+
+void Server::handleWHO(Client *c, const std::string &args)
+{
+    if (!c->isRegistered())
+    {
+        outputMessage(c, ":You have not registered");
+        return;
+    }
+    std::istringstream iss(args);
+    std::string mask;
+    iss >> mask;
+    if (mask.empty() || mask == "0")
+        mask = "*";
+
+    ListCursor cur;
+    cur.target = mask;
+    cur.lastFd = -1;
+    cur.started = false;
+    cur.minUsers = -1;
+    cur.maxUsers = -1;
+    cur.kind = (mask[0] == '#') ? ListCursor::WHO_CHANNEL : ListCursor::WHO_MASK;
+    queueCursor(c, cur, "WHO");
+}
+
+bool Server::listMatches(const ListCursor &cur, const Channel *ch) const
+{
+    int users = (int)ch->getMembers().size();
+    if (cur.minUsers >= 0 && users <= cur.minUsers)
+        return false;
+    if (cur.maxUsers >= 0 && users >= cur.maxUsers)
+        return false;
+    if (!cur.topicMask.empty() && !maskMatch(cur.topicMask, ch->getTopic()))
+        return false;
+    if (cur.masks.empty())
+        return true;
+    for (size_t i = 0; i < cur.masks.size(); ++i)
+    {
+        if (maskMatch(cur.masks[i], ch->getName()))
+            return true;
+    }
+    return false;
+}
+
+void Server::sendListEntry(Client *c, const Channel *ch)
+{
+    Format::Line line;
+    line << ":localhost 322 " << c->getNickname() << ' ' << ch->getName() << ' '
+         << (unsigned long)ch->getMembers().size() << " :" << ch->getTopic();
+    reply(c, line.end());
+}
+
+void Server::sendWhoEntry(Client *c, const std::string &chan, Client *who, bool op)
+{
+    Format::Line line;
+    line << ":localhost 352 " << c->getNickname() << ' ' << chan << ' ' << who->getUsername() << ' '
+         << who->getHostname() << " localhost " << who->getNickname() << (op ? " H@" : " H") << " :0 " << who->getRealname();
+    reply(c, line.end());
+}
+
+// a second LIST or WHO waits for the first one to finish, each gets its end reply
+void Server::queueCursor(Client *c, const ListCursor &cur, const char *cmd)
+{
+    std::deque<ListCursor> &q = _cursors[c->getFd()];
+    if (q.size() > MAX_QUEUED_CURSORS)
+    {
+        Format::Line line;
+        reply(c, (line << ":localhost 263 " << c->getNickname() << ' ' << cmd << " :Please wait a while and try again.").end());
+        return;
+    }
+    q.push_back(cur);
+}
+
+bool Server::hasRunnableCursor() const
+{
+    for (std::map<int, std::deque<ListCursor> >::const_iterator it = _cursors.begin(); it != _cursors.end(); ++it)
+    {
+        std::map<int, Client *>::const_iterator ci = _clients.find(it->first);
+        if (ci != _clients.end() && ci->second->pendingBytes() < _cursorBacklog)
+            return true;
+    }
+    return false;
+}
+
+void Server::pumpCursors()
+{
+    for (std::map<int, std::deque<ListCursor> >::iterator it = _cursors.begin(); it != _cursors.end();)
+    {
+        std::map<int, Client *>::iterator ci = _clients.find(it->first);
+        if (ci == _clients.end())
+        {
+            _cursors.erase(it++);
+            continue;
+        }
+        // a slow reader only holds back its own listing
+        if (ci->second->pendingBytes() >= _cursorBacklog)
+        {
+            ++it;
+            continue;
+        }
+        std::deque<ListCursor> &q = it->second;
+        if (stepCursor(ci->second, q.front()))
+            q.pop_front();
+        if (q.empty())
+            _cursors.erase(it++);
+        else
+            ++it;
+    }
+}
+
+bool Server::stepCursor(Client *c, ListCursor &cur)
+{
+    size_t emitted = 0;
+    size_t scanned = 0;
+    size_t maxScan = _cursorChunk * 16; // filters may skip a lot, bound that too
+
+    if (cur.kind == ListCursor::HISTORY)
+        return stepHistory(c, cur);
+
+    if (cur.kind == ListCursor::LIST)
+    {
+        std::map<std::string, Channel *>::iterator ct = cur.started ? _channels.upper_bound(cur.lastName) : _channels.begin();
+        cur.started = true;
+        for (; ct != _channels.end() && emitted < _cursorChunk && scanned < maxScan; ++ct, ++scanned)
+        {
+            cur.lastName = ct->first;
+            if (!listMatches(cur, ct->second))
+                continue;
+            sendListEntry(c, ct->second);
+            ++emitted;
+        }
+        if (ct != _channels.end())
+            return false;
+        reply(c, Format::Line(Format::RPL_LISTEND, c->getNickname()).end());
+        return true;
+    }
+
+    if (cur.kind == ListCursor::WHO_CHANNEL)
+    {
+        Channel *ch = findChannel(cur.target);
+        if (ch)
+        {
+            const std::map<int, Client *> &m = ch->getMembers();
+            std::map<int, Client *>::const_iterator mi = cur.started ? m.upper_bound(cur.lastFd) : m.begin();
+            cur.started = true;
+            for (; mi != m.end() && emitted < _cursorChunk; ++mi, ++emitted)
+            {
+                cur.lastFd = mi->first;
+                sendWhoEntry(c, ch->getName(), mi->second, ch->isOperator(mi->first));
+            }
+            if (mi != m.end())
+                return false;
+        }
+    }
+    else
+    {
+        std::map<std::string, Client *>::iterator ni = cur.started ? _nicks.upper_bound(cur.lastName) : _nicks.begin();
+        cur.started = true;
+        for (; ni != _nicks.end() && emitted < _cursorChunk && scanned < maxScan; ++ni, ++scanned)
+        {
+            cur.lastName = ni->first;
+            // a bare nick mask, or nick!user@host as in WHO *@host
+            if (!maskMatch(cur.target, ni->second->getNickname()) && !maskMatch(cur.target, ni->second->getMask()))
+                continue;
+            sendWhoEntry(c, "*", ni->second, false);
+            ++emitted;
+        }
+        if (ni != _nicks.end())
+            return false;
+    }
+    reply(c, Format::Line(Format::RPL_ENDOFWHO, c->getNickname(), cur.target).end());
+    return true;
+}
@@ -0,0 +1,188 @@
+#include "Mask.hpp"
+#include <cctype>
+
+static char lower(char c)
+{
+    return (char)std::tolower((unsigned char)c);
+}
+
+bool maskMatch(const std::string &mask, const std::string &str)
+{
+    size_t m = 0, s = 0;
+    size_t starM = std::string::npos, starS = 0;
+    while (s < str.size())
+    {
+        // '*' first: a literal '*' in the subject is still just a char to it
+        if (m < mask.size() && mask[m] == '*')
+        {
+            starM = m++;
+            starS = s;
+        }
+        else if (m < mask.size() && (mask[m] == '?' || lower(mask[m]) == lower(str[s])))
+        {
+            ++m;
+            ++s;
+        }
+        else if (starM != std::string::npos)
+        {
+            // let the last '*' swallow one more char
+            m = starM + 1;
+            s = ++starS;
+        }
+        else
+            return false;
+    }
+    while (m < mask.size() && mask[m] == '*')
+        ++m;
+    return m == mask.size();
+}
+
+MaskMatcher::MaskMatcher() : _gen(0)
+{
+    newNode(false);
+}
+
+int MaskMatcher::newNode(bool isStar)
+{
+    Node n;
+    n.any = -1;
+    n.star = -1;
+    n.isStar = isStar;
+    n.accept = false;
+    n.acceptRest = false;
+    _nodes.push_back(n);
+    return (int)_nodes.size() - 1;
+}
+
+void MaskMatcher::insert(const std::string &mask)
+{
+    int cur = 0;
+    for (size_t i = 0; i < mask.size(); ++i)
+    {
+        char ch = mask[i];
+        if (ch == '*')
+        {
+            while (i + 1 < mask.size() && mask[i + 1] == '*')
+                ++i;
+            if (_nodes[cur].star < 0)
+            {
+                int n = newNode(true);
+                _nodes[cur].star = n;
+            }
+            cur = _nodes[cur].star;
+        }
+        else if (ch == '?')
+        {
+            if (_nodes[cur].any < 0)
+            {
+                int n = newNode(false);
+                _nodes[cur].any = n;
+            }
+            cur = _nodes[cur].any;
+        }
+        else
+        {
+            ch = lower(ch);
+            std::map<char, int>::iterator it = _nodes[cur].next.find(ch);
+            if (it == _nodes[cur].next.end())
+            {
+                int n = newNode(false);
+                _nodes[cur].next[ch] = n;
+                cur = n;
+            }
+            else
+                cur = it->second;
+        }
+    }
+    _nodes[cur].accept = true;
+    if (_nodes[cur].isStar)
+        _nodes[cur].acceptRest = true;
+}
+
+void MaskMatcher::build(const std::vector<std::string> &masks)
+{
+    _literals.clear();
+    _nodes.clear();
+    newNode(false);
+    for (size_t i = 0; i < masks.size(); ++i)
+    {
+        const std::string &m = masks[i];
+        if (m.find_first_of("*?") == std::string::npos)
+        {
+            std::string l(m);
+            for (size_t j = 0; j < l.size(); ++j)
+                l[j] = lower(l[j]);
+            _literals.insert(l);
+        }
+        else
+            insert(m);
+    }
+    _seen.assign(_nodes.size(), 0);
+    _gen = 0;
+}
+
+void MaskMatcher::nextGeneration() const
+{
+    if (++_gen == 0)
+    {
+        _seen.assign(_nodes.size(), 0);
+        _gen = 1;
+    }
+}
+
+// returns true once a mask ending in '*' is reached
+bool MaskMatcher::addState(int n, std::vector<int> &set) const
+{
+    while (n >= 0 && _seen[n] != _gen)
+    {
+        _seen[n] = _gen;
+        set.push_back(n);
+        if (_nodes[n].acceptRest)
+            return true;
+        n = _nodes[n].star; // '*' also matches nothing
+    }
+    return false;
+}
+
+bool MaskMatcher::matches(const std::string &subject) const
+{
+    if (!_literals.empty())
+    {
+        std::string l(subject);
+        for (size_t j = 0; j < l.size(); ++j)
+            l[j] = lower(l[j]);
+        if (_literals.find(l) != _literals.end())
+            return true;
+    }
+    if (_nodes.size() <= 1)
+        return false;
+
+    _cur.clear();
+    nextGeneration();
+    if (addState(0, _cur))
+        return true;
+    for (size_t i = 0; i < subject.size() && !_cur.empty(); ++i)
+    {
+        char ch = lower(subject[i]);
+        _nxt.clear();
+        nextGeneration();
+        for (size_t k = 0; k < _cur.size(); ++k)
+        {
+            const Node &node = _nodes[_cur[k]];
+            if (node.isStar && addState(_cur[k], _nxt))
+                return true;
+            std::map<char, int>::const_iterator it = node.next.find(ch);
+            if (it != node.next.end() && addState(it->second, _nxt))
+                return true;
+            if (node.any >= 0 && addState(node.any, _nxt))
+                return true;
+        }
+        _cur.swap(_nxt);
+    }
+    for (size_t k = 0; k < _cur.size(); ++k)
+    {
+        if (_nodes[_cur[k]].accept)
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,161 @@
+#include "Server.hpp"
+
+// IRCv3 MONITOR. _watchers maps a folded nick to the clients watching it,
+// so a presence change only touches those; _monitoring is the per client
+// side, for MONITOR L/S and the cleanup on disconnect. Only registered
+// clients count as online.
+
+static const size_t MONITOR_LINE = 400; // targets per numeric line, in bytes
+
+// `head` lines with the items comma separated, split to stay short
+static std::string batch(const std::string &head, const std::vector<std::string> &items)
+{
+    std::string out, line;
+    for (size_t i = 0; i < items.size(); ++i)
+    {
+        if (!line.empty() && line.size() + items[i].size() + 1 > MONITOR_LINE)
+        {
+            out += head + line + "\r\n";
+            line.clear();
+        }
+        line += (line.empty() ? "" : ",") + items[i];
+    }
+    if (!line.empty())
+        out += head + line + "\r\n";
+    return out;
+}
+
+bool Server::addMonitor(Client *c, const std::string &target)
+{
+    std::map<std::string, std::string> &mine = _monitoring[c->getFd()];
+    std::string key = Scan::folded(target);
+    if (mine.find(key) != mine.end())
+        return true;
+    if (mine.size() >= _monitorLimit)
+    {
+        if (mine.empty())
+            _monitoring.erase(c->getFd());
+        return false;
+    }
+    mine[key] = target;
+    _watchers[key].insert(c);
+    return true;
+}
+
+void Server::removeMonitor(Client *c, const std::string &key)
+{
+    std::map<std::string, std::set<Client *> >::iterator w = _watchers.find(key);
+    if (w == _watchers.end())
+        return;
+    w->second.erase(c);
+    if (w->second.empty())
+        _watchers.erase(w);
+}
+
+void Server::clearMonitors(Client *c)
+{
+    std::map<int, std::map<std::string, std::string> >::iterator it = _monitoring.find(c->getFd());
+    if (it == _monitoring.end())
+        return;
+    for (std::map<std::string, std::string>::iterator t = it->second.begin(); t != it->second.end(); ++t)
+        removeMonitor(c, t->first);
+    _monitoring.erase(it);
+}
+
+void Server::monitorPresence(Client *who, const std::string &nick, bool online)
+{
+    std::map<std::string, std::set<Client *> >::iterator w = _watchers.find(Scan::folded(nick));
+    if (w == _watchers.end())
+        return;
+    const std::string &target = online ? who->getMask() : nick;
+    const char *numeric = online ? ":localhost 730 " : ":localhost 731 ";
+    for (std::set<Client *>::iterator it = w->second.begin(); it != w->second.end(); ++it)
+    {
+        Format::Line line;
+        reply(*it, (line << numeric << (*it)->getNickname() << " :" << target).end());
+    }
+}
+
+void Server::handleMONITOR(Client *c, const std::string &args)
+{
+    if (!c->isRegistered())
+    {
+        outputMessage(c, ":You have not registered");
+        return;
+    }
+    std::istringstream iss(args);
+    std::string op, targets;
+    iss >> op >> targets;
+    std::string me = c->getNickname();
+    std::vector<std::string> online, offline;
+    std::string full;                  // 734, after the status of what did fit
+
+    if (op == "+")
+    {
+        std::vector<std::string> items = splitList(targets);
+        for (size_t i = 0; i < items.size(); ++i)
+        {
+            if (!Scan::validNick(items[i].data(), items[i].size()))
+                continue;
+            if (!addMonitor(c, items[i]))
+            {
+                std::string rest; // the targets not added, this one included
+                for (size_t j = i; j < items.size(); ++j)
+                    rest += (j == i ? "" : ",") + items[j];
+                std::ostringstream oss;
+                oss << ":localhost 734 " << me << " " << _monitorLimit << " " << rest << " :Monitor list is full.\r\n";
+                full = oss.str();
+                break;
+            }
+            Client *o = findByNick(items[i]);
+            if (o && o->isRegistered())
+                online.push_back(o->getMask());
+            else
+                offline.push_back(items[i]);
+        }
+    }
+    else if (op == "-")
+    {
+        std::map<int, std::map<std::string, std::string> >::iterator it = _monitoring.find(c->getFd());
+        std::vector<std::string> items = splitList(targets);
+        for (size_t i = 0; it != _monitoring.end() && i < items.size(); ++i)
+        {
+            std::string key = Scan::folded(items[i]);
+            if (it->second.erase(key))
+                removeMonitor(c, key);
+        }
+        if (it != _monitoring.end() && it->second.empty())
+            _monitoring.erase(it);
+    }
+    else if (op == "C" || op == "c")
+        clearMonitors(c);
+    else if (op == "L" || op == "l" || op == "S" || op == "s")
+    {
+        bool list = op == "L" || op == "l";
+        std::map<int, std::map<std::string, std::string> >::iterator it = _monitoring.find(c->getFd());
+        if (it != _monitoring.end())
+        {
+            for (std::map<std::string, std::string>::iterator t = it->second.begin(); t != it->second.end(); ++t)
+            {
+                Client *o = list ? NULL : findByNick(t->second);
+                if (o && o->isRegistered())
+                    online.push_back(o->getMask());
+                else
+                    offline.push_back(t->second);
+            }
+        }
+        if (list)
+        {
+            reply(c, batch(":localhost 732 " + me + " :", offline) + ":localhost 733 " + me + " :End of MONITOR list\r\n");
+            return;
+        }
+    }
+    else
+    {
+        outputMessage(c, "MONITOR :Unknown subcommand");
+        return;
+    }
+    std::string out = batch(":localhost 730 " + me + " :", online) + batch(":localhost 731 " + me + " :", offline) + full;
+    if (!out.empty())
+        reply(c, out);
+}
@@ -0,0 +1,59 @@
+#include "Server.hpp"
+
+// The host side of ircserv_plugin.h: plugins listed as "plugin <path>"
+// config lines are loaded once at startup and call back in through these.
+
+void Server::loadPlugins()
+{
+    _pluginHost.abi = IRCSERV_PLUGIN_ABI;
+    _pluginHost.server = this;
+    _pluginHost.add_hook = &Server::pluginAddHook;
+    _pluginHost.send_fd = &Server::pluginSendFd;
+    _pluginHost.send_nick = &Server::pluginSendNick;
+    _pluginHost.send_channel = &Server::pluginSendChannel;
+    _pluginHost.log = &Server::pluginLog;
+
+    const std::vector<std::string> &paths = _config.getAll("plugin");
+    for (size_t i = 0; i < paths.size(); ++i)
+        _plugins.load(paths[i], &_pluginHost);
+}
+
+int Server::pluginAddHook(void *server, const char *cmd, int when, ircserv_hook fn, void *ctx)
+{
+    return static_cast<Server *>(server)->_plugins.addHook(cmd, when, fn, ctx);
+}
+
+int Server::pluginSendFd(void *server, int fd, const char *line, size_t len)
+{
+    Server *s = static_cast<Server *>(server);
+    std::map<int, Client *>::iterator it = s->_clients.find(fd);
+    if (it == s->_clients.end() || !line)
+        return -1;
+    s->reply(it->second, std::string(line, len));
+    return 0;
+}
+
+int Server::pluginSendNick(void *server, const char *nick, const char *line, size_t len)
+{
+    Server *s = static_cast<Server *>(server);
+    Client *c = nick ? s->findByNick(nick) : NULL;
+    if (!c || !line)
+        return -1;
+    s->reply(c, std::string(line, len));
+    return 0;
+}
+
+int Server::pluginSendChannel(void *server, const char *chan, const char *line, size_t len, int excludeFd)
+{
+    Server *s = static_cast<Server *>(server);
+    Channel *ch = chan ? s->findChannel(chan) : NULL;
+    if (!ch || !line)
+        return -1;
+    s->channelBroadcast(ch, std::string(line, len), excludeFd);
+    return 0;
+}
+
+void Server::pluginLog(void *, const char *text)
+{
+    std::cout << "plugin: " << (text ? text : "") << std::endl;
+}
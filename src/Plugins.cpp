@@ -0,0 +1,148 @@
+#include "Plugins.hpp"
+#include <dlfcn.h>
+#include <ctime>
+#include <cctype>
+#include <iostream>
+
+static unsigned long long nowNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+Plugins::Plugins() : _loading(0) {}
+
+Plugins::~Plugins()
+{
+    unloadAll();
+}
+
+bool Plugins::load(const std::string &path, const ircserv_host *host)
+{
+    void *h = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!h)
+    {
+        std::cerr << "plugin " << path << ": " << dlerror() << std::endl;
+        return false;
+    }
+    ircserv_plugin_init_fn init = reinterpret_cast<ircserv_plugin_init_fn>(dlsym(h, "ircserv_plugin_init"));
+    if (!init)
+    {
+        std::cerr << "plugin " << path << ": no ircserv_plugin_init" << std::endl;
+        dlclose(h);
+        return false;
+    }
+
+    std::string::size_type slash = path.rfind('/');
+    _loading = _names.size();
+    _names.push_back(slash == std::string::npos ? path : path.substr(slash + 1));
+    _handles.push_back(h);
+    size_t hooksBefore = _hooks.size();
+    if (init(host) == 0)
+    {
+        std::cout << "plugin " << _names.back() << " loaded, " << _hooks.size() - hooksBefore << " hooks" << std::endl;
+        return true;
+    }
+
+    // a failed init leaves nothing behind
+    std::cerr << "plugin " << path << ": init failed" << std::endl;
+    _hooks.resize(hooksBefore);
+    for (int w = 0; w < 2; ++w)
+    {
+        for (std::map<std::string, std::vector<size_t> >::iterator it = _byCmd[w].begin(); it != _byCmd[w].end(); ++it)
+        {
+            while (!it->second.empty() && it->second.back() >= hooksBefore)
+                it->second.pop_back();
+        }
+    }
+    _names.pop_back();
+    _handles.pop_back();
+    dlclose(h);
+    return false;
+}
+
+void Plugins::unloadAll()
+{
+    for (size_t i = _handles.size(); i-- > 0;)
+    {
+        ircserv_plugin_fini_fn fini = reinterpret_cast<ircserv_plugin_fini_fn>(dlsym(_handles[i], "ircserv_plugin_fini"));
+        if (fini)
+            fini();
+        dlclose(_handles[i]);
+    }
+    _handles.clear();
+    _names.clear();
+    _hooks.clear();
+    _byCmd[0].clear();
+    _byCmd[1].clear();
+}
+
+bool Plugins::empty() const
+{
+    return _hooks.empty();
+}
+
+int Plugins::addHook(const char *cmd, int when, ircserv_hook fn, void *ctx)
+{
+    if (!cmd || !*cmd || !fn || (when != IRCSERV_BEFORE && when != IRCSERV_AFTER) || _loading >= _names.size())
+        return -1;
+    Hook h;
+    h.fn = fn;
+    h.ctx = ctx;
+    h.plugin = _loading;
+    h.cmd = cmd;
+    for (size_t i = 0; i < h.cmd.size(); ++i)
+        h.cmd[i] = (char)std::toupper((unsigned char)h.cmd[i]);
+    h.when = when;
+    h.calls = 0;
+    h.drops = 0;
+    h.totalNs = 0;
+    h.maxNs = 0;
+    _byCmd[when][h.cmd].push_back(_hooks.size());
+    _hooks.push_back(h);
+    return 0;
+}
+
+bool Plugins::run(int when, const ircserv_msg &msg)
+{
+    static const std::vector<size_t> none;
+    std::map<std::string, std::vector<size_t> > &byCmd = _byCmd[when];
+    std::map<std::string, std::vector<size_t> >::const_iterator it = byCmd.find(std::string(msg.cmd, msg.cmd_len));
+    std::map<std::string, std::vector<size_t> >::const_iterator all = byCmd.find("*");
+    if (all == it)
+        all = byCmd.end(); // a client sent "*": the wildcard hooks are already in `a`
+    const std::vector<size_t> &a = it == byCmd.end() ? none : it->second;
+    const std::vector<size_t> &b = all == byCmd.end() ? none : all->second;
+
+    // both lists are in registration order, walk them merged
+    size_t i = 0, j = 0;
+    while (i < a.size() || j < b.size())
+    {
+        size_t idx = (j >= b.size() || (i < a.size() && a[i] < b[j])) ? a[i++] : b[j++];
+        Hook &h = _hooks[idx];
+        unsigned long long start = nowNs();
+        int rc = h.fn(h.ctx, &msg);
+        unsigned long long spent = nowNs() - start;
+        ++h.calls;
+        h.totalNs += spent;
+        if (spent > h.maxNs)
+            h.maxNs = spent;
+        if (when == IRCSERV_BEFORE && rc == IRCSERV_DROP)
+        {
+            ++h.drops;
+            return false;
+        }
+    }
+    return true;
+}
+
+const std::vector<Plugins::Hook> &Plugins::getHooks() const
+{
+    return _hooks;
+}
+
+const std::string &Plugins::getName(size_t plugin) const
+{
+    return _names[plugin];
+}
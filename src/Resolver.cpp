@@ -0,0 +1,642 @@
+#include "Resolver.hpp"
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+
+namespace
+{
+    const size_t HOSTLEN = 63;         // longer names are not used, the address is
+    const unsigned short TYPE_A = 1;
+    const unsigned short TYPE_PTR = 12;
+    const unsigned short TYPE_AAAA = 28;
+
+    long long nowMs()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    // fills `ss` from a numeric address, the port stays 0
+    bool parseAddress(const std::string &addr, sockaddr_storage &ss, socklen_t &len)
+    {
+        std::memset(&ss, 0, sizeof(ss));
+        sockaddr_in *v4 = (sockaddr_in *)&ss;
+        sockaddr_in6 *v6 = (sockaddr_in6 *)&ss;
+        if (inet_pton(AF_INET, addr.c_str(), &v4->sin_addr) == 1)
+        {
+            v4->sin_family = AF_INET;
+            len = sizeof(*v4);
+            return true;
+        }
+        if (inet_pton(AF_INET6, addr.c_str(), &v6->sin6_addr) == 1)
+        {
+            v6->sin6_family = AF_INET6;
+            len = sizeof(*v6);
+            return true;
+        }
+        return false;
+    }
+
+    // from /dev/urandom; a short read leaves the rest of `p` as it was
+    void randomBytes(int fd, void *p, size_t n)
+    {
+        if (fd >= 0 && read(fd, p, n) < 0)
+            std::perror("resolver: /dev/urandom");
+    }
+
+    // the address bytes of `ss`, 4 or 16 of them
+    std::string addressBytes(const sockaddr_storage &ss)
+    {
+        if (ss.ss_family == AF_INET)
+            return std::string((const char *)&((const sockaddr_in *)&ss)->sin_addr, 4);
+        return std::string((const char *)&((const sockaddr_in6 *)&ss)->sin6_addr, 16);
+    }
+
+    // what may go into a prefix: letters, digits, '-' and '.', no empty label
+    std::string validHost(std::string host)
+    {
+        if (!host.empty() && host[host.size() - 1] == '.')
+            host.erase(host.size() - 1);
+        if (host.empty() || host.size() > HOSTLEN || host[0] == '.' || host[0] == '-'
+            || host.find("..") != std::string::npos)
+            return "";
+        for (size_t i = 0; i < host.size(); ++i)
+        {
+            unsigned char c = (unsigned char)host[i];
+            if (!std::isalnum(c) && c != '-' && c != '.')
+                return "";
+        }
+        return host;
+    }
+
+    // a possibly compressed name at `off`; returns the offset after it in
+    // the record it started in, 0 if malformed
+    size_t readName(const std::string &msg, size_t off, std::string &name)
+    {
+        size_t end = 0;
+        name.clear();
+        for (int jumps = 0; jumps < 16;)
+        {
+            if (off >= msg.size())
+                return 0;
+            unsigned char len = (unsigned char)msg[off];
+            if (len == 0)
+                return end ? end : off + 1;
+            if ((len & 0xC0) == 0xC0)
+            {
+                if (off + 1 >= msg.size())
+                    return 0;
+                if (!end)
+                    end = off + 2;
+                off = ((size_t)(len & 0x3F) << 8) | (unsigned char)msg[off + 1];
+                ++jumps;
+                continue;
+            }
+            if (off + 1 + len > msg.size() || name.size() + len > 255)
+                return 0;
+            if (!name.empty())
+                name += '.';
+            name.append(msg, off + 1, len);
+            off += 1 + len;
+        }
+        return 0;
+    }
+
+    // rdata of every `type` record in the answer section, PTR names decoded
+    bool answers(const std::string &msg, unsigned short type, std::vector<std::string> &out)
+    {
+        if (msg.size() < 12)
+            return false;
+        const unsigned char *h = (const unsigned char *)msg.data();
+        size_t qd = ((size_t)h[4] << 8) | h[5];
+        size_t an = ((size_t)h[6] << 8) | h[7];
+        size_t off = 12;
+        std::string name;
+        for (size_t i = 0; i < qd; ++i)
+        {
+            off = readName(msg, off, name);
+            if (!off || off + 4 > msg.size())
+                return false;
+            off += 4;
+        }
+        for (size_t i = 0; i < an; ++i)
+        {
+            off = readName(msg, off, name);
+            if (!off || off + 10 > msg.size())
+                return false;
+            const unsigned char *rr = (const unsigned char *)msg.data() + off;
+            unsigned short rtype = (unsigned short)((rr[0] << 8) | rr[1]);
+            size_t rdlen = ((size_t)rr[8] << 8) | rr[9];
+            off += 10;
+            if (off + rdlen > msg.size())
+                return false;
+            if (rtype == type && type == TYPE_PTR)
+            {
+                if (readName(msg, off, name))
+                    out.push_back(name);
+            }
+            else if (rtype == type)
+                out.push_back(msg.substr(off, rdlen));
+            off += rdlen;
+        }
+        return true;
+    }
+}
+
+Resolver::Resolver()
+    : _cacheMax(4096), _ttl(3600), _negativeTtl(300), _seq(0), _timeoutMs(3000), _hits(0), _misses(0), _shared(NULL)
+{
+}
+
+Resolver::~Resolver()
+{
+    stop();
+}
+
+bool Resolver::start(size_t threads, const std::string &server, int timeoutMs)
+{
+    _timeoutMs = timeoutMs > 0 ? timeoutMs : 1;
+    Shared *sh = new Shared();
+    pthread_mutex_init(&sh->lock, NULL);
+    pthread_cond_init(&sh->work, NULL);
+    pthread_cond_init(&sh->exited, NULL);
+    sh->ready = 0;
+    sh->quit = false;
+    sh->running = 0;
+    sh->refs = 1;
+    sh->pipe[0] = sh->pipe[1] = -1;
+    sh->random = -1;
+    sh->serverLen = 0;
+    sh->timeoutMs = _timeoutMs;
+    _shared = sh;
+    if (!server.empty())
+    {
+        // addr, addr:port, or [v6]:port
+        std::string host = server, port = "53";
+        std::string::size_type colon = server.rfind(':');
+        if (server[0] == '[' && server.find(']') != std::string::npos)
+        {
+            host = server.substr(1, server.find(']') - 1);
+            if (colon != std::string::npos && colon > server.find(']'))
+                port = server.substr(colon + 1);
+        }
+        else if (colon != std::string::npos && server.find(':') == colon)
+        {
+            host = server.substr(0, colon);
+            port = server.substr(colon + 1);
+        }
+        sh->random = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+        if (sh->random < 0 || !parseAddress(host, sh->server, sh->serverLen))
+        {
+            stop();
+            return false;
+        }
+        unsigned short p = htons((unsigned short)std::atoi(port.c_str()));
+        if (sh->server.ss_family == AF_INET)
+            ((sockaddr_in *)&sh->server)->sin_port = p;
+        else
+            ((sockaddr_in6 *)&sh->server)->sin6_port = p;
+    }
+    if (pipe(sh->pipe) < 0)
+    {
+        stop();
+        return false;
+    }
+    fcntl(sh->pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(sh->pipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(sh->pipe[0], F_SETFD, FD_CLOEXEC); // an upgrade re-execs, the new process makes its own
+    fcntl(sh->pipe[1], F_SETFD, FD_CLOEXEC);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (size_t i = 0; i < threads; ++i)
+    {
+        pthread_t t;
+        pthread_mutex_lock(&sh->lock);
+        bool ok = pthread_create(&t, &attr, entry, sh) == 0;
+        if (ok)
+        {
+            ++sh->running;
+            ++sh->refs;
+        }
+        pthread_mutex_unlock(&sh->lock);
+        if (!ok)
+            break;
+    }
+    pthread_attr_destroy(&attr);
+    if (sh->running == 0)
+    {
+        stop();
+        return false;
+    }
+    return true;
+}
+
+void Resolver::stop()
+{
+    Shared *sh = _shared;
+    if (!sh)
+        return;
+    _shared = NULL;
+    // a worker in getnameinfo() cannot be interrupted: give the workers one
+    // lookup timeout to leave, then let the stragglers go on their own
+    timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += _timeoutMs / 1000;
+    until.tv_nsec += (long)(_timeoutMs % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000)
+    {
+        ++until.tv_sec;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&sh->lock);
+    sh->quit = true;
+    pthread_cond_broadcast(&sh->work);
+    while (sh->running > 0 && pthread_cond_timedwait(&sh->exited, &sh->lock, &until) != ETIMEDOUT)
+        ;
+    if (sh->running > 0)
+        std::cerr << "resolver: " << sh->running << " workers still busy, not waiting for them\n";
+    pthread_mutex_unlock(&sh->lock);
+    release(sh);
+    _waiting.clear();
+    _deadlines.clear();
+}
+
+// drops one reference, the last one closes the fds and frees `s`
+void Resolver::release(Shared *s)
+{
+    pthread_mutex_lock(&s->lock);
+    bool last = --s->refs == 0;
+    pthread_mutex_unlock(&s->lock);
+    if (!last)
+        return;
+    for (int i = 0; i < 2; ++i)
+    {
+        if (s->pipe[i] >= 0)
+            close(s->pipe[i]);
+    }
+    if (s->random >= 0)
+        close(s->random);
+    pthread_cond_destroy(&s->exited);
+    pthread_cond_destroy(&s->work);
+    pthread_mutex_destroy(&s->lock);
+    delete s;
+}
+
+void Resolver::configureCache(size_t entries, int ttlSecs, int negativeTtlSecs)
+{
+    _cacheMax = entries;
+    _ttl = ttlSecs;
+    _negativeTtl = negativeTtlSecs;
+    while (_cache.size() > _cacheMax)
+    {
+        _cache.erase(_lru.back());
+        _lru.pop_back();
+    }
+}
+
+void *Resolver::entry(void *arg)
+{
+    Shared *s = static_cast<Shared *>(arg);
+    loop(s);
+    pthread_mutex_lock(&s->lock);
+    --s->running;
+    pthread_cond_signal(&s->exited);
+    pthread_mutex_unlock(&s->lock);
+    release(s);
+    return NULL;
+}
+
+void Resolver::loop(Shared *s)
+{
+    pthread_mutex_lock(&s->lock);
+    while (!s->quit)
+    {
+        if (s->queue.empty())
+        {
+            pthread_cond_wait(&s->work, &s->lock);
+            continue;
+        }
+        std::string addr = s->queue.front();
+        s->queue.pop_front();
+        pthread_mutex_unlock(&s->lock);
+        std::string host = resolve(*s, addr);
+        pthread_mutex_lock(&s->lock);
+        if (s->quit)
+            break;
+        s->done.push_back(std::make_pair(addr, host));
+        // one byte per batch, written under the lock so collect() always
+        // drains the byte of the batch it takes
+        if (s->ready++ == 0 && write(s->pipe[1], "r", 1) < 0)
+            std::perror("resolver: wake");
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+std::string Resolver::resolve(const Shared &s, const std::string &addr)
+{
+    return validHost(s.serverLen ? resolveServer(s, addr) : resolveSystem(addr));
+}
+
+std::string Resolver::resolveSystem(const std::string &addr)
+{
+    sockaddr_storage ss;
+    socklen_t len;
+    if (!parseAddress(addr, ss, len))
+        return "";
+    char name[1025];
+    if (getnameinfo((sockaddr *)&ss, len, name, sizeof(name), NULL, 0, NI_NAMEREQD) != 0)
+        return "";
+
+    addrinfo hints, *res = NULL;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = ss.ss_family;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(name, NULL, &hints, &res) != 0)
+        return "";
+    std::string want = addressBytes(ss);
+    bool confirmed = false;
+    for (addrinfo *ai = res; ai && !confirmed; ai = ai->ai_next)
+    {
+        sockaddr_storage got;
+        std::memcpy(&got, ai->ai_addr, ai->ai_addrlen);
+        confirmed = got.ss_family == ss.ss_family && addressBytes(got) == want;
+    }
+    freeaddrinfo(res);
+    return confirmed ? std::string(name) : "";
+}
+
+bool Resolver::query(const Shared &s, const std::string &name, unsigned short type, std::string &reply)
+{
+    // a random ID and a random source port: 32 bits for a spoofed answer
+    // to guess instead of a predictable 16
+    unsigned short rnd[9] = {0};
+    randomBytes(s.random, rnd, sizeof(rnd));
+    unsigned short id = rnd[0];
+
+    std::string q;
+    q += (char)(id >> 8);
+    q += (char)(id & 0xFF);
+    q.append("\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00", 10); // RD, one question
+    size_t start = 0;
+    while (start < name.size())
+    {
+        size_t dot = name.find('.', start);
+        if (dot == std::string::npos)
+            dot = name.size();
+        if (dot - start == 0 || dot - start > 63)
+            return false;
+        q += (char)(dot - start);
+        q.append(name, start, dot - start);
+        start = dot + 1;
+    }
+    q += '\0';
+    q += (char)(type >> 8);
+    q += (char)(type & 0xFF);
+    q.append("\x00\x01", 2); // class IN
+
+    int fd = socket(s.server.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+    for (int i = 1; i < 9; ++i)
+    {
+        // ports in use are retried; if all tries fail the kernel picks one
+        sockaddr_storage local;
+        std::memset(&local, 0, sizeof(local));
+        local.ss_family = s.server.ss_family;
+        unsigned short port = htons((unsigned short)(1024 + rnd[i] % (65536 - 1024)));
+        if (local.ss_family == AF_INET)
+            ((sockaddr_in *)&local)->sin_port = port;
+        else
+            ((sockaddr_in6 *)&local)->sin6_port = port;
+        if (bind(fd, (const sockaddr *)&local, s.serverLen) == 0 || errno != EADDRINUSE)
+            break;
+    }
+    bool ok = connect(fd, (const sockaddr *)&s.server, s.serverLen) == 0 && send(fd, q.data(), q.size(), 0) == (ssize_t)q.size();
+    long long deadline = nowMs() + s.timeoutMs;
+    while (ok)
+    {
+        pollfd p;
+        p.fd = fd;
+        p.events = POLLIN;
+        p.revents = 0;
+        long long left = deadline - nowMs();
+        if (left <= 0 || poll(&p, 1, (int)left) <= 0)
+        {
+            ok = false;
+            break;
+        }
+        char buf[1500];
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 12)
+            continue;
+        const unsigned char *h = (const unsigned char *)buf;
+        if (((h[0] << 8) | h[1]) != id || !(h[2] & 0x80) || (size_t)n < q.size()
+            || std::memcmp(buf + 12, q.data() + 12, q.size() - 12) != 0)
+            continue; // not our answer, or not to our question
+        ok = (h[3] & 0x0F) == 0;  // NOERROR
+        reply.assign(buf, (size_t)n);
+        break;
+    }
+    close(fd);
+    return ok;
+}
+
+std::string Resolver::resolveServer(const Shared &s, const std::string &addr)
+{
+    sockaddr_storage ss;
+    socklen_t len;
+    if (!parseAddress(addr, ss, len))
+        return "";
+    std::string bytes = addressBytes(ss);
+    std::string ptr;
+    char part[8];
+    if (ss.ss_family == AF_INET)
+    {
+        for (int i = 3; i >= 0; --i)
+        {
+            std::snprintf(part, sizeof(part), "%u.", (unsigned char)bytes[i]);
+            ptr += part;
+        }
+        ptr += "in-addr.arpa";
+    }
+    else
+    {
+        for (int i = 15; i >= 0; --i)
+        {
+            unsigned char b = (unsigned char)bytes[i];
+            std::snprintf(part, sizeof(part), "%x.%x.", b & 0xF, b >> 4);
+            ptr += part;
+        }
+        ptr += "ip6.arpa";
+    }
+
+    std::string reply;
+    std::vector<std::string> names, addrs;
+    if (!query(s, ptr, TYPE_PTR, reply) || !answers(reply, TYPE_PTR, names) || names.empty())
+        return "";
+    std::string host = validHost(names[0]);
+    if (host.empty())
+        return "";
+    unsigned short type = ss.ss_family == AF_INET ? TYPE_A : TYPE_AAAA;
+    if (!query(s, host, type, reply) || !answers(reply, type, addrs))
+        return "";
+    for (size_t i = 0; i < addrs.size(); ++i)
+    {
+        if (addrs[i] == bytes)
+            return host;
+    }
+    return "";
+}
+
+void Resolver::remember(const std::string &addr, const std::string &host, time_t now)
+{
+    if (_cacheMax == 0)
+        return;
+    std::map<std::string, CacheEntry>::iterator it = _cache.find(addr);
+    if (it == _cache.end())
+    {
+        _lru.push_front(addr);
+        it = _cache.insert(std::make_pair(addr, CacheEntry())).first;
+        it->second.lru = _lru.begin();
+    }
+    else
+        _lru.splice(_lru.begin(), _lru, it->second.lru);
+    it->second.host = host;
+    it->second.expires = now + (host.empty() ? _negativeTtl : _ttl);
+    if (_cache.size() > _cacheMax)
+    {
+        _cache.erase(_lru.back());
+        _lru.pop_back();
+    }
+}
+
+bool Resolver::lookup(int fd, const std::string &addr, std::string &host)
+{
+    time_t now = time(NULL);
+    std::map<std::string, CacheEntry>::iterator it = _cache.find(addr);
+    if (it != _cache.end())
+    {
+        if (it->second.expires > now)
+        {
+            ++_hits;
+            _lru.splice(_lru.begin(), _lru, it->second.lru);
+            host = it->second.host;
+            return true;
+        }
+        _lru.erase(it->second.lru);
+        _cache.erase(it);
+    }
+    ++_misses;
+
+    // connections from one address share the lookup already in flight
+    std::map<std::string, std::vector<Waiter> >::iterator w = _waiting.find(addr);
+    if (w == _waiting.end())
+    {
+        bool room = false;
+        if (_shared)
+        {
+            pthread_mutex_lock(&_shared->lock);
+            room = _shared->queue.size() < MAX_QUEUE;
+            if (room)
+            {
+                _shared->queue.push_back(addr);
+                pthread_cond_signal(&_shared->work);
+            }
+            pthread_mutex_unlock(&_shared->lock);
+        }
+        if (!room)
+        {
+            host.clear();
+            return true;
+        }
+        w = _waiting.insert(std::make_pair(addr, std::vector<Waiter>())).first;
+    }
+    Waiter waiter;
+    waiter.fd = fd;
+    waiter.seq = ++_seq;
+    w->second.push_back(waiter);
+    Deadline d;
+    d.atMs = nowMs() + _timeoutMs;
+    d.fd = fd;
+    d.seq = waiter.seq;
+    d.addr = addr;
+    _deadlines.push_back(d);
+    return false;
+}
+
+void Resolver::collect(std::vector<Answer> &out)
+{
+    bool ready = _shared && __sync_fetch_and_add(&_shared->ready, 0) != 0;
+    if (_deadlines.empty() && !ready)
+        return;
+    if (ready)
+    {
+        std::vector<std::pair<std::string, std::string> > done;
+        pthread_mutex_lock(&_shared->lock);
+        done.swap(_shared->done);
+        _shared->ready = 0;
+        char buf[64];
+        while (read(_shared->pipe[0], buf, sizeof(buf)) > 0)
+            ;
+        pthread_mutex_unlock(&_shared->lock);
+
+        time_t now = time(NULL);
+        for (size_t i = 0; i < done.size(); ++i)
+        {
+            remember(done[i].first, done[i].second, now);
+            std::map<std::string, std::vector<Waiter> >::iterator w = _waiting.find(done[i].first);
+            if (w == _waiting.end())
+                continue;
+            for (size_t j = 0; j < w->second.size(); ++j)
+            {
+                Answer a;
+                a.fd = w->second[j].fd;
+                a.addr = done[i].first;
+                a.host = done[i].second;
+                out.push_back(a);
+            }
+            _waiting.erase(w);
+        }
+    }
+
+    long long now = nowMs();
+    while (!_deadlines.empty() && _deadlines.front().atMs <= now)
+    {
+        const Deadline &d = _deadlines.front();
+        std::map<std::string, std::vector<Waiter> >::iterator w = _waiting.find(d.addr);
+        for (size_t j = 0; w != _waiting.end() && j < w->second.size(); ++j)
+        {
+            if (w->second[j].seq != d.seq)
+                continue;
+            Answer a;
+            a.fd = d.fd;
+            a.addr = d.addr;
+            out.push_back(a);
+            // the entry stays even when emptied: the lookup goes on, fills
+            // the cache, and answers whoever connects from there meanwhile
+            w->second.erase(w->second.begin() + (long)j);
+            break;
+        }
+        _deadlines.pop_front();
+    }
+}
+
+int Resolver::nextDeadlineMs() const
+{
+    if (_deadlines.empty())
+        return -1;
+    long long left = _deadlines.front().atMs - nowMs();
+    return left > 0 ? (int)left : 0;
+}
@@ -0,0 +1,364 @@
+#include "Scan.hpp"
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    struct Kernels
+    {
+        size_t (*findByte)(const char *, size_t, char);
+        bool (*validNick)(const char *, size_t);
+        bool (*validChannelChars)(const char *, size_t);
+        void (*foldCase)(char *, size_t);
+        void (*xorMask)(char *, size_t, unsigned int);
+    };
+
+    /* scalar */
+
+    size_t findByteScalar(const char *p, size_t n, char c)
+    {
+        const void *hit = std::memchr(p, c, n);
+        return hit ? (size_t)((const char *)hit - p) : n;
+    }
+
+    bool nickByte(unsigned char b)
+    {
+        return b > 0x20 && b < 0x7F && b != ',';
+    }
+
+    bool channelByte(unsigned char b)
+    {
+        return b != 0 && b != 7 && b != '\r' && b != '\n' && b != ' ' && b != ',' && b != ':';
+    }
+
+    bool validNickScalar(const char *p, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (!nickByte((unsigned char)p[i]))
+                return false;
+        }
+        return true;
+    }
+
+    bool validChannelScalar(const char *p, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (!channelByte((unsigned char)p[i]))
+                return false;
+        }
+        return true;
+    }
+
+    void foldCaseScalar(char *p, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            unsigned char b = (unsigned char)p[i];
+            if (b >= 0x41 && b <= 0x5E)
+                p[i] = (char)(b + 0x20);
+        }
+    }
+
+    // `key` holds the 4 mask bytes in memory order, p[0] takes the first
+    void xorMaskScalar(char *p, size_t n, unsigned int key)
+    {
+        unsigned char k[4];
+        std::memcpy(k, &key, 4);
+        for (size_t i = 0; i < n; ++i)
+            p[i] = (char)(p[i] ^ k[i & 3]);
+    }
+
+    const Kernels SCALAR_KERNELS = {findByteScalar, validNickScalar, validChannelScalar, foldCaseScalar, xorMaskScalar};
+
+#ifdef SCAN_X86
+    /* SSE2, 16 bytes a step; signed compares make bytes >= 0x80 negative */
+
+    size_t findByteSse2(const char *p, size_t n, char c)
+    {
+        const __m128i needle = _mm_set1_epi8(c);
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+            int m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+            if (m)
+                return i + (size_t)__builtin_ctz((unsigned int)m);
+        }
+        return i + findByteScalar(p + i, n - i, c);
+    }
+
+    bool validNickSse2(const char *p, size_t n)
+    {
+        const __m128i lo = _mm_set1_epi8(0x20);
+        const __m128i hi = _mm_set1_epi8(0x7F);
+        const __m128i comma = _mm_set1_epi8(',');
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+            __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+            ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, comma), ok);
+            if (_mm_movemask_epi8(ok) != 0xFFFF)
+                return false;
+        }
+        return validNickScalar(p + i, n - i);
+    }
+
+    bool validChannelSse2(const char *p, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+            __m128i bad = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+            bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, _mm_set1_epi8(7)));
+            bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+            bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+            bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+            bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, _mm_set1_epi8(',')));
+            bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, _mm_set1_epi8(':')));
+            if (_mm_movemask_epi8(bad))
+                return false;
+        }
+        return validChannelScalar(p + i, n - i);
+    }
+
+    void foldCaseSse2(char *p, size_t n)
+    {
+        const __m128i lo = _mm_set1_epi8(0x40);
+        const __m128i hi = _mm_set1_epi8(0x5F);
+        const __m128i delta = _mm_set1_epi8(0x20);
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+            __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+            v = _mm_add_epi8(v, _mm_and_si128(upper, delta));
+            _mm_storeu_si128((__m128i *)(p + i), v);
+        }
+        foldCaseScalar(p + i, n - i);
+    }
+
+    void xorMaskSse2(char *p, size_t n, unsigned int key)
+    {
+        const __m128i k = _mm_set1_epi32((int)key);
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+            _mm_storeu_si128((__m128i *)(p + i), _mm_xor_si128(v, k));
+        }
+        xorMaskScalar(p + i, n - i, key); // i is a multiple of 4, the key phase holds
+    }
+
+    const Kernels SSE2_KERNELS = {findByteSse2, validNickSse2, validChannelSse2, foldCaseSse2, xorMaskSse2};
+
+    /* AVX2, 32 bytes a step */
+
+    __attribute__((target("avx2"))) size_t findByteAvx2(const char *p, size_t n, char c)
+    {
+        const __m256i needle = _mm256_set1_epi8(c);
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            unsigned int m = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+            if (m)
+                return i + (size_t)__builtin_ctz(m);
+        }
+        _mm256_zeroupper(); // the tail runs SSE code, a tail call skips the compiler's vzeroupper
+        return i + findByteSse2(p + i, n - i, c);
+    }
+
+    __attribute__((target("avx2"))) bool validNickAvx2(const char *p, size_t n)
+    {
+        const __m256i lo = _mm256_set1_epi8(0x20);
+        const __m256i hi = _mm256_set1_epi8(0x7F);
+        const __m256i comma = _mm256_set1_epi8(',');
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v));
+            ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, comma), ok);
+            if ((unsigned int)_mm256_movemask_epi8(ok) != 0xFFFFFFFFu)
+                return false;
+        }
+        _mm256_zeroupper();
+        return validNickSse2(p + i, n - i);
+    }
+
+    __attribute__((target("avx2"))) bool validChannelAvx2(const char *p, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            __m256i bad = _mm256_cmpeq_epi8(v, _mm256_setzero_si256());
+            bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(7)));
+            bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+            bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+            bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+            bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(',')));
+            bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')));
+            if (_mm256_movemask_epi8(bad))
+                return false;
+        }
+        _mm256_zeroupper();
+        return validChannelSse2(p + i, n - i);
+    }
+
+    __attribute__((target("avx2"))) void foldCaseAvx2(char *p, size_t n)
+    {
+        const __m256i lo = _mm256_set1_epi8(0x40);
+        const __m256i hi = _mm256_set1_epi8(0x5F);
+        const __m256i delta = _mm256_set1_epi8(0x20);
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v));
+            v = _mm256_add_epi8(v, _mm256_and_si256(upper, delta));
+            _mm256_storeu_si256((__m256i *)(p + i), v);
+        }
+        _mm256_zeroupper();
+        foldCaseSse2(p + i, n - i);
+    }
+
+    __attribute__((target("avx2"))) void xorMaskAvx2(char *p, size_t n, unsigned int key)
+    {
+        const __m256i k = _mm256_set1_epi32((int)key);
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            _mm256_storeu_si256((__m256i *)(p + i), _mm256_xor_si256(v, k));
+        }
+        _mm256_zeroupper();
+        xorMaskSse2(p + i, n - i, key);
+    }
+
+    const Kernels AVX2_KERNELS = {findByteAvx2, validNickAvx2, validChannelAvx2, foldCaseAvx2, xorMaskAvx2};
+#endif
+
+    Kernels g_kernels = SCALAR_KERNELS;
+    Scan::Level g_level = Scan::SCALAR;
+
+    // run a candidate against the scalar code on a fixed pseudo-random corpus
+    bool agreesWithScalar(const Kernels &k)
+    {
+        static const char palette[] = "aZ09[]\\^~{}|_-#&,: \r\n\x07\x00\x7f\x80\xff\x20\x21\x40\x5e\x5f";
+        unsigned int seed = 42;
+        char a[160], b[160];
+        for (int round = 0; round < 400; ++round)
+        {
+            size_t n = (size_t)(round % 150);
+            for (size_t i = 0; i < n; ++i)
+            {
+                seed = seed * 1103515245u + 12345u;
+                a[i] = palette[(seed >> 16) % (sizeof(palette) - 1)];
+                if (round % 3 == 0) // mostly valid input, so the long paths run too
+                    a[i] = (char)('a' + (seed >> 20) % 26);
+            }
+            if (round % 3 == 0 && n > 0)
+                a[(seed >> 8) % n] = (char)(round % 5 == 0 ? ',' : 'Q');
+            std::memcpy(b, a, n);
+            if (k.findByte(a, n, ',') != findByteScalar(a, n, ',')
+                || k.findByte(a, n, '\n') != findByteScalar(a, n, '\n')
+                || k.validNick(a, n) != validNickScalar(a, n)
+                || k.validChannelChars(a, n) != validChannelScalar(a, n))
+                return false;
+            k.foldCase(a, n);
+            foldCaseScalar(b, n);
+            if (std::memcmp(a, b, n) != 0)
+                return false;
+            k.xorMask(a, n, seed);
+            xorMaskScalar(b, n, seed);
+            if (std::memcmp(a, b, n) != 0)
+                return false;
+        }
+        return true;
+    }
+}
+
+Scan::Level Scan::init(Level cap)
+{
+    g_kernels = SCALAR_KERNELS;
+    g_level = SCALAR;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (cap >= AVX2 && __builtin_cpu_supports("avx2") && agreesWithScalar(AVX2_KERNELS))
+    {
+        g_kernels = AVX2_KERNELS;
+        g_level = AVX2;
+    }
+    else if (cap >= SSE2 && __builtin_cpu_supports("sse2") && agreesWithScalar(SSE2_KERNELS))
+    {
+        g_kernels = SSE2_KERNELS;
+        g_level = SSE2;
+    }
+#else
+    (void)cap;
+#endif
+    return g_level;
+}
+
+Scan::Level Scan::level()
+{
+    return g_level;
+}
+
+const char *Scan::levelName(Level l)
+{
+    if (l == AVX2)
+        return "avx2";
+    if (l == SSE2)
+        return "sse2";
+    return "scalar";
+}
+
+size_t Scan::findByte(const char *p, size_t n, char c)
+{
+    return g_kernels.findByte(p, n, c);
+}
+
+size_t Scan::findNewline(const char *p, size_t n)
+{
+    return g_kernels.findByte(p, n, '\n');
+}
+
+bool Scan::validNick(const char *p, size_t n)
+{
+    return g_kernels.validNick(p, n);
+}
+
+bool Scan::validChannelChars(const char *p, size_t n)
+{
+    return g_kernels.validChannelChars(p, n);
+}
+
+void Scan::foldCase(char *p, size_t n)
+{
+    g_kernels.foldCase(p, n);
+}
+
+void Scan::xorMask(char *p, size_t n, const unsigned char key[4])
+{
+    unsigned int k;
+    std::memcpy(&k, key, 4);
+    g_kernels.xorMask(p, n, k);
+}
+
+std::string Scan::folded(const std::string &s)
+{
+    std::string out(s);
+    if (!out.empty())
+        g_kernels.foldCase(&out[0], out.size());
+    return out;
+}
@@ -0,0 +1,131 @@
+#include "Server.hpp"
+#include <algorithm>
+
+// SendQ, what a client may have queued before it is dropped:
+//   sendq 4194304                  per client, 0 => unlimited
+//   sendq_oper 16777216            for opers (0 => as everyone else)
+//   sendq_class *!*@*.lan 1048576  by nick!user@host, first match wins
+//   sendq_pause 65536              stop reading a client while this much is queued for it
+//   sendq_total 536870912          connection buffer memory (the pool's in-use bytes)
+//                                  above which the oldest backlogs go first, 0 => off
+// Queueing past the cap only flags the client (fanout workers queue too);
+// enforceSendq() evicts at the end of the loop iteration.
+
+namespace
+{
+    struct Backlog
+    {
+        time_t since;
+        size_t bytes;
+        Client *client;
+    };
+
+    // oldest backlog first, the largest among equally old ones
+    bool worseFirst(const Backlog &a, const Backlog &b)
+    {
+        if (a.since != b.since)
+            return a.since < b.since;
+        return a.bytes > b.bytes;
+    }
+}
+
+void Server::setupSendq()
+{
+    _sendq = (size_t)_config.getInt("sendq", 4 << 20);
+    _sendqOper = (size_t)_config.getInt("sendq_oper", 0);
+    _sendqPause = (size_t)_config.getInt("sendq_pause", 64 << 10);
+    _sendqTotal = (size_t)_config.getInt("sendq_total", 512 << 20);
+    _sendqOverflows = 0;
+    _sendqEvictions = 0;
+    _pressureEvictions = 0;
+    const std::vector<std::string> &classes = _config.getAll("sendq_class");
+    for (size_t i = 0; i < classes.size(); ++i)
+    {
+        std::istringstream line(classes[i]);
+        std::string mask;
+        long bytes = -1;
+        line >> mask >> bytes;
+        if (mask.empty() || bytes < 0)
+        {
+            std::cerr << "sendq_class: expected <mask> <bytes>: " << classes[i] << std::endl;
+            continue;
+        }
+        _sendqClasses.push_back(std::make_pair(Scan::folded(mask), (size_t)bytes));
+    }
+}
+
+// on connect, registration and OPER: the mask or the oper flag may pick another class
+void Server::applySendq(Client *c)
+{
+    size_t cap = _sendq;
+    std::string mask = Scan::folded(c->getMask());
+    for (size_t i = 0; i < _sendqClasses.size(); ++i)
+    {
+        if (maskMatch(_sendqClasses[i].first, mask))
+        {
+            cap = _sendqClasses[i].second;
+            break;
+        }
+    }
+    if (c->isOper() && _sendqOper)
+        cap = _sendqOper;
+    c->setSendqMax(cap);
+}
+
+void Server::evictClient(Client *c, const std::string &reason)
+{
+    int fd = c->getFd();
+    // what is queued is lost anyway, the ERROR gets one best effort send
+    c->dropOutput();
+    c->queueWrite("ERROR :Closing Link: " + c->getHostname() + " (" + reason + ")\r\n");
+    const char *p;
+    size_t n;
+    c->nextWrite(p, n);
+    _io->send(fd, p, n);
+    disconnectClient(fd, reason);
+}
+
+void Server::enforceSendq()
+{
+    if (_sendqOverflows)
+    {
+        __sync_fetch_and_and(&_sendqOverflows, 0UL);
+        std::vector<int> over;
+        for (std::map<int, Client *>::iterator it = _clients.begin(); it != _clients.end(); ++it)
+            if (it->second->sendqExceeded())
+                over.push_back(it->first);
+        for (size_t i = 0; i < over.size(); ++i)
+        {
+            std::map<int, Client *>::iterator it = _clients.find(over[i]);
+            if (it == _clients.end())
+                continue;
+            evictClient(it->second, "SendQ exceeded");
+            ++_sendqEvictions;
+        }
+    }
+    if (!_sendqTotal)
+        return;
+    size_t held = BufferPool::stats().inUseBytes;
+    if (held <= _sendqTotal)
+        return;
+    std::vector<Backlog> worst;
+    for (std::map<int, Client *>::iterator it = _clients.begin(); it != _clients.end(); ++it)
+    {
+        Client *cl = it->second;
+        if (!cl->hasPendingWrite())
+            continue;
+        Backlog b = {cl->backlogSince(), cl->pendingBytes(), cl};
+        worst.push_back(b);
+    }
+    std::sort(worst.begin(), worst.end(), worseFirst);
+    // down to 90%, so the next burst does not land right back on the line
+    size_t target = _sendqTotal - _sendqTotal / 10;
+    for (size_t i = 0; i < worst.size() && held > target; ++i)
+    {
+        Client *cl = worst[i].client; // evicting one never frees another
+        size_t freed = cl->bufferCapacity();
+        evictClient(cl, "SendQ exceeded (server memory)");
+        ++_pressureEvictions;
+        held -= std::min(held, freed);
+    }
+}
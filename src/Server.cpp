@@ -1,14 +1,94 @@
 #include "Server.hpp"
+#include <algorithm>
 
-Server::Server(int port, const std::string &password)
-    : _port(port), _password(password), _serverFd(-1), _running(false)
+Server::Server(int port, const std::string &password, const Config &config, Transport *io)
+    : _port(port), _password(password), _config(config), _io(io ? io : &_sockets), _serverFd(-1), _running(false), _pollHoles(0), _batchSeq(0),
+      _snapshotInterval(0), _lastSnapshot(0), _snapshotPid(-1), _snapshotDirty(false), _restoredUntil(0),
+      _upgradeRequested(0), _stopRequested(0), _busyPoll(false), _busyIdleNs(0), _lastEventNs(0), _busySocketUs(0)
 {
-    setupServer();
+    if (pipe(_signalPipe) < 0)
+        throw std::runtime_error("pipe() failed");
+    for (int i = 0; i < 2; ++i)
+    {
+        fcntl(_signalPipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(_signalPipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    std::string scan = _config.getString("scan_level", "avx2");
+    Scan::Level cap = scan == "scalar" ? Scan::SCALAR : (scan == "sse2" ? Scan::SSE2 : Scan::AVX2);
+    std::cout << "scan kernels: " << Scan::levelName(Scan::init(cap)) << std::endl;
+    _cursorChunk = (size_t)_config.getInt("cursor_chunk", 64);
+    _cursorBacklog = (size_t)_config.getInt("cursor_backlog", 16384);
+    _maxListEntries = (size_t)_config.getInt("max_list_entries", 1000);
+    _monitorLimit = (size_t)_config.getInt("monitor_limit", 100);
+    _coalesce = _config.getInt("coalesce_fanout", 1) != 0;
+    _coalescedMsgs = 0;
+    _coalescedPasses = 0;
+    Latency::setEnabled(_config.getInt("latency_stamps", 1) != 0);
+    if (_cursorChunk == 0)
+        _cursorChunk = 1;
+    BufferPool::setIdleLimit((size_t)_config.getInt("buffer_pool_bytes", 8 << 20));
+    _fanoutThreshold = (size_t)_config.getInt("fanout_threshold", 2048);
+    long hot = _config.getInt("sketch_top", 10);
+    int window = (int)_config.getInt("sketch_window", 60);
+    long sample = _config.getInt("sketch_sample", 16);
+    _hotChannels.configure(hot > 0 ? (size_t)hot : 0, window, sample > 0 ? (unsigned int)sample : 1);
+    _hotSenders.configure(hot > 0 ? (size_t)hot : 0, window, sample > 0 ? (unsigned int)sample : 1);
+    long threads = _config.getInt("fanout_threads", 0);
+    if (threads > 0 && !_fanout.start((size_t)threads))
+        std::cerr << "fanout: only " << _fanout.threads() << " worker threads started\n";
+    if (_config.getInt("dns_lookups", 1))
+    {
+        _resolver.configureCache((size_t)_config.getInt("dns_cache_size", 4096), (int)_config.getInt("dns_cache_ttl", 3600),
+                                 (int)_config.getInt("dns_negative_ttl", 300));
+        std::string dnsServer = _config.getString("dns_server", "");
+        if (!_resolver.start((size_t)_config.getInt("dns_threads", 2), dnsServer, (int)_config.getInt("dns_timeout_ms", 3000)))
+            std::cerr << "dns: lookups disabled, cannot start the resolver" << (dnsServer.empty() ? "" : " for " + dnsServer) << std::endl;
+    }
+    setupSendq();
+    setupBusyPoll(); // after the workers exist, they must not inherit the pinning
+    _snapshotPath = _config.getString("snapshot_file", "");
+    _snapshotInterval = (int)_config.getInt("snapshot_interval", 30);
+    _lastSnapshot = time(NULL);
+    // an injected transport has no sockets to open and no state to inherit
+    if (_io == &_sockets)
+    {
+        if (!resumeUpgrade())
+        {
+            setupServer();
+            loadSnapshot();
+        }
+        setupListeners();
+    }
+    else
+    {
+        // it accepts on any fd it does not own, /dev/null just holds the slot
+        _serverFd = open("/dev/null", O_RDONLY);
+        if (_serverFd < 0)
+            throw std::runtime_error("open(/dev/null) failed");
+        Listener l;
+        l.fd = _serverFd;
+        l.webSocket = false;
+        l.spec = "memory";
+        _listeners.push_back(l);
+    }
+    loadPlugins();
+    std::string capture = _config.getString("capture_file", "");
+    if (!capture.empty() && !_capture.open(capture))
+        std::cerr << "capture disabled: cannot open " << capture << std::endl;
+    std::string histDir = _config.getString("history_dir", "");
+    if (!histDir.empty() && !_history.open(histDir, (size_t)_config.getInt("history_segment_size", 1 << 20),
+                                           (size_t)_config.getInt("history_max_bytes", 64 << 20),
+                                           _config.getInt("history_max_age", 30 * 86400),
+                                           (size_t)_config.getInt("history_max_mapped", 1024),
+                                           (unsigned int)_config.getInt("history_index_segments", 4)))
+        std::cerr << "history disabled: cannot use " << histDir << std::endl;
 }
 
 Server::~Server()
 {
     stop();
+    close(_signalPipe[0]);
+    close(_signalPipe[1]);
 }
 
 void Server::setNonBlocking(int fd)
@@ -45,6 +125,112 @@ void Server::setupServer()
     if (listen(_serverFd, SOMAXCONN) < 0)
         throw std::runtime_error("listen() failed");
     setNonBlocking(_serverFd);
+
+    Listener l;
+    l.fd = _serverFd;
+    l.webSocket = false;
+    std::ostringstream spec;
+    spec << _port;
+    l.spec = spec.str();
+    _listeners.push_back(l);
+}
+
+void Server::loadSnapshot()
+{
+    if (_snapshotPath.empty())
+        return;
+    if (!Snapshot::load(_snapshotPath, _channels))
+        return;
+    std::cout << "restored " << _channels.size() << " channels from " << _snapshotPath << std::endl;
+    // ops not back within the grace period lose their claim
+    time_t until = time(NULL) + _config.getInt("snapshot_op_grace", 300);
+    for (std::map<std::string, Channel *>::iterator it = _channels.begin(); it != _channels.end(); ++it)
+    {
+        it->second->setSavedOperatorsUntil(until);
+        noteRestored(it->first, until);
+    }
+}
+
+void Server::noteRestored(const std::string &key, time_t until)
+{
+    if (_restored.empty() || until < _restoredUntil)
+        _restoredUntil = until;
+    _restored.insert(key);
+}
+
+// once the saved ops of a restored channel expire, a channel nobody came
+// back to is freed and one with members gets an op again
+void Server::expireRestored(time_t now)
+{
+    if (_restored.empty() || now < _restoredUntil)
+        return;
+    _restoredUntil = 0;
+    for (std::set<std::string>::iterator it = _restored.begin(); it != _restored.end();)
+    {
+        std::map<std::string, Channel *>::iterator ct = _channels.find(*it);
+        if (ct != _channels.end() && ct->second->hasSavedOperators(now))
+        {
+            time_t until = ct->second->getSavedOperatorsUntil();
+            if (_restoredUntil == 0 || until < _restoredUntil)
+                _restoredUntil = until;
+            ++it;
+            continue;
+        }
+        if (ct != _channels.end())
+        {
+            Channel *ch = ct->second;
+            if (ch->isEmpty())
+            {
+                _history.forget(ch->getName());
+                delete ch;
+                _channels.erase(ct);
+                _snapshotDirty = true;
+            }
+            else
+                ensureChannelHasOperator(ch);
+        }
+        _restored.erase(it++);
+    }
+}
+
+void Server::startSnapshot()
+{
+    if (_snapshotPath.empty() || _snapshotPid > 0 || !_snapshotDirty)
+        return;
+    // the child works on a copy-on-write image, the loop never waits for the disk
+    pid_t pid = fork();
+    if (pid < 0)
+        return;
+    if (pid == 0)
+        _exit(Snapshot::write(_snapshotPath, _channels) ? 0 : 1);
+    _snapshotPid = pid;
+    _snapshotDirty = false;
+    _lastSnapshot = time(NULL);
+}
+
+void Server::periodic()
+{
+    if (_snapshotPid > 0)
+    {
+        int status;
+        if (waitpid(_snapshotPid, &status, WNOHANG) == _snapshotPid)
+        {
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            {
+                std::cerr << "snapshot to " << _snapshotPath << " failed\n";
+                _snapshotDirty = true;
+            }
+            _snapshotPid = -1;
+        }
+    }
+    time_t now = time(NULL);
+    if (_snapshotInterval > 0 && now - _lastSnapshot >= _snapshotInterval)
+        startSnapshot();
+    _capture.flush();
+    _history.expire(now);
+    expireRestored(now);
+    _hotChannels.tick(now);
+    _hotSenders.tick(now);
 }
 
 void Server::addPollFd(int fd, short events)
@@ -54,87 +240,177 @@ void Server::addPollFd(int fd, short events)
     p.fd = fd;
     p.events = events;
     p.revents = 0;
+    if ((size_t)fd >= _pollIndex.size())
+        _pollIndex.resize((size_t)fd + 1, -1);
+    _pollIndex[fd] = (int)_pollFds.size();
     _pollFds.push_back(p);
 }
 
 void Server::modPollEvents(int fd, short addEv, short removeEv)
 {
-    for (size_t i = 0; i < _pollFds.size(); ++i)
-    {
-        if (_pollFds[i].fd == fd)
-        {
-            short e = _pollFds[i].events;
-            e = (e | addEv);
-            e = (short)(e & ~removeEv);
-            _pollFds[i].events = e;
-            return;
-        }
-    }
+    if (fd < 0 || (size_t)fd >= _pollIndex.size() || _pollIndex[fd] < 0)
+        return;
+    pollfd &p = _pollFds[_pollIndex[fd]];
+    p.events = (short)((p.events | addEv) & ~removeEv);
 }
 
 void Server::removePollFd(int fd)
 {
+    // the slot becomes a hole poll() ignores, so indices stay valid while
+    // the loop is walking _pollFds; compactPollFds() closes the gaps later
+    if (fd < 0 || (size_t)fd >= _pollIndex.size() || _pollIndex[fd] < 0)
+        return;
+    pollfd &p = _pollFds[_pollIndex[fd]];
+    p.fd = -1;
+    p.events = 0;
+    p.revents = 0;
+    _pollIndex[fd] = -1;
+    ++_pollHoles;
+}
+
+void Server::compactPollFds()
+{
+    if (_pollHoles == 0)
+        return;
+    size_t out = 0;
     for (size_t i = 0; i < _pollFds.size(); ++i)
     {
-        if (_pollFds[i].fd == fd)
-        {
-            _pollFds.erase(_pollFds.begin() + i);
-            return;
-        }
+        if (_pollFds[i].fd < 0)
+            continue;
+        _pollFds[out] = _pollFds[i];
+        _pollIndex[_pollFds[out].fd] = (int)out;
+        ++out;
     }
+    _pollFds.resize(out);
+    _pollHoles = 0;
 }
 
 void Server::run()
+{
+    start();
+    while (step(-1))
+        ;
+    if (_stopRequested)
+    {
+        std::cout << "\nSignal " << (int)_stopRequested << " caught, shutting down..." << std::endl;
+        stop();
+    }
+}
+
+void Server::start()
 {
     // setting running flag and monitoring server + client
     _running = true;
-    addPollFd(_serverFd, POLLIN);
-    std::cout << "ircserv listening on " << _port << std::endl;
+    for (size_t i = 0; i < _listeners.size(); ++i)
+    {
+        addPollFd(_listeners[i].fd, POLLIN);
+        std::cout << "ircserv listening on " << _listeners[i].spec << std::endl;
+    }
+    if (_resolver.running())
+        addPollFd(_resolver.wakeFd(), POLLIN);
+    addPollFd(_signalPipe[0], POLLIN);
+}
 
-    while (_running)
+bool Server::step(int maxWaitMs)
+{
+    if (!_running || _stopRequested)
+        return false;
+    if (_upgradeRequested)
+    {
+        performUpgrade();
+        if (!_running)
+            return false;
+    }
+    // nb of file descriptor that are ready
+    int timeout = _snapshotInterval > 0 || !_restored.empty() ? 1000 : -1;
+    if (hasRunnableCursor())
+        timeout = 0;
+    int dnsWait = _resolver.nextDeadlineMs();
+    if (dnsWait >= 0 && (timeout < 0 || timeout > dnsWait))
+        timeout = dnsWait;
+    if (maxWaitMs >= 0 && (timeout < 0 || timeout > maxWaitMs))
+        timeout = maxWaitMs;
+    timeout = busyPollTimeout(timeout);
+    int eventsReady = _io->poll(&_pollFds[0], _pollFds.size(), timeout);
+    busyPollEvents(eventsReady);
+    if (eventsReady < 0)
     {
-        // nb of file descriptor that are ready
-        int eventsReady = poll(&_pollFds[0], _pollFds.size(), -1);
-        if (eventsReady < 0)
+        if (errno == EINTR && _running)
+            return true;
+        if (_running)
+            std::cerr << "poll() error\n";
+        return false;
+    }
+    periodic();
+
+    for (size_t i = 0; i < _pollFds.size(); ++i)
+    {
+        int fd = _pollFds[i].fd;
+        short readyEvents = _pollFds[i].revents;
+        if (fd < 0 || !readyEvents || fd == _resolver.wakeFd())
+            continue;
+        if (fd == _signalPipe[0])
         {
-            if (_running)
-                std::cerr << "poll() error\n";
-            break;
+            // the flags are checked at the top of the next step()
+            char buf[64];
+            while (read(fd, buf, sizeof(buf)) > 0)
+                ;
+            continue;
         }
-
-        for (size_t i = 0; i < _pollFds.size(); ++i)
+        if (isListener(fd))
         {
-            int fd = _pollFds[i].fd;
-            short readyEvents = _pollFds[i].revents;
-            if (!readyEvents)
-                continue;
-            if (fd == _serverFd && (readyEvents & POLLIN))
-            {
-                acceptNewClient();
-                continue;
-            }
-            if (readyEvents & (POLLERR | POLLHUP | POLLNVAL))
-            {
-                disconnectClient(fd, "connection closed");
-                if (i > 0)
-                    --i;
-                continue;
-            }
-            if (readyEvents & POLLIN) // input is ready recv wont block
-                handleClientReadable(fd);
-            if (readyEvents & POLLOUT) // output is ready send wont block
-                handleClientWritable(fd);
+            if (readyEvents & POLLIN)
+                acceptNewClient(fd);
+            continue;
+        }
+        if (readyEvents & (POLLERR | POLLHUP | POLLNVAL))
+        {
+            disconnectClient(fd, "connection closed");
+            continue;
         }
+        if (readyEvents & POLLIN) // input is ready recv wont block
+            handleClientReadable(fd);
+        if (readyEvents & POLLOUT) // output is ready send wont block
+            handleClientWritable(fd);
     }
+    handleResolved();
+    flushBroadcasts();
+    enforceSendq();
+    compactPollFds();
+    pumpCursors();
+    return true;
+}
+
+// called from signal handlers: a flag and a wakeup, nothing else
+void Server::wakeLoop()
+{
+    int saved = errno;
+    ssize_t n = write(_signalPipe[1], "s", 1); // fails only when full, a wakeup is pending then
+    (void)n;
+    errno = saved;
+}
+
+void Server::requestStop(int sig)
+{
+    _stopRequested = sig;
+    wakeLoop();
 }
 
 void Server::stop() {
     if (!_running) return;
     _running = false;
 
+    if (!_snapshotPath.empty())
+    {
+        if (_snapshotPid > 0)
+            waitpid(_snapshotPid, NULL, 0);
+        _snapshotPid = -1;
+        Snapshot::write(_snapshotPath, _channels);
+    }
+
     for (std::map<int, Client*>::iterator it = _clients.begin();
          it != _clients.end(); ++it) {
-        close(it->first);
+        _io->close(it->first);
         delete it->second;     // <-- free client objects
     }
     _clients.clear();
@@ -146,21 +422,72 @@ void Server::stop() {
     }
     _channels.clear();
 
-    if (_serverFd >= 0) { close(_serverFd); _serverFd = -1; }
+    for (size_t i = 0; i < _listeners.size(); ++i)
+    {
+        close(_listeners[i].fd);
+        if (!_listeners[i].unixPath.empty())
+            unlink(_listeners[i].unixPath.c_str());
+    }
+    _listeners.clear();
+    _serverFd = -1;
     _pollFds.clear();
+    _pollIndex.clear();
+    _pollHoles = 0;
+    _fanout.stop();
+    _resolver.stop();
+    _plugins.unloadAll();
+    _capture.close();
 }
 
-void Server::acceptNewClient()
+void Server::acceptNewClient(int listenFd)
 {
-    sockaddr_in clientAddress;
-    socklen_t clientSize = sizeof(clientAddress);
-    int ClientFd = accept(_serverFd, (sockaddr *)&clientAddress, &clientSize); // i used sockaddr_in because our server is IPv4
-    if (ClientFd < 0)                                                          // safety measure LOL it should never fail
+    // drain a connect burst in one wakeup instead of one poll pass per client
+    for (int n = 0; n < 64; ++n)
+    {
+        int ClientFd = _io->accept(listenFd); // comes back non-blocking
+        if (ClientFd < 0)                     // none left (or a transient error)
+            return;
+        tuneSocket(ClientFd);
+        addPollFd(ClientFd, POLLIN);
+        Client *c = new Client(ClientFd);
+        if (isWebSocketListener(listenFd))
+            c->startWebSocket();
+        _clients[ClientFd] = c;
+        _capture.connected(ClientFd);
+        c->setAddress(_io->peerAddress(ClientFd));
+        applySendq(c);
+        lookupHost(c);
+    }
+}
+
+void Server::lookupHost(Client *c)
+{
+    if (c->getAddress().empty() || !_resolver.running())
         return;
-    setNonBlocking(ClientFd);
-    addPollFd(ClientFd, POLLIN);
-    Client *c = new Client(ClientFd);
-    _clients[ClientFd] = c;
+    std::string host;
+    if (!_resolver.lookup(c->getFd(), c->getAddress(), host))
+        c->setResolving(true);
+    else if (!host.empty())
+        c->setHostname(host);
+}
+
+void Server::handleResolved()
+{
+    std::vector<Resolver::Answer> answers;
+    _resolver.collect(answers);
+    for (size_t i = 0; i < answers.size(); ++i)
+    {
+        // the fd may have been closed and reused since the lookup started
+        std::map<int, Client *>::iterator it = _clients.find(answers[i].fd);
+        if (it == _clients.end() || !it->second->isResolving() || it->second->getAddress() != answers[i].addr)
+            continue;
+        Client *c = it->second;
+        c->setResolving(false);
+        if (!answers[i].host.empty())
+            c->setHostname(answers[i].host);
+        applySendq(c); // a class may match the name
+        processClientCommands(c); // what arrived meanwhile, may disconnect c
+    }
 }
 
 void Server::handleClientReadable(int fd)
@@ -169,8 +496,15 @@ void Server::handleClientReadable(int fd)
     if (it == _clients.end()) // should never return, just for safety lol
         return;
     Client *c = it->second;
+    if (_sendqPause && c->pendingBytes() > _sendqPause)
+    {
+        // leave it in the socket, TCP holds the client back until we drained
+        c->setReadPaused(true);
+        modPollEvents(fd, 0, POLLIN);
+        return;
+    }
     char buf[4096];
-    ssize_t bytesRead = recv(fd, buf, sizeof(buf), 0);
+    ssize_t bytesRead = _io->recv(fd, buf, sizeof(buf));
     if (bytesRead == 0)
     {
         disconnectClient(fd, "EOF");
@@ -183,10 +517,46 @@ void Server::handleClientReadable(int fd)
         disconnectClient(fd, "recv error");
         return;
     }
-    c->appendToInbuf(buf, (size_t)bytesRead); // must check
+    if (c->webSocket())
+    {
+        if (!receiveWebSocket(c, buf, (size_t)bytesRead))
+            return;
+    }
+    else
+    {
+        _capture.received(fd, buf, (size_t)bytesRead);
+        c->appendToInbuf(buf, (size_t)bytesRead); // must check
+    }
     processClientCommands(c);
 }
 
+bool Server::receiveWebSocket(Client *c, const char *data, size_t length)
+{
+    std::string text, back;
+    bool ok = c->webSocket()->receive(data, length, text, back);
+    int fd = c->getFd();
+    if (!back.empty())
+    {
+        c->queueRaw(back);
+        modPollEvents(fd, POLLOUT, 0);
+    }
+    if (!ok)
+    {
+        // best effort for the close frame or HTTP error, the socket goes now
+        const char *p;
+        size_t n;
+        c->nextWrite(p, n);
+        _io->send(fd, p, n);
+        disconnectClient(fd, "WebSocket closed");
+        return false;
+    }
+    // the capture holds IRC lines, so a replay can run over plain TCP
+    if (!text.empty())
+        _capture.received(fd, text.data(), text.size());
+    c->appendToInbuf(text.data(), text.size());
+    return true;
+}
+
 void Server::handleClientWritable(int fd)
 {
     std::map<int, Client *>::iterator it = _clients.find(fd);
@@ -196,10 +566,13 @@ void Server::handleClientWritable(int fd)
         return;
     }
     Client *c = it->second;
+    // each lane is one contiguous buffer, a single send covers all it holds
     while (c->hasPendingWrite())
     {
-        const std::string &msg = c->frontWrite();
-        ssize_t sent = send(fd, msg.data(), msg.size(), 0);
+        const char *data;
+        size_t pending;
+        c->nextWrite(data, pending);
+        ssize_t sent = _io->send(fd, data, pending);
         if (sent < 0)
         {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
@@ -207,15 +580,14 @@ void Server::handleClientWritable(int fd)
             disconnectClient(fd, "send error");
             return;
         }
-        if ((size_t)sent < msg.size())
+        c->consumeWrite((size_t)sent);
+        if (c->isReadPaused() && c->pendingBytes() <= _sendqPause / 2)
         {
-            std::string rest = msg.substr((size_t)sent);
-            c->popFrontWrite();
-            c->queueWrite(rest);
-            return; // wait for next POLLOUT
+            c->setReadPaused(false);
+            modPollEvents(fd, POLLIN, 0);
         }
-        else
-            c->popFrontWrite();
+        if ((size_t)sent < pending)
+            return; // wait for next POLLOUT
     }
     modPollEvents(fd, 0, POLLOUT);
 }
@@ -226,23 +598,33 @@ void Server::disconnectClient(int fd, const std::string &reason)
     if (it == _clients.end())
     {
         removePollFd(fd);
-        close(fd);
+        _io->close(fd);
         return;
     }
     Client *c = it->second;
+    flushBroadcasts(); // the batch skips this fd for its own messages, and fds get reused
+    _cursors.erase(fd);
+    _capture.disconnected(fd);
+    clearMonitors(c);
+    if (c->isRegistered())
+        monitorPresence(c, c->getNickname(), false);
     for (std::map<std::string, Channel *>::iterator ct = _channels.begin(); ct != _channels.end();)
     {
         Channel *ch = ct->second;
-        if (ch->isMember(fd))
+        ch->forgetFd(fd); // a pending INVITE must not pass to whoever gets this fd next
+        if (!ch->isMember(fd))
         {
-            std::string msg = ":" + c->getNickname() + " PART " + ch->getName() + " :Quit: " + reason + "\r\n";
-            channelBroadcast(ch, msg, -1);
-            ch->removeMember(fd);
+            ++ct;
+            continue;
         }
+        Format::Line msg;
+        channelBroadcast(ch, (msg << ':' << c->getMask() << " PART " << ch->getName() << " :Quit: " << reason).end(), -1);
+        ch->removeMember(fd);
+        _snapshotDirty = true;
         if (ch->isEmpty())
         {
-            // delete ch;
-            // ch =NULL;
+            _history.forget(ch->getName());
+            delete ch;
             std::map<std::string, Channel *>::iterator toErase = ct++;
             _channels.erase(toErase);
         }
@@ -254,30 +636,48 @@ void Server::disconnectClient(int fd, const std::string &reason)
     }
     if (!c->getNickname().empty())
     {
-        std::map<std::string, Client *>::iterator nit = _nicks.find(c->getNickname());
+        std::map<std::string, Client *>::iterator nit = _nicks.find(Scan::folded(c->getNickname()));
         if (nit != _nicks.end() && nit->second == c)
             _nicks.erase(nit);
     }
     removePollFd(fd);
-    close(fd);
+    _io->close(fd);
     delete c;
     // c = NULL;
     _clients.erase(it);
 }
-void Server::reply(Client *c, const std::string &msg)
+void Server::reply(Client *c, const std::string &msg, Client::Lane lane)
+{
+    if (!c)
+        return;
+    reply(c, msg, lane, Latency::stamp(Latency::DIRECT));
+}
+
+void Server::reply(Client *c, const std::string &msg, Client::Lane lane, const Latency::Stamp &st)
 {
     if (!c)
         return;
-    c->queueWrite(msg);
+    c->queueWrite(msg.data(), msg.size(), lane, st);
+    if (c->sendqExceeded())
+        ++_sendqOverflows;
+    modPollEvents(c->getFd(), POLLOUT, 0);
+}
+
+void Server::reply(Client *c, const Format::Line &line, Client::Lane lane)
+{
+    if (!c)
+        return;
+    c->queueWrite(line.data(), line.size(), lane, Latency::stamp(Latency::DIRECT));
+    if (c->sendqExceeded())
+        ++_sendqOverflows;
     modPollEvents(c->getFd(), POLLOUT, 0);
 }
 
 void Server::outputMessage(Client *c, const std::string &msg)
 {
-    std::ostringstream oss;
-    std::string nick = c->getNickname().empty() ? "*" : c->getNickname();
-    oss << ":localhost " << " " << nick << " " << msg << "\r\n";
-    reply(c, oss.str());
+    Format::Line line;
+    line << ":localhost  " << (c->getNickname().empty() ? "*" : c->getNickname().c_str()) << ' ' << msg;
+    reply(c, line.end());
 }
 
 void Server::welcomeIfReady(Client *c)
@@ -286,34 +686,283 @@ void Server::welcomeIfReady(Client *c)
         return;
     if (!c->hasPassed() || !c->hasNick() || !c->hasUser() || c->isRegistered())
         return;
+    if (c->isNegotiatingCaps()) // held back until CAP END
+        return;
     c->setRegistered(true);
+    applySendq(c);
+    monitorPresence(c, c->getNickname(), true);
     outputMessage(c, ":Welcome to the IRC network " + c->getNickname());
     outputMessage(c, ":Your host is localhost");
 }
 
 void Server::splitCommand(const std::string &line, std::string &cmd, std::string &args)
 {
-    std::istringstream iss(line);
-    iss >> cmd;
-    std::getline(iss, args);
-    if (!args.empty() && args[0] == ' ')
-        args.erase(0, 1);
+    size_t start = line.find_first_not_of(' ');
+    // message tags sent by the client are not used, skip them
+    if (start != std::string::npos && line[start] == '@')
+    {
+        size_t sp = line.find(' ', start);
+        start = sp == std::string::npos ? sp : line.find_first_not_of(' ', sp);
+    }
+    if (start == std::string::npos)
+    {
+        cmd.clear();
+        args.clear();
+        return;
+    }
+    size_t sp = start + Scan::findByte(line.data() + start, line.size() - start, ' ');
+    cmd.assign(line, start, sp - start);
+    if (sp < line.size())
+        args.assign(line, sp + 1, std::string::npos);
+    else
+        args.clear();
+}
+
+namespace
+{
+    // a batch of channel messages, and which members sent some of them
+    struct ChannelBatch
+    {
+        const char *bytes;
+        const size_t *ends;
+        const int *senders;
+        const Latency::Stamp *stamps;
+        size_t count;
+        std::vector<int> senderFds;        // sorted, unique
+
+        bool sent(int fd) const { return std::binary_search(senderFds.begin(), senderFds.end(), fd); }
+
+        // everything but the member's own messages; false if nothing is left
+        bool queueFor(Client *c, int fd, Client::Lane lane) const
+        {
+            bool queued = false;
+            for (size_t i = 0; i < count;)
+            {
+                if (senders[i] == fd)
+                {
+                    ++i;
+                    continue;
+                }
+                size_t run = i;
+                while (run < count && senders[run] != fd)
+                    ++run;
+                c->queueBatch(bytes, ends, stamps, i, run, 0, lane);
+                queued = true;
+                i = run;
+            }
+            return queued;
+        }
+    };
+
+    // runs on the pool: every chunk owns a disjoint set of members, and the
+    // loop thread works chunks too until Fanout::run() has them all done
+    struct BroadcastJob : public FanoutJob
+    {
+        const std::vector<Client *> *members;
+        const ChannelBatch *batch;
+        std::vector<pollfd> *pollFds;
+        const std::vector<int> *pollIndex;
+        Transport *io;
+        Client::Lane lane;
+        unsigned long *overflows;          // Server::_sendqOverflows
+
+        void runRange(size_t begin, size_t end)
+        {
+            Latency::Batch direct(batch->stamps[0].cls); // copies handed to the kernel right here
+            size_t total = batch->ends[batch->count - 1];
+            for (size_t i = begin; i < end; ++i)
+            {
+                Client *c = (*members)[i];
+                int fd = c->getFd();
+                if (batch->sent(fd))
+                {
+                    if (!batch->queueFor(c, fd, lane))
+                        continue;
+                }
+                // an empty queue means nothing can overtake us, try the socket first;
+                // WebSocket output has to be framed per client, it always queues
+                else if (!c->hasPendingWrite() && !c->webSocket())
+                {
+                    ssize_t n = io->send(fd, batch->bytes, total);
+                    size_t done = n > 0 ? (size_t)n : 0;
+                    size_t m = 0;
+                    if (done && batch->stamps[0].cls != Latency::NONE)
+                    {
+                        unsigned long long now = Latency::now();
+                        for (; m < batch->count && batch->ends[m] <= done; ++m)
+                            direct.add(now - batch->stamps[m].ns);
+                    }
+                    else
+                        while (m < batch->count && batch->ends[m] <= done)
+                            ++m;
+                    if (m == batch->count)
+                        continue;
+                    c->queueBatch(batch->bytes, batch->ends, batch->stamps, m, batch->count,
+                                  done - (m ? batch->ends[m - 1] : 0), lane);
+                }
+                else
+                    c->queueBatch(batch->bytes, batch->ends, batch->stamps, 0, batch->count, 0, lane);
+                if (c->sendqExceeded())
+                    __sync_fetch_and_add(overflows, 1UL);
+                if ((size_t)fd < pollIndex->size() && (*pollIndex)[fd] >= 0)
+                    (*pollFds)[(*pollIndex)[fd]].events |= POLLOUT;
+            }
+        }
+    };
 }
 
-void Server::channelBroadcast(Channel *ch, const std::string &msg, int excludeFd)
+void Server::fanOut(Channel *ch, const char *bytes, const size_t *ends, const int *senders, const Latency::Stamp *stamps,
+                    size_t count, Client::Lane lane)
 {
+    ChannelBatch batch;
+    batch.bytes = bytes;
+    batch.ends = ends;
+    batch.senders = senders;
+    batch.stamps = stamps;
+    batch.count = count;
+    batch.senderFds.assign(senders, senders + count);
+    std::sort(batch.senderFds.begin(), batch.senderFds.end());
+    batch.senderFds.erase(std::unique(batch.senderFds.begin(), batch.senderFds.end()), batch.senderFds.end());
+
     const std::map<int, Client *> &m = ch->getMembers();
+    if (m.size() >= _fanoutThreshold && _fanout.threads() > 0)
+    {
+        BroadcastJob job;
+        job.members = &ch->getMemberList();
+        job.batch = &batch;
+        job.pollFds = &_pollFds;
+        job.pollIndex = &_pollIndex;
+        job.io = _io;
+        job.lane = lane;
+        job.overflows = &_sendqOverflows;
+        _fanout.run(job, job.members->size());
+        return;
+    }
     for (std::map<int, Client *>::const_iterator it = m.begin(); it != m.end(); ++it)
     {
-        if (it->first == excludeFd)
-            continue;
-        reply(it->second, msg);
+        if (batch.sent(it->first))
+        {
+            if (!batch.queueFor(it->second, it->first, lane))
+                continue;
+        }
+        else
+            it->second->queueBatch(bytes, ends, stamps, 0, count, 0, lane);
+        if (it->second->sendqExceeded())
+            ++_sendqOverflows;
+        modPollEvents(it->first, POLLOUT, 0);
+    }
+}
+
+void Server::channelBroadcast(Channel *ch, const char *msg, size_t len, int excludeFd, Client::Lane lane)
+{
+    flushBroadcasts(); // whatever was posted earlier goes out first
+    const std::map<int, Client *> &m = ch->getMembers();
+    size_t copies = excludeFd >= 0 && m.size() ? m.size() - 1 : m.size(); // the excluded fd is the sender, a member
+    _hotChannels.add(ch->getName().data(), ch->getName().size(), (unsigned long long)len * copies);
+    if (!len)
+        return;
+    Latency::Stamp st = Latency::stamp(Latency::classFor(m.size())); // one clock read for every copy
+    fanOut(ch, msg, &len, &excludeFd, &st, 1, lane);
+}
+
+// like channelBroadcast, at the end of the loop iteration together with
+// whatever else this channel gets in it
+void Server::channelMessage(Channel *ch, const Format::Line &line, int excludeFd, Client::Lane lane)
+{
+    if (!_coalesce)
+    {
+        channelBroadcast(ch, line, excludeFd, lane);
+        return;
+    }
+    const std::map<int, Client *> &m = ch->getMembers();
+    size_t copies = excludeFd >= 0 && m.size() ? m.size() - 1 : m.size();
+    _hotChannels.add(ch->getName().data(), ch->getName().size(), (unsigned long long)line.size() * copies);
+    std::pair<std::map<std::pair<Channel *, int>, size_t>::iterator, bool> slot =
+        _coalescedIndex.insert(std::make_pair(std::make_pair(ch, (int)lane), _coalesced.size()));
+    if (slot.second)
+    {
+        _coalesced.push_back(Coalesced());
+        _coalesced.back().ch = ch;
+        _coalesced.back().lane = lane;
+    }
+    Coalesced &b = _coalesced[slot.first->second];
+    b.bytes.append(line.data(), line.size());
+    b.ends.push_back(b.bytes.size());
+    b.senders.push_back(excludeFd);
+    b.stamps.push_back(Latency::stamp(Latency::classFor(m.size())));
+    _coalescedSenders.insert(excludeFd);
+    ++_coalescedMsgs;
+}
+
+void Server::flushBroadcasts()
+{
+    if (_coalesced.empty())
+        return;
+    std::vector<Coalesced> batches;
+    batches.swap(_coalesced);
+    _coalescedIndex.clear();
+    _coalescedSenders.clear();
+    for (size_t i = 0; i < batches.size(); ++i)
+    {
+        Coalesced &b = batches[i];
+        fanOut(b.ch, b.bytes.data(), &b.ends[0], &b.senders[0], &b.stamps[0], b.ends.size(), b.lane);
+        ++_coalescedPasses;
+    }
+}
+
+std::vector<std::string> Server::splitList(const std::string &list)
+{
+    std::vector<std::string> out;
+    std::string::size_type start = 0;
+    while (start < list.size())
+    {
+        std::string::size_type comma = start + Scan::findByte(list.data() + start, list.size() - start, ',');
+        if (comma > start)
+            out.push_back(list.substr(start, comma - start));
+        start = comma + 1;
     }
+    return out;
+}
+
+Channel *Server::findChannel(const std::string &name)
+{
+    std::map<std::string, Channel *>::iterator it = _channels.find(Scan::folded(name));
+    if (it == _channels.end())
+        return NULL;
+    return it->second;
+}
+
+std::string Server::normalizeMask(const std::string &mask)
+{
+    // "bad" => "bad!*@*", "bad@host" => "*!bad@host", "nick!user" => "nick!user@*"
+    std::string m = mask;
+    std::string::size_type bang = m.find('!');
+    std::string::size_type at = m.find('@');
+    if (bang == std::string::npos && at == std::string::npos)
+        return m + "!*@*";
+    if (bang == std::string::npos)
+        m = "*!" + m;
+    if (at == std::string::npos)
+        m += "@*";
+    return m;
+}
+
+void Server::sendMaskList(Client *c, Channel *ch, char mode)
+{
+    const std::vector<std::string> &list = mode == 'b' ? ch->getBans() : ch->getExcepts();
+    const char *item = mode == 'b' ? ":localhost 367 " : ":localhost 348 ";
+    for (size_t i = 0; i < list.size(); ++i)
+    {
+        Format::Line line;
+        reply(c, (line << item << c->getNickname() << ' ' << ch->getName() << ' ' << list[i]).end());
+    }
+    const Format::Template &end = mode == 'b' ? Format::RPL_ENDOFBANLIST : Format::RPL_ENDOFEXCEPTLIST;
+    reply(c, Format::Line(end, c->getNickname(), ch->getName()).end());
 }
 
 Client *Server::findByNick(const std::string &nick)
 {
-    std::map<std::string, Client *>::iterator it = _nicks.find(nick);
+    std::map<std::string, Client *>::iterator it = _nicks.find(Scan::folded(nick));
     if (it == _nicks.end())
         return NULL;
     return it->second;
@@ -322,8 +971,9 @@ void Server::serverNotice(Client *c, const std::string &text)
 {
     if (!c)
         return;
-    std::string nick = c->getNickname().empty() ? "*" : c->getNickname();
-    reply(c, ":localhost NOTICE " + nick + " :" + text + "\r\n");
+    Format::Line line;
+    line << ":localhost NOTICE " << (c->getNickname().empty() ? "*" : c->getNickname().c_str()) << " :" << text;
+    reply(c, line.end());
 }
 
 void Server::ensureChannelHasOperator(Channel *ch)
@@ -334,6 +984,9 @@ void Server::ensureChannelHasOperator(Channel *ch)
     const std::map<int, Client *> &m = ch->getMembers();
     if (m.empty())
         return;
+    // a restored channel waits for its own ops until the grace period ends
+    if (ch->hasSavedOperators(time(NULL)))
+        return;
 
     // Check if any operator still exists
     bool hasOp = false;
@@ -352,12 +1005,14 @@ void Server::ensureChannelHasOperator(Channel *ch)
     Client *newOp = m.begin()->second;
     ch->addOperator(newOpFd);
 
-    std::string msg = ":localhost MODE " + ch->getName() + " +o " + newOp->getNickname() + "\r\n";
-    channelBroadcast(ch, msg, -1);
+    Format::Line msg;
+    channelBroadcast(ch, (msg << ":localhost MODE " << ch->getName() << " +o " << newOp->getNickname()).end(), -1);
 }
 
 void Server::processClientCommands(Client *c)
 {
+    if (c->isResolving()) // input waits in the buffer for the DNS answer, in order
+        return;
     while (true)
     {
         std::string line = c->popNextCommand();
@@ -370,6 +1025,23 @@ void Server::processClientCommands(Client *c)
         }
         std::string cmd, args;
         splitCommand(line, cmd, args);
+        if (cmd != "PRIVMSG" && cmd != "PING")
+            flushBroadcasts(); // JOIN, PART, MODE... must not overtake what was posted before them
+        Accounting::Scope parsed(Accounting::PARSE);
+        parsed.add(line);
+        parsed.add(args);
+        int fd = c->getFd();
+        // hooks see the parsed command in place, nothing is copied for them
+        ircserv_msg msg;
+        msg.fd = fd;
+        msg.cmd = cmd.data();
+        msg.cmd_len = cmd.size();
+        msg.args = args.data();
+        msg.args_len = args.size();
+        msg.nick = c->getNickname().data();
+        msg.nick_len = c->getNickname().size();
+        if (!_plugins.empty() && !_plugins.run(IRCSERV_BEFORE, msg))
+            continue;
         if (cmd == "PASS")
             handlePASS(c, args);
         else if (cmd == "NICK")
@@ -394,8 +1066,34 @@ void Server::processClientCommands(Client *c)
             handleTOPIC(c, args);
         else if (cmd == "MODE")
             handleMODE(c, args);
+        else if (cmd == "CHATHISTORY")
+            handleCHATHISTORY(c, args);
+        else if (cmd == "CAP")
+            handleCAP(c, args);
+        else if (cmd == "NAMES")
+            handleNAMES(c, args);
+        else if (cmd == "LIST")
+            handleLIST(c, args);
+        else if (cmd == "WHO")
+            handleWHO(c, args);
+        else if (cmd == "OPER")
+            handleOPER(c, args);
+        else if (cmd == "STATS")
+            handleSTATS(c, args);
+        else if (cmd == "MONITOR")
+            handleMONITOR(c, args);
         else
             outputMessage(c, cmd + " :Unknown command");
+        // QUIT (or a failed send) may have freed c
+        std::map<int, Client *>::iterator alive = _clients.find(fd);
+        if (alive == _clients.end() || alive->second != c)
+            return;
+        if (!_plugins.empty())
+        {
+            msg.nick = c->getNickname().data();
+            msg.nick_len = c->getNickname().size();
+            _plugins.run(IRCSERV_AFTER, msg);
+        }
         welcomeIfReady(c);
     }
 }
@@ -411,7 +1109,7 @@ void Server::handleMODE(Client *c, const std::string &args)
         return;
     }
 
-    std::map<std::string, Channel *>::iterator it = _channels.find(chan);
+    std::map<std::string, Channel *>::iterator it = _channels.find(Scan::folded(chan));
     if (it == _channels.end())
     {
         outputMessage(c, chan + " :No such channel");
@@ -424,6 +1122,13 @@ void Server::handleMODE(Client *c, const std::string &args)
         outputMessage(c, chan + " +" + std::string(ch->isInviteOnly() ? "i" : "") + std::string(ch->isTopicRestricted() ? "t" : "") + std::string(ch->hasKey() ? "k" : "") + std::string(ch->getUserLimit() >= 0 ? "l" : ""));
         return;
     }
+    // "MODE #chan b" only reads the list, anyone may do that
+    std::string bare = flags[0] == '+' ? flags.substr(1) : flags;
+    if ((bare == "b" || bare == "e") && (iss >> std::ws).eof())
+    {
+        sendMaskList(c, ch, bare[0]);
+        return;
+    }
     if (!ch->isOperator(c->getFd()))
     {
         outputMessage(c, chan + " :You're not channel operator");
@@ -432,7 +1137,7 @@ void Server::handleMODE(Client *c, const std::string &args)
 
     bool adding = true;
     std::string param;
-    std::ostringstream broadcastModes;
+    Format::Line broadcastModes;
 
     for (size_t i = 0; i < flags.size(); ++i)
     {
@@ -451,10 +1156,12 @@ void Server::handleMODE(Client *c, const std::string &args)
         {
         case 'i':
             ch->setInviteOnly(adding);
+            _snapshotDirty = true;
             broadcastModes << (adding ? "+" : "-") << "i";
             break;
         case 't':
             ch->setTopicRestricted(adding);
+            _snapshotDirty = true;
             broadcastModes << (adding ? "+" : "-") << "t";
             break;
         case 'k':
@@ -467,11 +1174,13 @@ void Server::handleMODE(Client *c, const std::string &args)
                     return;
                 }
                 ch->setKey(param);
+                _snapshotDirty = true;
                 broadcastModes << "+k " << param;
             }
             else
             {
                 ch->clearKey();
+                _snapshotDirty = true;
                 broadcastModes << "-k";
             }
             break;
@@ -489,11 +1198,13 @@ void Server::handleMODE(Client *c, const std::string &args)
                 if (lim < 1)
                     lim = 1;
                 ch->setUserLimit(lim);
-                broadcastModes << "+l " << lim;
+                _snapshotDirty = true;
+                broadcastModes << "+l " << (unsigned long)lim;
             }
             else
             {
                 ch->setUserLimit(-1);
+                _snapshotDirty = true;
                 broadcastModes << "-l";
             }
             break;
@@ -515,8 +1226,30 @@ void Server::handleMODE(Client *c, const std::string &args)
                 ch->addOperator(target->getFd());
             else
                 ch->removeOperator(target->getFd());
-            std::string msg = ":" + c->getNickname() + " MODE " + chan + " " + (adding ? "+o " : "-o ") + param + "\r\n";
-            channelBroadcast(ch, msg, -1);
+            _snapshotDirty = true;
+            Format::Line msg;
+            channelBroadcast(ch, (msg << ':' << c->getMask() << " MODE " << chan << (adding ? " +o " : " -o ") << param).end(), -1);
+            break;
+        }
+        case 'b':
+        case 'e':
+        {
+            if (!(iss >> param))
+            {
+                sendMaskList(c, ch, f);
+                break;
+            }
+            std::string mask = normalizeMask(param);
+            bool changed;
+            if (f == 'b')
+                changed = adding ? (ch->getBans().size() < _maxListEntries && ch->addBan(mask)) : ch->removeBan(mask);
+            else
+                changed = adding ? (ch->getExcepts().size() < _maxListEntries && ch->addExcept(mask)) : ch->removeExcept(mask);
+            if (!changed)
+                break;
+            _snapshotDirty = true;
+            Format::Line msg;
+            channelBroadcast(ch, (msg << ':' << c->getMask() << " MODE " << chan << (adding ? " +" : " -") << f << ' ' << mask).end(), -1);
             break;
         }
         default:
@@ -524,9 +1257,10 @@ void Server::handleMODE(Client *c, const std::string &args)
             break;
         }
     }
-    if (broadcastModes.str().size() > 0)
+    if (broadcastModes.size() > 0)
     {
-        std::string msg = ":" + c->getNickname() + " MODE " + chan + " " + broadcastModes.str() + "\r\n";
-        channelBroadcast(ch, msg, -1);
+        Format::Line msg;
+        msg << ':' << c->getMask() << " MODE " << chan << ' ';
+        channelBroadcast(ch, msg.put(broadcastModes.data(), broadcastModes.size()).end(), -1);
     }
 }
@@ -0,0 +1,155 @@
+#include "Sketch.hpp"
+#include <algorithm>
+
+static const size_t SLOTS = HeavyHitters::BUCKETS + 1;
+
+HeavyHitters::HeavyHitters()
+    : _current(0), _bucketStart(time(NULL)), _bucketSecs(10), _maxTop(10), _sample(1), _skip(1), _rng(0x9E3779B9u)
+{
+    Cell zero = {0, 0};
+    _cells.assign(DEPTH * WIDTH * SLOTS, zero);
+}
+
+void HeavyHitters::configure(size_t top, int windowSecs, unsigned int sample)
+{
+    _maxTop = top;
+    _sample = sample > 0 ? sample : 1;
+    _skip = 1;
+    _bucketSecs = windowSecs / (int)BUCKETS > 0 ? windowSecs / (int)BUCKETS : 1;
+    if (_top.size() > _maxTop)
+        _top.clear();
+}
+
+size_t HeavyHitters::column(size_t row, unsigned long long hash)
+{
+    // multiply-shift with an odd constant per row, the top bits pick the column
+    static const unsigned long long seeds[DEPTH] = {0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+                                                    0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL};
+    return (size_t)((hash * seeds[row]) >> (64 - WIDTH_BITS));
+}
+
+void HeavyHitters::estimate(unsigned long long hash, unsigned int &msgs, unsigned long long &bytes) const
+{
+    unsigned long long m = ~0ULL;
+    bytes = ~0ULL;
+    for (size_t r = 0; r < DEPTH; ++r)
+    {
+        const Cell &sum = _cells[((r * WIDTH + column(r, hash)) * SLOTS) + BUCKETS];
+        m = std::min(m, sum.msgs);
+        bytes = std::min(bytes, sum.bytes);
+    }
+    msgs = (unsigned int)m;
+}
+
+void HeavyHitters::add(const char *key, size_t len, unsigned long long bytes)
+{
+    if (_maxTop == 0 || --_skip > 0)
+        return;
+    // gaps uniform in [1, 2 * _sample - 1], _sample on average: a fixed
+    // stride would lock onto periodic traffic
+    _rng ^= _rng << 13;
+    _rng ^= _rng >> 17;
+    _rng ^= _rng << 5;
+    _skip = 1 + _rng % (2 * _sample - 1);
+    record(key, len, _sample, bytes * _sample);
+}
+
+void HeavyHitters::record(const char *key, size_t len, unsigned long long msgs, unsigned long long bytes)
+{
+    // FNV-1a over the RFC 1459 folded key
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i)
+    {
+        unsigned char c = (unsigned char)key[i];
+        if (c >= 'A' && c <= '^')
+            c = (unsigned char)(c + 32);
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    unsigned long long m = ~0ULL;
+    unsigned long long b = ~0ULL;
+    for (size_t r = 0; r < DEPTH; ++r)
+    {
+        Cell *slots = &_cells[(r * WIDTH + column(r, hash)) * SLOTS];
+        slots[_current].msgs += msgs;
+        slots[_current].bytes += bytes;
+        m = std::min(m, slots[BUCKETS].msgs += msgs);
+        b = std::min(b, slots[BUCKETS].bytes += bytes);
+    }
+
+    Entry *low = NULL;
+    for (size_t i = 0; i < _top.size(); ++i)
+    {
+        if (_top[i].hash == hash)
+        {
+            _top[i].msgs = (unsigned int)m;
+            _top[i].bytes = b;
+            return;
+        }
+        if (!low || _top[i].bytes < low->bytes)
+            low = &_top[i];
+    }
+    if (_top.size() < _maxTop)
+    {
+        Entry e;
+        e.hash = hash;
+        e.key.assign(key, len);
+        e.msgs = (unsigned int)m;
+        e.bytes = b;
+        _top.push_back(e);
+    }
+    else if (low && b > low->bytes)
+    {
+        low->hash = hash;
+        low->key.assign(key, len);
+        low->msgs = (unsigned int)m;
+        low->bytes = b;
+    }
+}
+
+void HeavyHitters::rotate()
+{
+    // the oldest bucket leaves the sum and becomes the current one
+    _current = (_current + 1) % BUCKETS;
+    for (size_t i = 0; i < DEPTH * WIDTH; ++i)
+    {
+        Cell *slots = &_cells[i * SLOTS];
+        slots[BUCKETS].msgs -= slots[_current].msgs;
+        slots[BUCKETS].bytes -= slots[_current].bytes;
+        slots[_current].msgs = 0;
+        slots[_current].bytes = 0;
+    }
+}
+
+void HeavyHitters::tick(time_t now)
+{
+    if (now - _bucketStart < _bucketSecs)
+        return;
+    size_t steps = (size_t)((now - _bucketStart) / _bucketSecs);
+    for (size_t i = 0; i < steps && i <= BUCKETS; ++i)
+        rotate();
+    _bucketStart += (time_t)steps * _bucketSecs;
+    // estimates only shrink here, keys that left the window drop out
+    for (size_t i = 0; i < _top.size();)
+    {
+        estimate(_top[i].hash, _top[i].msgs, _top[i].bytes);
+        if (_top[i].msgs == 0)
+        {
+            _top[i] = _top.back();
+            _top.pop_back();
+        }
+        else
+            ++i;
+    }
+}
+
+static bool heavier(const HeavyHitters::Entry &a, const HeavyHitters::Entry &b)
+{
+    return a.bytes != b.bytes ? a.bytes > b.bytes : a.msgs > b.msgs;
+}
+
+std::vector<HeavyHitters::Entry> HeavyHitters::top() const
+{
+    std::vector<Entry> out(_top);
+    std::sort(out.begin(), out.end(), heavier);
+    return out;
+}
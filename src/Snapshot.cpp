@@ -0,0 +1,213 @@
+#include "Snapshot.hpp"
+#include "Channel.hpp"
+#include "Client.hpp"
+#include "Scan.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// layout: "IRCSNAP2" u32 count, then per channel
+//   str name, str topic, str key, u8 flags, i32 limit, u32 nops, str op...,
+//   u32 nbans, str ban..., u32 nexcepts, str except...   (bans: v2 only)
+// str = u16 length + bytes, ops are nick!user@host
+static const char MAGIC[8] = {'I', 'R', 'C', 'S', 'N', 'A', 'P', '2'};
+static const size_t MAGIC_PREFIX = 7; // the last byte is the version
+static const unsigned char FLAG_INVITE = 1;
+static const unsigned char FLAG_TOPIC = 2;
+
+static void putRaw(std::string &out, const void *p, size_t n)
+{
+    out.append((const char *)p, n);
+}
+
+static void putStr(std::string &out, const std::string &s)
+{
+    unsigned short len = (unsigned short)(s.size() > 0xFFFF ? 0xFFFF : s.size());
+    putRaw(out, &len, sizeof(len));
+    out.append(s, 0, len);
+}
+
+static void putList(std::string &out, const std::vector<std::string> &list)
+{
+    unsigned int n = (unsigned int)list.size();
+    putRaw(out, &n, sizeof(n));
+    for (size_t i = 0; i < list.size(); ++i)
+        putStr(out, list[i]);
+}
+
+bool Snapshot::write(const std::string &path, const std::map<std::string, Channel *> &channels)
+{
+    std::string out;
+    out.reserve(channels.size() * 64 + 16);
+    putRaw(out, MAGIC, sizeof(MAGIC));
+    unsigned int count = (unsigned int)channels.size();
+    putRaw(out, &count, sizeof(count));
+
+    for (std::map<std::string, Channel *>::const_iterator it = channels.begin(); it != channels.end(); ++it)
+    {
+        const Channel *ch = it->second;
+        putStr(out, ch->getName());
+        putStr(out, ch->getTopic());
+        putStr(out, ch->getKey());
+        unsigned char flags = 0;
+        if (ch->isInviteOnly())
+            flags |= FLAG_INVITE;
+        if (ch->isTopicRestricted())
+            flags |= FLAG_TOPIC;
+        putRaw(out, &flags, sizeof(flags));
+        int limit = ch->getUserLimit();
+        putRaw(out, &limit, sizeof(limit));
+
+        // operators are kept by mask, fds mean nothing after a restart; only
+        // the current ones, saved ops not back yet are not carried forward
+        std::vector<std::string> ops;
+        const std::map<int, Client *> &m = ch->getMembers();
+        for (std::map<int, Client *>::const_iterator mi = m.begin(); mi != m.end(); ++mi)
+        {
+            if (ch->isOperator(mi->first))
+                ops.push_back(mi->second->getMask());
+        }
+        unsigned int nops = (unsigned int)ops.size();
+        putRaw(out, &nops, sizeof(nops));
+        for (size_t i = 0; i < ops.size(); ++i)
+            putStr(out, ops[i]);
+        putList(out, ch->getBans());
+        putList(out, ch->getExcepts());
+    }
+
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    size_t off = 0;
+    while (off < out.size())
+    {
+        ssize_t n = ::write(fd, out.data() + off, out.size() - off);
+        if (n <= 0)
+        {
+            close(fd);
+            unlink(tmp.c_str());
+            return false;
+        }
+        off += (size_t)n;
+    }
+    fsync(fd);
+    close(fd);
+    return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+namespace
+{
+    struct Reader
+    {
+        const char *p;
+        const char *end;
+
+        bool raw(void *dst, size_t n)
+        {
+            if ((size_t)(end - p) < n)
+                return false;
+            std::memcpy(dst, p, n);
+            p += n;
+            return true;
+        }
+        bool str(std::string &s)
+        {
+            unsigned short len;
+            if (!raw(&len, sizeof(len)) || (size_t)(end - p) < len)
+                return false;
+            s.assign(p, len);
+            p += len;
+            return true;
+        }
+        bool list(std::vector<std::string> &out)
+        {
+            unsigned int n;
+            if (!raw(&n, sizeof(n)))
+                return false;
+            for (unsigned int i = 0; i < n; ++i)
+            {
+                std::string s;
+                if (!str(s))
+                    return false;
+                out.push_back(s);
+            }
+            return true;
+        }
+    };
+}
+
+bool Snapshot::load(const std::string &path, std::map<std::string, Channel *> &channels)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(MAGIC) + 4)
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return false;
+    madvise(base, size, MADV_SEQUENTIAL);
+
+    Reader r;
+    r.p = (const char *)base;
+    r.end = r.p + size;
+    bool ok = std::memcmp(r.p, MAGIC, MAGIC_PREFIX) == 0 && (r.p[7] == '1' || r.p[7] == '2');
+    bool hasBans = r.p[7] >= '2';
+    r.p += sizeof(MAGIC);
+    unsigned int count = 0;
+    ok = ok && r.raw(&count, sizeof(count));
+
+    for (unsigned int i = 0; ok && i < count; ++i)
+    {
+        std::string name, topic, key;
+        unsigned char flags;
+        int limit;
+        unsigned int nops;
+        if (!r.str(name) || !r.str(topic) || !r.str(key) || !r.raw(&flags, sizeof(flags))
+            || !r.raw(&limit, sizeof(limit)) || !r.raw(&nops, sizeof(nops)) || name.empty())
+        {
+            ok = false;
+            break;
+        }
+        Channel *ch = new Channel(name);
+        ch->setTopic(topic);
+        ch->setKey(key);
+        ch->setInviteOnly((flags & FLAG_INVITE) != 0);
+        ch->setTopicRestricted((flags & FLAG_TOPIC) != 0);
+        ch->setUserLimit(limit);
+        for (unsigned int j = 0; j < nops; ++j)
+        {
+            std::string mask;
+            if (!r.str(mask))
+            {
+                ok = false;
+                break;
+            }
+            ch->addSavedOperator(mask);
+        }
+        std::vector<std::string> bans, excepts;
+        if (ok && hasBans)
+            ok = r.list(bans) && r.list(excepts);
+        for (size_t j = 0; j < bans.size(); ++j)
+            ch->addBan(bans[j]);
+        for (size_t j = 0; j < excepts.size(); ++j)
+            ch->addExcept(excepts[j]);
+        std::string folded = Scan::folded(name);
+        if (channels.find(folded) != channels.end())
+            delete channels[folded];
+        channels[folded] = ch;
+    }
+    munmap(base, size);
+    return ok;
+}
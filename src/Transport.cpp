@@ -0,0 +1,230 @@
+#include "Transport.hpp"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+int SocketTransport::poll(pollfd *fds, size_t n, int timeoutMs)
+{
+    return ::poll(fds, n, timeoutMs);
+}
+
+int SocketTransport::accept(int listenFd)
+{
+    int fd = ::accept(listenFd, NULL, NULL);
+    if (fd >= 0)
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+std::string SocketTransport::peerAddress(int fd)
+{
+    sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    char buf[INET6_ADDRSTRLEN];
+    if (getpeername(fd, (sockaddr *)&ss, &len) < 0)
+        return "";
+    if (ss.ss_family == AF_INET)
+        return inet_ntop(AF_INET, &((sockaddr_in *)&ss)->sin_addr, buf, sizeof(buf)) ? buf : "";
+    if (ss.ss_family != AF_INET6)
+        return "";
+    const in6_addr &a = ((sockaddr_in6 *)&ss)->sin6_addr;
+    if (IN6_IS_ADDR_V4MAPPED(&a)) // ::ffff:a.b.c.d is just an IPv4 peer
+        return inet_ntop(AF_INET, a.s6_addr + 12, buf, sizeof(buf)) ? buf : "";
+    return inet_ntop(AF_INET6, &a, buf, sizeof(buf)) ? buf : "";
+}
+
+ssize_t SocketTransport::recv(int fd, char *buf, size_t len)
+{
+    return ::recv(fd, buf, len, 0);
+}
+
+ssize_t SocketTransport::send(int fd, const char *buf, size_t len)
+{
+    return ::send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+void SocketTransport::close(int fd)
+{
+    ::close(fd);
+}
+
+MemoryTransport::MemoryTransport() : _nextFd(FIRST_FD), _unread(0) {}
+
+int MemoryTransport::poll(pollfd *fds, size_t n, int)
+{
+    int ready = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        fds[i].revents = 0;
+        if (fds[i].fd < 0)
+            continue;
+        Conn *conn = find(fds[i].fd);
+        if (!conn)
+        {
+            if ((fds[i].events & POLLIN) && !_acceptQueue.empty())
+                fds[i].revents = POLLIN;
+        }
+        else
+        {
+            const Conn &c = *conn;
+            if ((fds[i].events & POLLIN) && (!c.in.empty() || c.hungUp))
+                fds[i].revents |= POLLIN;
+            if ((fds[i].events & POLLOUT) && (!c.window || c.out.size() < c.window))
+                fds[i].revents |= POLLOUT;
+        }
+        if (fds[i].revents)
+            ++ready;
+    }
+    return ready;
+}
+
+MemoryTransport::Conn *MemoryTransport::find(int fd)
+{
+    if (fd < FIRST_FD || fd >= _nextFd)
+        return NULL;
+    return &_conns[(size_t)(fd - FIRST_FD)];
+}
+
+const MemoryTransport::Conn *MemoryTransport::find(int fd) const
+{
+    if (fd < FIRST_FD || fd >= _nextFd)
+        return NULL;
+    return &_conns[(size_t)(fd - FIRST_FD)];
+}
+
+int MemoryTransport::accept(int)
+{
+    if (_acceptQueue.empty())
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    int fd = _acceptQueue.front();
+    _acceptQueue.pop_front();
+    return fd;
+}
+
+ssize_t MemoryTransport::recv(int fd, char *buf, size_t len)
+{
+    Conn *conn = find(fd);
+    if (!conn || conn->closed)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    Conn &c = *conn;
+    if (c.in.empty())
+    {
+        if (c.hungUp)
+            return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t n = c.in.size() < len ? c.in.size() : len;
+    std::memcpy(buf, c.in.data(), n);
+    if (n == c.in.size())
+        std::string().swap(c.in); // idle connections keep no block
+    else
+        c.in.erase(0, n);
+    _unread -= n;
+    return (ssize_t)n;
+}
+
+ssize_t MemoryTransport::send(int fd, const char *buf, size_t len)
+{
+    Conn *conn = find(fd);
+    if (!conn || conn->closed || conn->hungUp)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    Conn &c = *conn;
+    size_t n = len;
+    if (c.window)
+    {
+        size_t room = c.out.size() < c.window ? c.window - c.out.size() : 0;
+        if (room == 0)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (n > room)
+            n = room;
+    }
+    c.out.append(buf, n);
+    return (ssize_t)n;
+}
+
+void MemoryTransport::close(int fd)
+{
+    Conn *conn = find(fd);
+    if (conn)
+        conn->closed = true;
+}
+
+std::string MemoryTransport::peerAddress(int fd)
+{
+    Conn *conn = find(fd);
+    return conn ? conn->peer : "";
+}
+
+int MemoryTransport::connect(const std::string &peer)
+{
+    int fd = _nextFd++;
+    Conn c;
+    c.hungUp = false;
+    c.closed = false;
+    c.window = 0;
+    c.peer = peer;
+    _conns.push_back(c);
+    _acceptQueue.push_back(fd);
+    return fd;
+}
+
+void MemoryTransport::inject(int fd, const std::string &bytes)
+{
+    Conn *conn = find(fd);
+    if (!conn)
+        return;
+    conn->in += bytes;
+    _unread += bytes.size();
+}
+
+void MemoryTransport::hangUp(int fd)
+{
+    Conn *conn = find(fd);
+    if (conn)
+        conn->hungUp = true;
+}
+
+void MemoryTransport::setWindow(int fd, size_t bytes)
+{
+    Conn *conn = find(fd);
+    if (conn)
+        conn->window = bytes;
+}
+
+std::string MemoryTransport::take(int fd)
+{
+    std::string out;
+    Conn *conn = find(fd);
+    if (conn)
+        out.swap(conn->out);
+    return out;
+}
+
+size_t MemoryTransport::outputSize(int fd) const
+{
+    const Conn *conn = find(fd);
+    return conn ? conn->out.size() : 0;
+}
+
+bool MemoryTransport::isClosed(int fd) const
+{
+    const Conn *conn = find(fd);
+    return !conn || conn->closed;
+}
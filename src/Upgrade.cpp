@@ -0,0 +1,590 @@
+#include "Server.hpp"
+#include <sys/un.h>
+#include <dirent.h>
+
+extern char **environ;
+
+// Binary upgrade: the running server forks/execs the new binary, streams its
+// state over a socketpair and hands every socket over with SCM_RIGHTS. The
+// new process acks once it owns everything, then the old one just exits;
+// closing our copies of the fds does not touch the connections.
+
+static const char *UPGRADE_ENV = "IRCSERV_UPGRADE_FD";
+static const unsigned int UPGRADE_VERSION = 7;
+static const size_t FDS_PER_MSG = 200;
+
+namespace
+{
+    struct Writer
+    {
+        std::string out;
+
+        void raw(const void *p, size_t n) { out.append((const char *)p, n); }
+        void u32(unsigned int v) { raw(&v, sizeof(v)); }
+        void i32(int v) { raw(&v, sizeof(v)); }
+        void str(const std::string &s)
+        {
+            u32((unsigned int)s.size());
+            out.append(s);
+        }
+    };
+
+    struct Reader
+    {
+        const char *p;
+        const char *end;
+        bool ok;
+
+        void raw(void *dst, size_t n)
+        {
+            if (!ok || (size_t)(end - p) < n)
+            {
+                ok = false;
+                std::memset(dst, 0, n);
+                return;
+            }
+            std::memcpy(dst, p, n);
+            p += n;
+        }
+        unsigned int u32()
+        {
+            unsigned int v;
+            raw(&v, sizeof(v));
+            return v;
+        }
+        int i32()
+        {
+            int v;
+            raw(&v, sizeof(v));
+            return v;
+        }
+        std::string str()
+        {
+            unsigned int n = u32();
+            if (!ok || (size_t)(end - p) < n)
+            {
+                ok = false;
+                return "";
+            }
+            std::string s(p, n);
+            p += n;
+            return s;
+        }
+    };
+}
+
+static bool writeAll(int fd, const char *p, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return false;
+        p += w;
+        n -= (size_t)w;
+    }
+    return true;
+}
+
+static bool readAll(int fd, char *p, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= (size_t)r;
+    }
+    return true;
+}
+
+static bool sendFds(int sock, const std::vector<int> &fds)
+{
+    for (size_t i = 0; i < fds.size(); i += FDS_PER_MSG)
+    {
+        size_t n = fds.size() - i < FDS_PER_MSG ? fds.size() - i : FDS_PER_MSG;
+        unsigned int count = (unsigned int)n;
+        iovec iov;
+        iov.iov_base = &count;
+        iov.iov_len = sizeof(count);
+
+        std::vector<char> control(CMSG_SPACE(n * sizeof(int)));
+        msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control[0];
+        msg.msg_controllen = control.size();
+        cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(n * sizeof(int));
+        std::memcpy(CMSG_DATA(cm), &fds[i], n * sizeof(int));
+        if (sendmsg(sock, &msg, 0) != (ssize_t)sizeof(count))
+            return false;
+    }
+    return true;
+}
+
+static bool recvFds(int sock, size_t total, std::vector<int> &fds)
+{
+    while (fds.size() < total)
+    {
+        unsigned int count = 0;
+        iovec iov;
+        iov.iov_base = &count;
+        iov.iov_len = sizeof(count);
+
+        std::vector<char> control(CMSG_SPACE(FDS_PER_MSG * sizeof(int)));
+        msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control[0];
+        msg.msg_controllen = control.size();
+        if (recvmsg(sock, &msg, 0) != (ssize_t)sizeof(count))
+            return false;
+        cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        if (!cm || cm->cmsg_type != SCM_RIGHTS || count > FDS_PER_MSG)
+            return false;
+        size_t start = fds.size();
+        fds.resize(start + count);
+        std::memcpy(&fds[start], CMSG_DATA(cm), count * sizeof(int));
+    }
+    return true;
+}
+
+void Server::setUpgradeCommand(char **argv)
+{
+    char path[4096];
+    ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (n > 0)
+    {
+        path[n] = '\0';
+        _execPath = path;
+        // the binary we run from may already have been replaced on disk
+        std::string::size_type del = _execPath.rfind(" (deleted)");
+        if (del != std::string::npos && del + 10 == _execPath.size())
+            _execPath.erase(del);
+    }
+    else
+        _execPath = argv[0];
+    _execArgs.clear();
+    for (int i = 0; argv[i]; ++i)
+        _execArgs.push_back(argv[i]);
+}
+
+void Server::requestUpgrade()
+{
+    _upgradeRequested = 1;
+    wakeLoop();
+}
+
+std::string Server::serializeState(std::vector<int> &fds)
+{
+    Writer w;
+    w.u32(UPGRADE_VERSION);
+
+    // fds travel in the same order they are listed here
+    w.i32(_serverFd);
+    fds.push_back(_serverFd);
+    w.u32((unsigned int)_listeners.size() - 1);
+    for (size_t i = 0; i < _listeners.size(); ++i)
+    {
+        if (_listeners[i].fd == _serverFd)
+            continue;
+        fds.push_back(_listeners[i].fd);
+        w.str(_listeners[i].spec);
+        w.str(_listeners[i].unixPath);
+    }
+
+    w.u32((unsigned int)_clients.size());
+    for (std::map<int, Client *>::iterator it = _clients.begin(); it != _clients.end(); ++it)
+    {
+        Client *c = it->second;
+        fds.push_back(it->first);
+        w.i32(it->first);
+        w.u32((c->hasPassed() ? 1u : 0u) | (c->hasNick() ? 2u : 0u) | (c->hasUser() ? 4u : 0u) | (c->isRegistered() ? 8u : 0u)
+              | (c->isNegotiatingCaps() ? 16u : 0u) | (c->isOper() ? 32u : 0u));
+        w.u32(c->getCaps());
+        w.str(c->getNickname());
+        w.str(c->getUsername());
+        w.str(c->getRealname());
+        w.str(c->pendingInput());
+        w.u32(c->hasPendingWrite() ? 1u : 0u); // still a list of chunks on the wire
+        if (c->hasPendingWrite())
+            w.str(c->pendingOutput());
+        WebSocket *ws = c->webSocket();
+        w.u32(ws ? 1u | (ws->state() << 1) : 0u);
+        if (ws)
+        {
+            w.str(ws->unread());
+            w.str(ws->partial());
+        }
+        w.str(c->getAddress());
+        w.str(c->getHostname());
+        w.u32(c->isResolving() ? 1u : 0u);
+        std::map<int, std::map<std::string, std::string> >::iterator mon = _monitoring.find(it->first);
+        w.u32(mon == _monitoring.end() ? 0u : (unsigned int)mon->second.size());
+        if (mon != _monitoring.end())
+        {
+            for (std::map<std::string, std::string>::iterator t = mon->second.begin(); t != mon->second.end(); ++t)
+                w.str(t->second);
+        }
+    }
+
+    w.u32((unsigned int)_channels.size());
+    for (std::map<std::string, Channel *>::iterator ct = _channels.begin(); ct != _channels.end(); ++ct)
+    {
+        Channel *ch = ct->second;
+        w.str(ch->getName());
+        w.str(ch->getTopic());
+        w.str(ch->getKey());
+        w.u32((ch->isInviteOnly() ? 1u : 0u) | (ch->isTopicRestricted() ? 2u : 0u));
+        w.i32(ch->getUserLimit());
+
+        const std::map<int, Client *> &m = ch->getMembers();
+        w.u32((unsigned int)m.size());
+        for (std::map<int, Client *>::const_iterator mi = m.begin(); mi != m.end(); ++mi)
+        {
+            w.i32(mi->first);
+            w.u32(ch->isOperator(mi->first) ? 1u : 0u);
+        }
+        const std::set<int> &inv = ch->getInvited();
+        w.u32((unsigned int)inv.size());
+        for (std::set<int>::const_iterator ii = inv.begin(); ii != inv.end(); ++ii)
+            w.i32(*ii);
+        const std::set<std::string> &saved = ch->getSavedOperators();
+        w.u32((unsigned int)ch->getSavedOperatorsUntil());
+        w.u32((unsigned int)saved.size());
+        for (std::set<std::string>::const_iterator si = saved.begin(); si != saved.end(); ++si)
+            w.str(*si);
+        w.u32((unsigned int)ch->getBans().size());
+        for (size_t i = 0; i < ch->getBans().size(); ++i)
+            w.str(ch->getBans()[i]);
+        w.u32((unsigned int)ch->getExcepts().size());
+        for (size_t i = 0; i < ch->getExcepts().size(); ++i)
+            w.str(ch->getExcepts()[i]);
+    }
+    return w.out;
+}
+
+bool Server::restoreState(const std::string &blob, const std::vector<int> &fds)
+{
+    Reader r;
+    r.p = blob.data();
+    r.end = r.p + blob.size();
+    r.ok = true;
+    // older senders are accepted, fields they did not know keep their defaults
+    unsigned int version = r.u32();
+    if (version == 0 || version > UPGRADE_VERSION)
+        return false;
+
+    size_t next = 0;
+    std::map<int, int> fdMap; // old fd => fd received here
+    int oldListen = r.i32();
+    if (next >= fds.size())
+        return false;
+    fdMap[oldListen] = fds[next++];
+    _serverFd = fds[0];
+    Listener main;
+    main.fd = _serverFd;
+    main.webSocket = false;
+    std::ostringstream spec;
+    spec << _port;
+    main.spec = spec.str();
+    _listeners.push_back(main);
+    unsigned int nlisteners = version >= 4 ? r.u32() : 0;
+    for (unsigned int i = 0; r.ok && i < nlisteners; ++i)
+    {
+        Listener l;
+        l.spec = r.str();
+        l.unixPath = r.str();
+        l.webSocket = isWebSocketSpec(l.spec);
+        if (!r.ok || next >= fds.size())
+            return false;
+        l.fd = fds[next++];
+        setNonBlocking(l.fd);
+        _listeners.push_back(l);
+    }
+
+    unsigned int nclients = r.u32();
+    for (unsigned int i = 0; r.ok && i < nclients; ++i)
+    {
+        int oldFd = r.i32();
+        unsigned int flags = r.u32();
+        unsigned int caps = version >= 2 ? r.u32() : 0;
+        std::string nick = r.str();
+        std::string user = r.str();
+        std::string real = r.str();
+        std::string inbuf = r.str();
+        if (!r.ok || next >= fds.size())
+            return false;
+        int fd = fds[next++];
+        fdMap[oldFd] = fd;
+
+        Client *c = new Client(fd);
+        if (flags & 1u)
+            c->markPassed();
+        if (flags & 2u)
+        {
+            c->setNickname(nick);
+            _nicks[Scan::folded(nick)] = c;
+        }
+        if (flags & 4u)
+            c->setUsername(user, real);
+        c->setRegistered((flags & 8u) != 0);
+        c->setNegotiatingCaps((flags & 16u) != 0);
+        c->setOper((flags & 32u) != 0);
+        c->setCaps(caps);
+        c->appendToInbuf(inbuf.data(), inbuf.size());
+        unsigned int nout = r.u32();
+        for (unsigned int j = 0; r.ok && j < nout; ++j)
+            c->queueRaw(r.str()); // already framed for a WebSocket
+        unsigned int ws = version >= 5 ? r.u32() : 0;
+        if (ws & 1u)
+        {
+            std::string unread = r.str();
+            std::string partial = r.str();
+            c->startWebSocket();
+            c->webSocket()->restore(ws >> 1, unread, partial);
+        }
+        if (version >= 6)
+        {
+            c->setAddress(r.str());
+            std::string host = r.str();
+            bool resolving = r.u32() != 0;
+            if (!host.empty())
+                c->setHostname(host);
+            if (resolving) // the lookup died with the old process, start over
+                lookupHost(c);
+        }
+        unsigned int nmon = version >= 7 ? r.u32() : 0;
+        for (unsigned int j = 0; r.ok && j < nmon; ++j)
+            addMonitor(c, r.str());
+        applySendq(c);
+        _clients[fd] = c;
+        setNonBlocking(fd);
+        tuneSocket(fd);
+        addPollFd(fd, (short)(POLLIN | (c->hasPendingWrite() ? POLLOUT : 0)));
+    }
+
+    unsigned int nchannels = r.u32();
+    for (unsigned int i = 0; r.ok && i < nchannels; ++i)
+    {
+        Channel *ch = new Channel(r.str());
+        _channels[Scan::folded(ch->getName())] = ch;
+        ch->setTopic(r.str());
+        ch->setKey(r.str());
+        unsigned int flags = r.u32();
+        ch->setInviteOnly((flags & 1u) != 0);
+        ch->setTopicRestricted((flags & 2u) != 0);
+        ch->setUserLimit(r.i32());
+
+        unsigned int nmembers = r.u32();
+        for (unsigned int j = 0; r.ok && j < nmembers; ++j)
+        {
+            std::map<int, int>::iterator fi = fdMap.find(r.i32());
+            bool op = r.u32() != 0;
+            if (fi == fdMap.end())
+                continue;
+            std::map<int, Client *>::iterator it = _clients.find(fi->second);
+            if (it == _clients.end())
+                continue;
+            ch->addMember(it->second);
+            if (op)
+                ch->addOperator(fi->second);
+        }
+        unsigned int ninvited = r.u32();
+        for (unsigned int j = 0; r.ok && j < ninvited; ++j)
+        {
+            std::map<int, int>::iterator fi = fdMap.find(r.i32());
+            if (fi != fdMap.end())
+                ch->inviteUser(fi->second);
+        }
+        // saved ops keep their deadline
+        ch->setSavedOperatorsUntil((time_t)r.u32());
+        unsigned int nsaved = r.u32();
+        for (unsigned int j = 0; r.ok && j < nsaved; ++j)
+            ch->addSavedOperator(r.str());
+        if (nsaved)
+            noteRestored(Scan::folded(ch->getName()), ch->getSavedOperatorsUntil());
+        if (version >= 3)
+        {
+            unsigned int nbans = r.u32();
+            for (unsigned int j = 0; r.ok && j < nbans; ++j)
+                ch->addBan(r.str());
+            unsigned int nexcepts = r.u32();
+            for (unsigned int j = 0; r.ok && j < nexcepts; ++j)
+                ch->addExcept(r.str());
+        }
+    }
+    return r.ok;
+}
+
+// every open fd, from /proc/self/fd or else by probing up to the fd limit
+static std::vector<int> openFds()
+{
+    std::vector<int> fds;
+    if (DIR *d = opendir("/proc/self/fd"))
+    {
+        int self = dirfd(d);
+        while (struct dirent *e = readdir(d))
+        {
+            if (e->d_name[0] == '.')
+                continue;
+            int fd = std::atoi(e->d_name);
+            if (fd != self)
+                fds.push_back(fd);
+        }
+        closedir(d);
+        return fds;
+    }
+    long max = sysconf(_SC_OPEN_MAX);
+    for (int fd = 0; fd < (max > 0 ? max : 1024); ++fd)
+    {
+        if (fcntl(fd, F_GETFD) >= 0)
+            fds.push_back(fd);
+    }
+    return fds;
+}
+
+// the environment of the new binary: ours, with the handover fd set
+static std::vector<std::string> upgradeEnv(int fd)
+{
+    std::string prefix = std::string(UPGRADE_ENV) + "=";
+    std::vector<std::string> env;
+    for (char **e = environ; *e; ++e)
+    {
+        if (std::strncmp(*e, prefix.c_str(), prefix.size()) != 0)
+            env.push_back(*e);
+    }
+    std::ostringstream own;
+    own << prefix << fd;
+    env.push_back(own.str());
+    return env;
+}
+
+static std::vector<char *> argvOf(const std::vector<std::string> &strs)
+{
+    std::vector<char *> v;
+    for (size_t i = 0; i < strs.size(); ++i)
+        v.push_back(const_cast<char *>(strs[i].c_str()));
+    v.push_back(NULL);
+    return v;
+}
+
+void Server::performUpgrade()
+{
+    _upgradeRequested = 0;
+    if (_execPath.empty())
+    {
+        std::cerr << "upgrade: no binary to exec\n";
+        return;
+    }
+    std::cout << "upgrade: handing over to " << _execPath << std::endl;
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+        std::cerr << "upgrade: socketpair() failed\n";
+        return;
+    }
+    // built before the fork: the child must not allocate (other threads may
+    // hold the heap lock), it only closes fds and execs
+    std::vector<int> inherited = openFds();
+    std::vector<std::string> envStrs = upgradeEnv(sv[1]);
+    std::vector<char *> envp = argvOf(envStrs);
+    std::vector<char *> args = argvOf(_execArgs);
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(sv[0]);
+        close(sv[1]);
+        std::cerr << "upgrade: fork() failed\n";
+        return;
+    }
+    if (pid == 0)
+    {
+        // nothing but stdio and the handover socket survives into the new
+        // binary: sockets come back through it, files and pipes are reopened
+        for (size_t i = 0; i < inherited.size(); ++i)
+        {
+            if (inherited[i] > 2 && inherited[i] != sv[1])
+                close(inherited[i]);
+        }
+        execve(_execPath.c_str(), &args[0], &envp[0]);
+        _exit(127);
+    }
+    close(sv[1]);
+
+    std::vector<int> fds;
+    std::string blob = serializeState(fds);
+    unsigned long long size = blob.size();
+    unsigned int nfds = (unsigned int)fds.size();
+    bool ok = writeAll(sv[0], (const char *)&size, sizeof(size))
+              && writeAll(sv[0], blob.data(), blob.size())
+              && writeAll(sv[0], (const char *)&nfds, sizeof(nfds))
+              && sendFds(sv[0], fds);
+
+    char ack = 0;
+    if (ok)
+    {
+        pollfd p;
+        p.fd = sv[0];
+        p.events = POLLIN;
+        p.revents = 0;
+        ok = poll(&p, 1, 10000) == 1 && read(sv[0], &ack, 1) == 1 && ack == 'K';
+    }
+    close(sv[0]);
+
+    if (!ok)
+    {
+        std::cerr << "upgrade: new binary did not take over, resuming\n";
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return;
+    }
+    std::cout << "upgrade: pid " << pid << " took over" << std::endl;
+    // the new process owns the snapshot and the unix socket files now
+    _snapshotPath.clear();
+    for (size_t i = 0; i < _listeners.size(); ++i)
+        _listeners[i].unixPath.clear();
+    stop();
+}
+
+bool Server::resumeUpgrade()
+{
+    const char *env = getenv(UPGRADE_ENV);
+    if (!env)
+        return false;
+    int sock = std::atoi(env);
+    unsetenv(UPGRADE_ENV);
+
+    unsigned long long size = 0;
+    if (!readAll(sock, (char *)&size, sizeof(size)) || size > (1ULL << 34))
+        throw std::runtime_error("upgrade: bad handover header");
+    std::string blob((size_t)size, '\0');
+    unsigned int nfds = 0;
+    std::vector<int> fds;
+    if ((size && !readAll(sock, &blob[0], blob.size()))
+        || !readAll(sock, (char *)&nfds, sizeof(nfds))
+        || !recvFds(sock, nfds, fds))
+        throw std::runtime_error("upgrade: handover interrupted");
+    if (!restoreState(blob, fds))
+        throw std::runtime_error("upgrade: corrupt handover state");
+
+    char ack = 'K';
+    if (write(sock, &ack, 1) != 1)
+        throw std::runtime_error("upgrade: cannot ack handover");
+    close(sock);
+    std::cout << "upgrade: resumed " << _clients.size() << " clients, "
+              << _channels.size() << " channels" << std::endl;
+    return true;
+}
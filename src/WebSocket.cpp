@@ -0,0 +1,362 @@
+#include "WebSocket.hpp"
+#include "Buffer.hpp"
+#include "Scan.hpp"
+#include "Accounting.hpp"
+#include <cstring>
+#include <cctype>
+
+namespace
+{
+    const char *ACCEPT_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+    unsigned int rol(unsigned int v, int n)
+    {
+        return (v << n) | (v >> (32 - n));
+    }
+
+    // SHA-1 is only here for Sec-WebSocket-Accept, no security rests on it
+    void sha1(const std::string &in, unsigned char digest[20])
+    {
+        unsigned int h[5] = {0x67452301u, 0xEFCDAB89u, 0x98BADCFEu, 0x10325476u, 0xC3D2E1F0u};
+        std::string msg(in);
+        unsigned long long bits = (unsigned long long)in.size() * 8;
+        msg += '\x80';
+        while (msg.size() % 64 != 56)
+            msg += '\0';
+        for (int i = 7; i >= 0; --i)
+            msg += (char)((bits >> (i * 8)) & 0xFF);
+
+        for (size_t block = 0; block < msg.size(); block += 64)
+        {
+            unsigned int w[80];
+            for (int i = 0; i < 16; ++i)
+            {
+                const unsigned char *b = (const unsigned char *)msg.data() + block + i * 4;
+                w[i] = ((unsigned int)b[0] << 24) | ((unsigned int)b[1] << 16) | ((unsigned int)b[2] << 8) | b[3];
+            }
+            for (int i = 16; i < 80; ++i)
+                w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+            unsigned int a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+            for (int i = 0; i < 80; ++i)
+            {
+                unsigned int f, k;
+                if (i < 20)
+                {
+                    f = (b & c) | (~b & d);
+                    k = 0x5A827999u;
+                }
+                else if (i < 40)
+                {
+                    f = b ^ c ^ d;
+                    k = 0x6ED9EBA1u;
+                }
+                else if (i < 60)
+                {
+                    f = (b & c) | (b & d) | (c & d);
+                    k = 0x8F1BBCDCu;
+                }
+                else
+                {
+                    f = b ^ c ^ d;
+                    k = 0xCA62C1D6u;
+                }
+                unsigned int t = rol(a, 5) + f + e + k + w[i];
+                e = d;
+                d = c;
+                c = rol(b, 30);
+                b = a;
+                a = t;
+            }
+            h[0] += a;
+            h[1] += b;
+            h[2] += c;
+            h[3] += d;
+            h[4] += e;
+        }
+        for (int i = 0; i < 5; ++i)
+        {
+            digest[i * 4] = (unsigned char)(h[i] >> 24);
+            digest[i * 4 + 1] = (unsigned char)(h[i] >> 16);
+            digest[i * 4 + 2] = (unsigned char)(h[i] >> 8);
+            digest[i * 4 + 3] = (unsigned char)h[i];
+        }
+    }
+
+    std::string base64(const unsigned char *p, size_t n)
+    {
+        static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        std::string out;
+        for (size_t i = 0; i < n; i += 3)
+        {
+            unsigned int v = (unsigned int)p[i] << 16;
+            if (i + 1 < n)
+                v |= (unsigned int)p[i + 1] << 8;
+            if (i + 2 < n)
+                v |= p[i + 2];
+            out += alphabet[(v >> 18) & 63];
+            out += alphabet[(v >> 12) & 63];
+            out += i + 1 < n ? alphabet[(v >> 6) & 63] : '=';
+            out += i + 2 < n ? alphabet[v & 63] : '=';
+        }
+        return out;
+    }
+
+    std::string lower(std::string s)
+    {
+        for (size_t i = 0; i < s.size(); ++i)
+            s[i] = (char)std::tolower((unsigned char)s[i]);
+        return s;
+    }
+
+    std::string trim(const std::string &s)
+    {
+        size_t b = s.find_first_not_of(" \t");
+        size_t e = s.find_last_not_of(" \t\r");
+        return b == std::string::npos ? "" : s.substr(b, e - b + 1);
+    }
+
+    // true if the comma separated `list` holds `token`, case-insensitive
+    bool hasToken(const std::string &list, const std::string &token)
+    {
+        std::string l = lower(list);
+        size_t start = 0;
+        while (start <= l.size())
+        {
+            size_t comma = l.find(',', start);
+            if (comma == std::string::npos)
+                comma = l.size();
+            if (trim(l.substr(start, comma - start)) == token)
+                return true;
+            start = comma + 1;
+        }
+        return false;
+    }
+
+    void putHeader(std::string &out, unsigned char opcode, size_t len)
+    {
+        out += (char)(0x80 | opcode);
+        if (len < 126)
+            out += (char)len;
+        else if (len < 65536)
+        {
+            out += (char)126;
+            out += (char)(len >> 8);
+            out += (char)(len & 0xFF);
+        }
+        else
+        {
+            out += (char)127;
+            for (int i = 7; i >= 0; --i)
+                out += (char)(((unsigned long long)len >> (i * 8)) & 0xFF);
+        }
+    }
+}
+
+std::string WebSocket::closeFrame(unsigned short code)
+{
+    std::string out;
+    putHeader(out, 0x8, 2);
+    out += (char)(code >> 8);
+    out += (char)(code & 0xFF);
+    return out;
+}
+
+bool WebSocket::handshake(std::string &reply)
+{
+    size_t end = _raw.find("\r\n\r\n");
+    if (end == std::string::npos)
+    {
+        if (_raw.size() <= MAX_HANDSHAKE)
+            return true;
+        reply = "HTTP/1.1 431 Request Header Fields Too Large\r\nConnection: close\r\n\r\n";
+        return false;
+    }
+
+    std::string upgrade, connection, key, version, protocols;
+    size_t pos = _raw.find("\r\n");
+    bool get = _raw.compare(0, 4, "GET ") == 0;
+    while (pos < end)
+    {
+        size_t next = _raw.find("\r\n", pos + 2);
+        std::string line = _raw.substr(pos + 2, next - pos - 2);
+        pos = next;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        std::string name = lower(trim(line.substr(0, colon)));
+        std::string value = trim(line.substr(colon + 1));
+        if (name == "upgrade")
+            upgrade = value;
+        else if (name == "connection")
+            connection = value;
+        else if (name == "sec-websocket-key")
+            key = value;
+        else if (name == "sec-websocket-version")
+            version = value;
+        else if (name == "sec-websocket-protocol")
+            protocols += (protocols.empty() ? "" : ",") + value;
+    }
+    _raw.erase(0, end + 4);
+
+    if (!get || !hasToken(upgrade, "websocket") || !hasToken(connection, "upgrade") || key.empty())
+    {
+        reply = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n";
+        return false;
+    }
+    if (version != "13")
+    {
+        reply = "HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13\r\nConnection: close\r\n\r\n";
+        return false;
+    }
+
+    unsigned char digest[20];
+    sha1(key + ACCEPT_GUID, digest);
+    reply = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: "
+            + base64(digest, sizeof(digest)) + "\r\n";
+    // binary frames carry any bytes, text frames must be UTF-8, so binary wins
+    if (hasToken(protocols, "binary.ircv3.net"))
+    {
+        reply += "Sec-WebSocket-Protocol: binary.ircv3.net\r\n";
+        _state |= BINARY;
+    }
+    else if (hasToken(protocols, "text.ircv3.net"))
+        reply += "Sec-WebSocket-Protocol: text.ircv3.net\r\n";
+    reply += "\r\n";
+    _state |= OPEN;
+    return true;
+}
+
+bool WebSocket::decode(std::string &text, std::string &reply)
+{
+    size_t off = 0;
+    bool ok = true;
+    while (ok && _raw.size() - off >= 2)
+    {
+        const unsigned char *h = (const unsigned char *)_raw.data() + off;
+        size_t avail = _raw.size() - off;
+        bool fin = (h[0] & 0x80) != 0;
+        unsigned char opcode = h[0] & 0x0F;
+        unsigned long long len = h[1] & 0x7F;
+        size_t head = 2;
+        if (len == 126)
+            head = 4;
+        else if (len == 127)
+            head = 10;
+        if (avail < head + 4)
+            break;
+        if (len == 126)
+            len = ((unsigned long long)h[2] << 8) | h[3];
+        else if (len == 127)
+        {
+            len = 0;
+            for (int i = 0; i < 8; ++i)
+                len = (len << 8) | h[2 + i];
+        }
+
+        // clients must mask, nothing here negotiates extensions (RSV bits)
+        if ((h[0] & 0x70) || !(h[1] & 0x80) || (opcode >= 8 && (!fin || len > 125)))
+        {
+            reply += closeFrame(1002);
+            return false;
+        }
+        if (len > MAX_MESSAGE || _message.size() + len > MAX_MESSAGE)
+        {
+            reply += closeFrame(1009);
+            return false;
+        }
+        if (avail < head + 4 + len)
+            break;
+
+        unsigned char key[4];
+        std::memcpy(key, h + head, 4);
+        char *payload = &_raw[off + head + 4];
+        Scan::xorMask(payload, (size_t)len, key);
+        off += head + 4 + (size_t)len;
+
+        switch (opcode)
+        {
+        case 0x0: // continuation
+        case 0x1: // text
+        case 0x2: // binary
+            if ((opcode == 0) != ((_state & FRAGMENTED) != 0))
+            {
+                reply += closeFrame(1002);
+                return false;
+            }
+            _message.append(payload, (size_t)len);
+            if (!fin)
+            {
+                _state |= FRAGMENTED;
+                break;
+            }
+            _state &= ~FRAGMENTED;
+            text += _message;
+            if (_message.empty() || _message[_message.size() - 1] != '\n')
+                text += "\r\n";
+            _message.clear();
+            break;
+        case 0x8: // close, echo the status code back
+            reply += closeFrame(len >= 2 ? (unsigned short)(((unsigned char)payload[0] << 8) | (unsigned char)payload[1])
+                                         : 1000);
+            ok = false;
+            break;
+        case 0x9: // ping
+            putHeader(reply, 0xA, (size_t)len);
+            reply.append(payload, (size_t)len);
+            break;
+        case 0xA: // pong
+            break;
+        default:
+            reply += closeFrame(1002);
+            return false;
+        }
+    }
+    _raw.erase(0, off);
+    return ok;
+}
+
+bool WebSocket::receive(const char *p, size_t n, std::string &text, std::string &reply)
+{
+    _raw.append(p, n);
+    if (!(_state & OPEN))
+    {
+        if (!handshake(reply))
+            return false;
+        if (!(_state & OPEN))
+            return true; // headers not complete yet
+    }
+    return decode(text, reply);
+}
+
+void WebSocket::frame(const char *p, size_t n, Buffer &out) const
+{
+    unsigned char opcode = (_state & BINARY) ? 0x2 : 0x1;
+    size_t start = 0;
+    while (start < n)
+    {
+        size_t eol = start + Scan::findNewline(p + start, n - start);
+        size_t end = eol;
+        if (end > start && p[end - 1] == '\r')
+            --end;
+        if (end > start)
+        {
+            std::string head;
+            putHeader(head, opcode, end - start);
+            out.append(head.data(), head.size());
+            out.append(p + start, end - start);
+        }
+        start = eol + 1;
+    }
+}
+
+void WebSocket::restore(unsigned int state, const std::string &unread, const std::string &partial)
+{
+    _state = state;
+    _raw = unread;
+    _message = partial;
+}
+
+size_t WebSocket::footprint() const
+{
+    return sizeof(*this) + Accounting::heapBytes(_raw) + Accounting::heapBytes(_message);
+}
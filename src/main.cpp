@@ -5,18 +5,22 @@ Server* g_server = NULL;
 
 void handleSignal(int sig)
 {
+    // only a flag: the worker threads make freeing from here unsafe
     if (g_server)
-    {
-        std::cout << "\nSignal " << sig << " caught, shutting down..." << std::endl;
-        g_server->stop();
-    }
+        g_server->requestStop(sig);
+}
+
+void handleUpgradeSignal(int)
+{
+    if (g_server)
+        g_server->requestUpgrade();
 }
 
 int main(int argc, char **argv)
 {
-    if (argc != 3)
+    if (argc != 3 && argc != 4)
     {
-        std::cerr << "Usage: ./ircserv <port> <password>\n";
+        std::cerr << "Usage: ./ircserv <port> <password> [config]\n";
         return 1;
     }
 
@@ -31,12 +35,17 @@ int main(int argc, char **argv)
 
     try
     {
-        Server s(port, password);
+        Config config;
+        if (argc == 4)
+            config.load(argv[3]);
+        Server s(port, password, config);
         g_server = &s;
+        s.setUpgradeCommand(argv);
 
         signal(SIGINT, handleSignal);   // Ctrl + C
         signal(SIGQUIT, handleSignal);  
         signal(SIGTERM, handleSignal);  // graceful kill
+        signal(SIGUSR2, handleUpgradeSignal); // exec the new binary and hand over
 
         s.run(); // blocking loop
     }
@@ -0,0 +1,73 @@
+// Sample plugin, loaded by "make plugintest" (tools/plugintest.cpp).
+//
+// Answers with NOTICEs so a client can see which hooks ran and in what
+// order: PING and "*" get star-before/star-after from the wildcard hooks
+// around ping-before/ping-after from the PING ones, and a PRIVMSG
+// containing "drop-me" is dropped with a "dropped" NOTICE to its sender.
+
+#include "ircserv_plugin.h"
+#include <string>
+
+static const ircserv_host *host;
+
+static void notice(const ircserv_msg *msg, const std::string &text)
+{
+    std::string line = ":plugin NOTICE " + std::string(msg->nick, msg->nick_len) + " :" + text + "\r\n";
+    host->send_fd(host->server, msg->fd, line.data(), line.size());
+}
+
+static bool traced(const ircserv_msg *msg)
+{
+    std::string cmd(msg->cmd, msg->cmd_len);
+    return cmd == "PING" || cmd == "*";
+}
+
+static int starBefore(void *, const ircserv_msg *msg)
+{
+    if (traced(msg))
+        notice(msg, "star-before " + std::string(msg->cmd, msg->cmd_len));
+    return IRCSERV_CONTINUE;
+}
+
+static int pingBefore(void *, const ircserv_msg *msg)
+{
+    notice(msg, "ping-before");
+    return IRCSERV_CONTINUE;
+}
+
+static int pingAfter(void *, const ircserv_msg *msg)
+{
+    notice(msg, "ping-after");
+    return IRCSERV_CONTINUE;
+}
+
+static int starAfter(void *, const ircserv_msg *msg)
+{
+    if (traced(msg))
+        notice(msg, "star-after " + std::string(msg->cmd, msg->cmd_len));
+    return IRCSERV_CONTINUE;
+}
+
+static int privmsgBefore(void *, const ircserv_msg *msg)
+{
+    if (std::string(msg->args, msg->args_len).find("drop-me") == std::string::npos)
+        return IRCSERV_CONTINUE;
+    notice(msg, "dropped");
+    return IRCSERV_DROP;
+}
+
+extern "C" int ircserv_plugin_init(const ircserv_host *h)
+{
+    if (h->abi != IRCSERV_PLUGIN_ABI)
+        return 1;
+    host = h;
+    // registration order is run order, wildcard and named hooks interleaved
+    if (h->add_hook(h->server, "*", IRCSERV_BEFORE, starBefore, NULL)
+        || h->add_hook(h->server, "PING", IRCSERV_BEFORE, pingBefore, NULL)
+        || h->add_hook(h->server, "PING", IRCSERV_AFTER, pingAfter, NULL)
+        || h->add_hook(h->server, "*", IRCSERV_AFTER, starAfter, NULL)
+        || h->add_hook(h->server, "PRIVMSG", IRCSERV_BEFORE, privmsgBefore, NULL))
+        return 1;
+    h->log(h->server, "hookplugin: loaded");
+    return 0;
+}
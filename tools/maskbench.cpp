@@ -0,0 +1,196 @@
+// Ban list matching cost: MaskMatcher against one maskMatch() per mask.
+//
+//   maskbench [-m masks] [-s subjects] [-r rounds] [-x seed]
+//
+// Builds a ban list shaped like real ones (literal masks, *!*@host,
+// *!*@*.domain, nick!*@*, a few '?' masks), then checks every subject
+// against it both ways. The two must agree on every subject or the run
+// fails; about a tenth of the subjects are built to hit a mask. Times are
+// nanoseconds per subject checked against the whole list.
+
+#include "Mask.hpp"
+#include <time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static long long nowNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static std::string word(size_t len)
+{
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    std::string s;
+    for (size_t i = 0; i < len; ++i)
+        s += chars[std::rand() % (sizeof(chars) - 1)];
+    return s;
+}
+
+static std::string host()
+{
+    static const char *tlds[] = {"net", "com", "org", "io", "lan"};
+    return word(3 + std::rand() % 6) + "." + word(4 + std::rand() % 6) + "." + tlds[std::rand() % 5];
+}
+
+static std::string mask()
+{
+    switch (std::rand() % 6)
+    {
+    case 0: // exact
+        return word(5) + "!" + word(5) + "@" + host();
+    case 1:
+    case 2:
+        return "*!*@" + host();
+    case 3:
+    {
+        std::string h = host();
+        return "*!*@*" + h.substr(h.find('.'));
+    }
+    case 4:
+        return word(6) + "!*@*";
+    default:
+    {
+        std::string m = "*!" + word(4) + "@" + host();
+        m[2 + std::rand() % 4] = '?';
+        return m;
+    }
+    }
+}
+
+// a subject the mask accepts: wildcards filled in with fresh text
+static std::string hitting(const std::string &m)
+{
+    std::string s;
+    for (size_t i = 0; i < m.size(); ++i)
+    {
+        if (m[i] == '*')
+            s += word(std::rand() % 6);
+        else if (m[i] == '?')
+            s += word(1);
+        else
+            s += m[i];
+    }
+    return s;
+}
+
+static void usage()
+{
+    std::cerr << "usage: maskbench [-m masks] [-s subjects] [-r rounds] [-x seed]\n";
+    std::exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    size_t nmasks = 1000, nsubjects = 1000, rounds = 5;
+    unsigned int seed = 1;
+    for (int i = 1; i < argc; i += 2)
+    {
+        if (i + 1 >= argc)
+            usage();
+        if (std::strcmp(argv[i], "-m") == 0)
+            nmasks = (size_t)std::atol(argv[i + 1]);
+        else if (std::strcmp(argv[i], "-s") == 0)
+            nsubjects = (size_t)std::atol(argv[i + 1]);
+        else if (std::strcmp(argv[i], "-r") == 0)
+            rounds = (size_t)std::atol(argv[i + 1]);
+        else if (std::strcmp(argv[i], "-x") == 0)
+            seed = (unsigned int)std::atol(argv[i + 1]);
+        else
+            usage();
+    }
+    if (!nsubjects || !rounds)
+        usage();
+    std::srand(seed);
+
+    std::vector<std::string> masks;
+    for (size_t i = 0; i < nmasks; ++i)
+        masks.push_back(mask());
+    std::vector<std::string> subjects;
+    for (size_t i = 0; i < nsubjects; ++i)
+    {
+        if (nmasks && std::rand() % 10 == 0)
+            subjects.push_back(hitting(masks[std::rand() % nmasks]));
+        else
+            subjects.push_back(word(5) + "!" + word(5) + "@" + host());
+    }
+
+    // fixed cases, with wildcard characters on the subject side too
+    static const struct { const char *mask; const char *subject; bool match; } edges[] = {
+        {"*a", "*ba", true},
+        {"*a", "*", false},
+        {"*", "*", true},
+        {"a*", "a*b", true},
+        {"?*b", "**b", true},
+        {"*!*@*", "n!u@h", true},
+        {"*!*@h", "n!u@x", false},
+        {"a?c", "A?C", true},
+    };
+    for (size_t i = 0; i < sizeof(edges) / sizeof(edges[0]); ++i)
+    {
+        MaskMatcher one;
+        one.build(std::vector<std::string>(1, edges[i].mask));
+        bool linear = maskMatch(edges[i].mask, edges[i].subject);
+        bool compiled = one.matches(edges[i].subject);
+        if (linear != edges[i].match || compiled != edges[i].match)
+        {
+            std::cerr << "mismatch: " << edges[i].mask << " vs " << edges[i].subject << " linear=" << linear
+                      << " compiled=" << compiled << " want=" << edges[i].match << "\n";
+            return 1;
+        }
+    }
+
+    long long t0 = nowNs();
+    MaskMatcher matcher;
+    matcher.build(masks);
+    long long buildNs = nowNs() - t0;
+
+    // agreement first, the timings mean nothing otherwise
+    size_t hits = 0;
+    for (size_t i = 0; i < subjects.size(); ++i)
+    {
+        bool linear = false;
+        for (size_t j = 0; j < masks.size() && !linear; ++j)
+            linear = maskMatch(masks[j], subjects[i]);
+        if (matcher.matches(subjects[i]) != linear)
+        {
+            std::cerr << "mismatch: " << subjects[i] << " linear=" << linear << "\n";
+            return 1;
+        }
+        hits += linear;
+    }
+
+    size_t sink = 0;
+    t0 = nowNs();
+    for (size_t r = 0; r < rounds; ++r)
+        for (size_t i = 0; i < subjects.size(); ++i)
+            sink += matcher.matches(subjects[i]);
+    long long compiledNs = nowNs() - t0;
+
+    // the per-mask glob stops at the first hit, as a ban check would
+    t0 = nowNs();
+    for (size_t r = 0; r < rounds; ++r)
+        for (size_t i = 0; i < subjects.size(); ++i)
+            for (size_t j = 0; j < masks.size(); ++j)
+                if (maskMatch(masks[j], subjects[i]))
+                {
+                    ++sink;
+                    break;
+                }
+    long long linearNs = nowNs() - t0;
+
+    double checks = (double)rounds * (double)subjects.size();
+    std::printf("masks %lu subjects %lu hits %lu\n", (unsigned long)masks.size(), (unsigned long)subjects.size(),
+                (unsigned long)hits);
+    std::printf("build_us %.1f\n", buildNs / 1000.0);
+    std::printf("compiled_ns_per_check %.1f\n", compiledNs / checks);
+    std::printf("glob_ns_per_check %.1f\n", linearNs / checks);
+    std::printf("speedup %.1fx\n", compiledNs ? (double)linearNs / (double)compiledNs : 0.0);
+    return sink == 2 * hits * rounds ? 0 : 1;
+}
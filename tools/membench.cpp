@@ -0,0 +1,209 @@
+// Runs the server on a MemoryTransport, so the numbers leave the kernel out:
+// no sockets, no syscalls per message, only parsing, routing and queueing.
+//
+//   membench [-c clients] [-m messages] [-t fanout_threads] [-w window] [-n 1] [-i 1 [-b bytes]]
+//
+// Every client registers and joins #bench, then client 0 sends the messages
+// to the channel and the run ends once every copy has been delivered.
+// -w limits how many unread bytes each client holds, like a socket buffer:
+// the server then has to queue and wait for POLLOUT. The summary goes to
+// stderr as "key value" lines; the server's own chatter goes to stdout.
+// join_bytes counts what the JOINs alone sent out; -n 1 has every client
+// request draft/no-implicit-names first, so two runs show what it saves.
+//
+// -i 1 measures idle clients instead: they register (no JOIN) in batches,
+// like connections trickling in, and the RSS growth per client is reported.
+// It includes the in-memory transport's own bookkeeping per connection.
+// The run fails (exit 1) above -b bytes per client, 1024 by default; use
+// enough clients (100k) that the fixed costs no longer count.
+
+#include "Server.hpp"
+#include <sys/time.h>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+static long long nowUsec()
+{
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static long rssBytes()
+{
+    std::ifstream in("/proc/self/statm");
+    long size = 0, resident = 0;
+    in >> size >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void usage()
+{
+    std::cerr << "usage: membench [-c clients] [-m messages] [-t fanout_threads] [-w window] [-n 1] [-i 1 [-b bytes]]\n";
+    std::exit(2);
+}
+
+// Steps the server until it has read everything and stopped writing,
+// draining what the clients received as it goes.
+static void settle(Server &server, MemoryTransport &io, const std::vector<int> &fds,
+                   unsigned long long &bytes, unsigned long long &lines)
+{
+    int quiet = 0;
+    while (quiet < 3)
+    {
+        server.step(0);
+        bool wrote = false;
+        for (size_t i = 0; i < fds.size(); ++i)
+        {
+            if (io.outputSize(fds[i]) == 0)
+                continue;
+            std::string out = io.take(fds[i]);
+            bytes += out.size();
+            for (size_t k = 0; k < out.size(); ++k)
+                lines += out[k] == '\n';
+            wrote = true;
+        }
+        quiet = (wrote || io.unread() > 0) ? 0 : quiet + 1;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    long clients = 100, messages = 10000, threads = 0, window = 0, idle = 0, budget = 1024, noNames = 0;
+    for (int i = 1; i < argc; i += 2)
+    {
+        if (i + 1 >= argc || argv[i][0] != '-')
+            usage();
+        long v = std::atol(argv[i + 1]);
+        if (std::strcmp(argv[i], "-c") == 0)
+            clients = v;
+        else if (std::strcmp(argv[i], "-m") == 0)
+            messages = v;
+        else if (std::strcmp(argv[i], "-t") == 0)
+            threads = v;
+        else if (std::strcmp(argv[i], "-w") == 0)
+            window = v;
+        else if (std::strcmp(argv[i], "-i") == 0)
+            idle = v;
+        else if (std::strcmp(argv[i], "-b") == 0)
+            budget = v;
+        else if (std::strcmp(argv[i], "-n") == 0)
+            noNames = v;
+        else
+            usage();
+    }
+    if (clients < 1 || messages < 0 || threads < 0 || window < 0 || budget < 1)
+        usage();
+
+    Config config;
+    config.set("snapshot_file", "");
+    config.set("snapshot_interval", "0");
+    config.set("history_dir", "");
+    std::ostringstream t;
+    t << threads;
+    config.set("fanout_threads", t.str());
+
+    MemoryTransport io;
+    Server server(0, "bench", config, &io);
+    server.start();
+
+    std::vector<int> fds;
+    unsigned long long bytes = 0, lines = 0;
+    if (idle)
+    {
+        fds.reserve((size_t)clients);
+        settle(server, io, fds, bytes, lines);
+        long before = rssBytes();
+        std::vector<int> batch;
+        for (long i = 0; i < clients; ++i)
+        {
+            int fd = io.connect();
+            fds.push_back(fd);
+            batch.push_back(fd);
+            std::ostringstream reg;
+            reg << "PASS bench\r\nNICK b" << i << "\r\nUSER b" << i << " 0 * :bench\r\n";
+            io.inject(fd, reg.str());
+            if (batch.size() == 1000 || i + 1 == clients)
+            {
+                settle(server, io, batch, bytes, lines);
+                batch.clear();
+            }
+        }
+#ifdef __GLIBC__
+        malloc_trim(0); // count what is held, not what malloc kept from the bursts
+#endif
+        long grown = rssBytes() - before;
+        std::cerr << "clients " << clients << "\n"
+                  << "rss_growth " << grown << "\n"
+                  << "rss_per_client " << grown / clients << "\n"
+                  << "client_object " << sizeof(Client) << "\n"
+                  << "budget_per_client " << budget << (grown / clients > budget ? " EXCEEDED" : " ok") << "\n";
+        server.stop();
+        return grown / clients > budget ? 1 : 0;
+    }
+    long long t0 = nowUsec();
+    for (long i = 0; i < clients; ++i)
+    {
+        int fd = io.connect();
+        fds.push_back(fd);
+        std::ostringstream reg;
+        reg << "PASS bench\r\n";
+        if (noNames)
+            reg << "CAP REQ :draft/no-implicit-names\r\nCAP END\r\n";
+        reg << "NICK b" << i << "\r\nUSER b" << i << " 0 * :bench\r\n";
+        io.inject(fd, reg.str());
+    }
+    settle(server, io, fds, bytes, lines);
+    unsigned long long regBytes = bytes;
+    for (long i = 0; i < clients; ++i)
+    {
+        io.inject(fds[i], "JOIN #bench\r\n");
+        if (window)
+            io.setWindow(fds[i], (size_t)window);
+    }
+    settle(server, io, fds, bytes, lines);
+    long long t1 = nowUsec();
+
+    unsigned long long setupBytes = bytes;
+    bytes = lines = 0;
+    std::string burst;
+    for (long i = 0; i < messages; ++i)
+    {
+        std::ostringstream msg;
+        msg << "PRIVMSG #bench :message " << i << " with some padding to look like chat\r\n";
+        burst += msg.str();
+        if (burst.size() >= 65536 || i + 1 == messages)
+        {
+            io.inject(fds[0], burst);
+            burst.clear();
+            server.step(0); // keep the input side from piling up all at once
+        }
+    }
+    settle(server, io, fds, bytes, lines);
+    long long t2 = nowUsec();
+
+    double setupSecs = (double)(t1 - t0) / 1e6;
+    double secs = (double)(t2 - t1) / 1e6;
+    unsigned long long expected = (unsigned long long)messages * (unsigned long long)(clients - 1);
+    std::cerr << "clients " << clients << "\n"
+              << "messages " << messages << "\n"
+              << "fanout_threads " << threads << "\n"
+              << "window " << window << "\n"
+              << "setup_secs " << setupSecs << "\n"
+              << "setup_bytes " << setupBytes << "\n"
+              << "join_bytes " << setupBytes - regBytes << "\n"
+              << "join_bytes_per_join " << (setupBytes - regBytes) / (unsigned long long)clients << "\n"
+              << "no_implicit_names " << (noNames ? 1 : 0) << "\n"
+              << "deliveries " << lines << "\n"
+              << "deliveries_expected " << expected << "\n"
+              << "bench_secs " << secs << "\n"
+              << "messages_per_sec " << (secs > 0 ? (double)messages / secs : 0) << "\n"
+              << "deliveries_per_sec " << (secs > 0 ? (double)lines / secs : 0) << "\n"
+              << "bytes_per_sec " << (secs > 0 ? (double)bytes / secs : 0) << "\n";
+    server.stop();
+    return lines == expected ? 0 : 1;
+}
@@ -0,0 +1,339 @@
+// Round trip latency of PING/PONG, one request in flight at a time.
+//
+//   pingpong [-n count] [-p password] [-s] <host> <port|ws:port|unix:path> [...]
+//
+// Every port is measured in turn with the same client, so running one server
+// with "busy_poll 1" and one without, on two ports, compares the modes side
+// by side. -s makes this client spin on recv too, which keeps its own wakeups
+// out of the numbers. Times are microseconds.
+//
+// A port written ws:<port> is spoken to as a WebSocket (masked frames, one
+// line each), so a "listen ws:" endpoint and a proxy in front of the plain
+// port (tools/wsproxy.cpp, websockify and friends) can be compared on one
+// command line. One written unix:<path> connects to a "listen unix:" socket,
+// so loopback TCP and a unix socket compare the same way.
+//
+// After the round trips, each endpoint gets the same count of PINGs
+// pipelined, 256 in flight, for throughput in lines per second.
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static long long nowNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int dialUnix(const std::string &path)
+{
+    sockaddr_un sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(sa.sun_path))
+        return -1;
+    std::memcpy(sa.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (sockaddr *)&sa, sizeof(sa)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if (fd >= 0)
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+static int dial(const std::string &host, const std::string &port)
+{
+    if (port.compare(0, 5, "unix:") == 0)
+        return dialUnix(port.substr(5));
+    addrinfo hints, *res = NULL;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res)
+        return -1;
+    int fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0)
+    {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+    }
+    return fd;
+}
+
+struct Session
+{
+    int fd;
+    bool ws;
+    std::string raw;                   // WebSocket bytes not decoded yet
+    std::string in;                    // IRC text received
+};
+
+static std::string frame(const std::string &line)
+{
+    std::string out;
+    out += (char)0x81;
+    if (line.size() < 126)
+        out += (char)(0x80 | line.size());
+    else
+    {
+        out += (char)(0x80 | 126);
+        out += (char)(line.size() >> 8);
+        out += (char)(line.size() & 0xFF);
+    }
+    unsigned char key[4] = {0x12, 0x34, 0x56, 0x78};
+    out.append((const char *)key, 4);
+    for (size_t i = 0; i < line.size(); ++i)
+        out += (char)(line[i] ^ key[i & 3]);
+    return out;
+}
+
+// server frames are never masked; every message becomes a CRLF line
+static void unframe(Session &s)
+{
+    while (s.raw.size() >= 2)
+    {
+        size_t len = (unsigned char)s.raw[1] & 0x7F, head = 2;
+        if (len == 126)
+        {
+            if (s.raw.size() < 4)
+                return;
+            len = ((size_t)(unsigned char)s.raw[2] << 8) | (unsigned char)s.raw[3];
+            head = 4;
+        }
+        else if (len == 127)
+            return; // no reply here comes near 64 KiB
+        if (s.raw.size() < head + len)
+            return;
+        s.in.append(s.raw, head, len);
+        s.in += "\r\n";
+        s.raw.erase(0, head + len);
+    }
+}
+
+static bool sendAll(int fd, const std::string &s)
+{
+    size_t off = 0;
+    while (off < s.size())
+    {
+        ssize_t n = send(fd, s.data() + off, s.size() - off, MSG_NOSIGNAL);
+        if (n > 0)
+            off += (size_t)n;
+        else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return false;
+    }
+    return true;
+}
+
+static bool sendLines(Session &s, const std::string &lines)
+{
+    if (!s.ws)
+        return sendAll(s.fd, lines);
+    std::string out;
+    size_t start = 0;
+    while (start < lines.size())
+    {
+        size_t eol = lines.find("\r\n", start);
+        out += frame(lines.substr(start, eol - start));
+        start = eol + 2;
+    }
+    return sendAll(s.fd, out);
+}
+
+// reads until `want` shows up in the stream, keeps what follows it
+static bool waitFor(Session &s, const std::string &want, bool spin)
+{
+    long long deadline = nowNs() + 5000000000LL;
+    int fd = s.fd;
+    std::string &in = s.ws ? s.raw : s.in;
+    while (true)
+    {
+        if (s.ws)
+            unframe(s);
+        size_t pos = s.in.find(want);
+        if (pos != std::string::npos)
+        {
+            s.in.erase(0, pos + want.size());
+            return true;
+        }
+        if (nowNs() > deadline)
+            return false;
+        if (!spin)
+        {
+            pollfd p;
+            p.fd = fd;
+            p.events = POLLIN;
+            p.revents = 0;
+            poll(&p, 1, 100);
+        }
+        char buf[4096];
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n > 0)
+            in.append(buf, (size_t)n);
+        else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            return false;
+    }
+}
+
+static double at(const std::vector<long long> &v, double p)
+{
+    return v.empty() ? 0 : (double)v[(size_t)(p * (double)(v.size() - 1))] / 1000.0;
+}
+
+// `count` PINGs in windows of PIPELINE, each window written at once
+static double throughput(Session &s, long count, bool spin)
+{
+    static const long PIPELINE = 256;
+    long long t0 = nowNs();
+    for (long done = 0; done < count;)
+    {
+        long n = std::min(PIPELINE, count - done);
+        std::string batch;
+        for (long j = 0; j < n; ++j)
+        {
+            std::ostringstream tok;
+            tok << "PING :b" << done + j << "\r\n";
+            batch += tok.str();
+        }
+        std::ostringstream last;
+        last << "PONG :b" << done + n - 1 << "\r\n";
+        if (!sendLines(s, batch) || !waitFor(s, last.str(), spin))
+            return -1;
+        done += n;
+    }
+    return (double)count * 1e9 / (double)(nowNs() - t0);
+}
+
+static bool measure(const std::string &host, const std::string &spec, const std::string &pass, long count, bool spin)
+{
+    Session s;
+    s.ws = spec.compare(0, 3, "ws:") == 0;
+    std::string port = s.ws ? spec.substr(3) : spec;
+    int fd = dial(host, port);
+    s.fd = fd;
+    if (fd < 0)
+    {
+        std::cerr << "pingpong: cannot connect to " << host << ":" << port << "\n";
+        return false;
+    }
+    if (s.ws)
+    {
+        // any key will do, this client does not check the accept value
+        if (!sendAll(fd, "GET / HTTP/1.1\r\nHost: " + host + "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                         "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n"
+                         "Sec-WebSocket-Protocol: text.ircv3.net\r\n\r\n"))
+            s.fd = -1;
+        Session http = s;
+        http.ws = false;
+        if (s.fd < 0 || !waitFor(http, " 101 ", spin) || !waitFor(http, "\r\n\r\n", spin))
+        {
+            std::cerr << "pingpong: no WebSocket upgrade on port " << port << "\n";
+            close(fd);
+            return false;
+        }
+        s.raw = http.in;
+    }
+    static int seq;
+    std::ostringstream nick;
+    nick << "pp" << getpid() << "_" << seq++;
+    if (!sendLines(s, "PASS " + pass + "\r\nNICK " + nick.str() + "\r\nUSER pp 0 * :pingpong\r\n")
+        || !waitFor(s, ":Your host is", spin))
+    {
+        std::cerr << "pingpong: registration failed on port " << port << "\n";
+        close(fd);
+        return false;
+    }
+
+    std::vector<long long> rtt;
+    rtt.reserve((size_t)count);
+    long warmup = count / 10 + 1;
+    for (long i = 0; i < warmup + count; ++i)
+    {
+        std::ostringstream tok;
+        tok << "t" << i;
+        long long t0 = nowNs();
+        if (!sendLines(s, "PING :" + tok.str() + "\r\n") || !waitFor(s, "PONG :" + tok.str() + "\r\n", spin))
+        {
+            std::cerr << "pingpong: lost the connection on port " << port << "\n";
+            close(fd);
+            return false;
+        }
+        if (i >= warmup)
+            rtt.push_back(nowNs() - t0);
+    }
+    double rate = throughput(s, count, spin);
+    close(fd);
+    if (rate < 0)
+    {
+        std::cerr << "pingpong: lost the connection on port " << port << "\n";
+        return false;
+    }
+
+    std::sort(rtt.begin(), rtt.end());
+    double sum = 0;
+    for (size_t i = 0; i < rtt.size(); ++i)
+        sum += (double)rtt[i] / 1000.0;
+    std::printf("port %-9s n=%ld min=%.1f p50=%.1f p90=%.1f p99=%.1f max=%.1f avg=%.1f lines/s=%.0f\n", spec.c_str(),
+                count, at(rtt, 0), at(rtt, 0.5), at(rtt, 0.9), at(rtt, 0.99), at(rtt, 1.0), sum / (double)rtt.size(),
+                rate);
+    return true;
+}
+
+static void usage()
+{
+    std::cerr << "usage: pingpong [-n count] [-p password] [-s] <host> <port|ws:port|unix:path> [...]\n";
+    std::exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    long count = 10000;
+    std::string pass = "pw";
+    bool spin = false;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i)
+    {
+        if (std::strcmp(argv[i], "-s") == 0)
+            spin = true;
+        else if (std::strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            count = std::atol(argv[++i]);
+        else if (std::strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            pass = argv[++i];
+        else
+            usage();
+    }
+    if (argc - i < 2 || count < 1)
+        usage();
+    std::string host = argv[i];
+    bool ok = true;
+    for (++i; i < argc; ++i)
+        ok = measure(host, argv[i], pass, count, spin) && ok;
+    return ok ? 0 : 1;
+}
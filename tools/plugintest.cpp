@@ -0,0 +1,213 @@
+// Plugin hooks end to end: starts its own ircserv with the sample plugin
+// (tools/hookplugin.cpp) and checks what a client sees.
+//
+//   plugintest [-p port] <ircserv> <plugin.so>
+//
+// Fails unless a PING runs the hooks in registration order around the
+// handler (star-before, ping-before, PONG, ping-after, star-after), a
+// command sent literally as "*" runs each wildcard hook once, and a
+// PRIVMSG the plugin drops never reaches its target while the next one
+// does.
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static int dial(int port)
+{
+    sockaddr_in sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (sockaddr *)&sa, sizeof(sa)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+static void sendLine(int fd, const std::string &line)
+{
+    std::string s = line + "\r\n";
+    send(fd, s.data(), s.size(), MSG_NOSIGNAL);
+}
+
+// collects lines until one contains `until`, then `graceMs` more for extras
+static std::vector<std::string> readUntil(int fd, const std::string &until, int graceMs)
+{
+    std::string in;
+    std::vector<std::string> lines;
+    bool seen = false;
+    for (int i = 0; i < 200 && !(seen && graceMs <= 0); ++i)
+    {
+        pollfd p;
+        p.fd = fd;
+        p.events = POLLIN;
+        p.revents = 0;
+        poll(&p, 1, 10);
+        if (seen)
+            graceMs -= 10;
+        char buf[4096];
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n == 0)
+            break;
+        if (n < 0)
+            continue;
+        in.append(buf, (size_t)n);
+        size_t eol;
+        while ((eol = in.find("\r\n")) != std::string::npos)
+        {
+            lines.push_back(in.substr(0, eol));
+            in.erase(0, eol + 2);
+            if (lines.back().find(until) != std::string::npos)
+                seen = true;
+        }
+    }
+    return lines;
+}
+
+// the plugin's NOTICE texts and the PONGs, in arrival order
+static std::string trace(const std::vector<std::string> &lines)
+{
+    std::string t;
+    for (size_t i = 0; i < lines.size(); ++i)
+    {
+        const std::string &l = lines[i];
+        std::string item;
+        if (l.compare(0, 15, ":plugin NOTICE ") == 0 && l.find(" :") != std::string::npos)
+            item = l.substr(l.find(" :") + 2);
+        else if (l.compare(0, 5, "PONG ") == 0 || l.find(" PONG ") != std::string::npos)
+            item = "PONG";
+        else
+            continue;
+        t += (t.empty() ? "" : ", ") + item;
+    }
+    return t;
+}
+
+static int login(int port, const std::string &nick)
+{
+    int fd = dial(port);
+    if (fd < 0)
+        return -1;
+    sendLine(fd, "PASS plugpw");
+    sendLine(fd, "NICK " + nick);
+    sendLine(fd, "USER " + nick + " 0 * :plugintest");
+    readUntil(fd, " 001 ", 0);
+    return fd;
+}
+
+static bool check(const char *what, const std::string &got, const std::string &want)
+{
+    bool ok = got == want;
+    std::printf("%-10s %s\n", what, ok ? "ok" : "FAIL");
+    if (!ok)
+        std::printf("  want: %s\n  got:  %s\n", want.c_str(), got.c_str());
+    return ok;
+}
+
+static void usage()
+{
+    std::cerr << "usage: plugintest [-p port] <ircserv> <plugin.so>\n";
+    std::exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    long port = 6692;
+    int i = 1;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2)
+    {
+        if (std::strcmp(argv[i], "-p") == 0)
+            port = std::atol(argv[i + 1]);
+        else
+            usage();
+    }
+    if (argc - i != 2)
+        usage();
+
+    std::ostringstream cfgPath, logPath, portStr;
+    cfgPath << "/tmp/plugintest." << getpid() << ".conf";
+    logPath << "/tmp/plugintest." << getpid() << ".log";
+    portStr << port;
+    {
+        std::ofstream cfg(cfgPath.str().c_str());
+        cfg << "snapshot_file\nhistory_dir\nplugin " << argv[i + 1] << "\n";
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int log = open(logPath.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        dup2(log, 1);
+        dup2(log, 2);
+        close(log);
+        execl(argv[i], argv[i], portStr.str().c_str(), "plugpw", cfgPath.str().c_str(), (char *)NULL);
+        _exit(127);
+    }
+    int probe = -1;
+    for (int t = 0; t < 100 && probe < 0; ++t)
+    {
+        usleep(50000);
+        probe = dial((int)port);
+    }
+    bool ok = probe >= 0;
+    if (!ok)
+        std::cerr << "plugintest: server did not come up on port " << port << "\n";
+    else
+    {
+        close(probe);
+        int a = login((int)port, "plugsend");
+        int b = login((int)port, "plugrecv");
+        ok = a >= 0 && b >= 0;
+
+        sendLine(a, "PING :order");
+        ok = check("order", trace(readUntil(a, "star-after PING", 0)),
+                   "star-before PING, ping-before, PONG, ping-after, star-after PING") && ok;
+
+        // "*" is both the command and the wildcard: each hook must still run once
+        sendLine(a, "*");
+        ok = check("wildcard", trace(readUntil(a, "star-after *", 200)), "star-before *, star-after *") && ok;
+
+        sendLine(a, "PRIVMSG plugrecv :drop-me");
+        sendLine(a, "PRIVMSG plugrecv :keep-me");
+        ok = check("drop", trace(readUntil(a, "dropped", 100)), "dropped") && ok;
+        std::vector<std::string> got = readUntil(b, "keep-me", 100);
+        std::string delivered;
+        for (size_t l = 0; l < got.size(); ++l)
+            if (got[l].find(" PRIVMSG plugrecv :") != std::string::npos)
+                delivered += (delivered.empty() ? "" : ", ") + got[l].substr(got[l].find(" :") + 2);
+        ok = check("delivered", delivered, "keep-me") && ok;
+        close(a);
+        close(b);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(cfgPath.str().c_str());
+    if (ok)
+        unlink(logPath.str().c_str());
+    else
+        std::cerr << "plugintest: server log kept in " << logPath.str() << "\n";
+    std::printf("%s\n", ok ? "plugintest: pass" : "plugintest: FAIL");
+    return ok ? 0 : 1;
+}
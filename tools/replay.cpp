@@ -0,0 +1,338 @@
+// Drives an ircserv capture file (capture_file config key) against a server.
+//
+//   replay [-s speed] [-r report] [-b baseline] <capture> <host> <port>
+//
+// -s 1 keeps the recorded pacing, -s 10 plays ten times faster, -s 0 sends
+// everything as fast as the server takes it. The summary is printed as
+// "key value" lines; -r also writes it to a file and -b compares it with a
+// report from an earlier run. Latency is first-response latency: the time
+// from a chunk leaving the socket to the next bytes the server sends back
+// on that connection.
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct Record
+{
+    unsigned char type;
+    unsigned long long conn;           // segment << 32 | conn id
+    long long usec;
+    std::string data;
+};
+
+struct Conn
+{
+    int fd;
+    std::string out;
+    std::deque<long long> waiting;     // when each sent chunk left, oldest first
+    bool closing;
+};
+
+static long long nowUsec()
+{
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static bool readCapture(const char *path, std::vector<Record> &out)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return false;
+    std::string all((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    const char *p = all.data();
+    const char *end = p + all.size();
+    unsigned long long segment = 0;
+    const size_t head = 1 + 4 + 8 + 4;
+    while (p < end)
+    {
+        if ((size_t)(end - p) >= 8 && std::memcmp(p, "IRCCAP1\n", 8) == 0)
+        {
+            ++segment; // a new process appended to the file
+            p += 8;
+            continue;
+        }
+        if ((size_t)(end - p) < head)
+            return false;
+        Record r;
+        unsigned int conn, len;
+        r.type = (unsigned char)*p;
+        std::memcpy(&conn, p + 1, 4);
+        std::memcpy(&r.usec, p + 5, 8);
+        std::memcpy(&len, p + 13, 4);
+        p += head;
+        if ((size_t)(end - p) < len)
+            return false;
+        r.data.assign(p, len);
+        p += len;
+        r.conn = segment << 32 | conn;
+        out.push_back(r);
+    }
+    return segment > 0;
+}
+
+static int dial(const std::string &host, const std::string &port)
+{
+    addrinfo hints, *res = NULL;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res)
+        return -1;
+    int fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0)
+    {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+    }
+    return fd;
+}
+
+static double percentile(std::vector<long long> &v, double p)
+{
+    if (v.empty())
+        return 0;
+    size_t i = (size_t)(p * (double)(v.size() - 1));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return (double)v[i];
+}
+
+static void usage()
+{
+    std::cerr << "usage: replay [-s speed] [-r report] [-b baseline] <capture> <host> <port>\n";
+    std::exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    double speed = 1;
+    std::string reportPath, baselinePath;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i += 2)
+    {
+        if (i + 1 >= argc)
+            usage();
+        if (std::strcmp(argv[i], "-s") == 0)
+            speed = std::atof(argv[i + 1]);
+        else if (std::strcmp(argv[i], "-r") == 0)
+            reportPath = argv[i + 1];
+        else if (std::strcmp(argv[i], "-b") == 0)
+            baselinePath = argv[i + 1];
+        else
+            usage();
+    }
+    if (argc - i != 3 || speed < 0)
+        usage();
+
+    std::vector<Record> recs;
+    if (!readCapture(argv[i], recs))
+    {
+        std::cerr << "replay: cannot read capture " << argv[i] << "\n";
+        return 1;
+    }
+    std::string host = argv[i + 1], port = argv[i + 2];
+
+    std::map<unsigned long long, Conn> conns;
+    std::vector<long long> latencies;
+    unsigned long long sent = 0, received = 0, lines = 0, failed = 0;
+    long long captureStart = recs.empty() ? 0 : recs.front().usec;
+    long long captureSpan = recs.empty() ? 0 : recs.back().usec - captureStart;
+    long long start = nowUsec();
+    long long lastInput = start;
+    long long doneAt = 0;
+    size_t next = 0;
+
+    while (true)
+    {
+        long long now = nowUsec();
+        // apply everything that is due
+        while (next < recs.size()
+               && (speed == 0 || (double)(recs[next].usec - captureStart) / speed <= (double)(now - start)))
+        {
+            const Record &r = recs[next++];
+            std::map<unsigned long long, Conn>::iterator it = conns.find(r.conn);
+            if (r.type == 3)
+            {
+                if (it != conns.end())
+                    it->second.closing = true;
+                continue;
+            }
+            if (it == conns.end() || r.type == 1)
+            {
+                if (it != conns.end())
+                    close(it->second.fd);
+                Conn c;
+                c.fd = dial(host, port);
+                c.closing = false;
+                if (c.fd < 0)
+                {
+                    ++failed;
+                    continue;
+                }
+                conns[r.conn] = c;
+                it = conns.find(r.conn);
+            }
+            it->second.out += r.data;
+            lines += (unsigned long long)std::count(r.data.begin(), r.data.end(), '\n');
+        }
+
+        std::vector<pollfd> pfds;
+        std::vector<unsigned long long> keys;
+        for (std::map<unsigned long long, Conn>::iterator it = conns.begin(); it != conns.end();)
+        {
+            Conn &c = it->second;
+            if (c.closing && c.out.empty())
+            {
+                close(c.fd);
+                conns.erase(it++);
+                continue;
+            }
+            pollfd p;
+            p.fd = c.fd;
+            p.events = (short)(POLLIN | (c.out.empty() ? 0 : POLLOUT));
+            p.revents = 0;
+            pfds.push_back(p);
+            keys.push_back(it->first);
+            ++it;
+        }
+
+        bool done = next >= recs.size();
+        bool flushed = true;
+        for (std::map<unsigned long long, Conn>::iterator it = conns.begin(); it != conns.end(); ++it)
+            flushed = flushed && it->second.out.empty();
+        // after the last record, wait for the server to go quiet
+        if (done && flushed && doneAt == 0)
+            doneAt = now;
+        if (done && flushed && (pfds.empty() || now - std::max(lastInput, doneAt) > 1000000))
+            break;
+
+        int timeout = 10;
+        if (!done && speed > 0)
+        {
+            long long due = start + (long long)((double)(recs[next].usec - captureStart) / speed);
+            long long ms = (due - now) / 1000;
+            timeout = (int)std::max(0LL, std::min(ms, 10LL));
+        }
+        else if (!done)
+            timeout = 0;
+        if (pfds.empty())
+        {
+            usleep((useconds_t)timeout * 1000);
+            continue;
+        }
+        if (poll(&pfds[0], pfds.size(), timeout) < 0 && errno != EINTR)
+            break;
+
+        now = nowUsec();
+        for (size_t k = 0; k < pfds.size(); ++k)
+        {
+            Conn &c = conns[keys[k]];
+            if (pfds[k].revents & POLLIN)
+            {
+                char buf[65536];
+                ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+                if (n > 0)
+                {
+                    received += (unsigned long long)n;
+                    lastInput = now;
+                    if (!c.waiting.empty())
+                        latencies.push_back(now - c.waiting.front());
+                    c.waiting.clear();
+                }
+                else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                {
+                    c.out.clear();
+                    c.closing = true;
+                    continue;
+                }
+            }
+            if ((pfds[k].revents & POLLOUT) && !c.out.empty())
+            {
+                ssize_t n = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+                if (n > 0)
+                {
+                    sent += (unsigned long long)n;
+                    c.out.erase(0, (size_t)n);
+                    if (c.out.empty())
+                        c.waiting.push_back(now);
+                }
+                else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    c.out.clear();
+                    c.closing = true;
+                }
+            }
+        }
+    }
+    for (std::map<unsigned long long, Conn>::iterator it = conns.begin(); it != conns.end(); ++it)
+        close(it->second.fd);
+
+    double secs = (double)(nowUsec() - start) / 1e6;
+    std::ostringstream rep;
+    rep << "records " << recs.size() << "\n"
+        << "connect_failures " << failed << "\n"
+        << "capture_secs " << (double)captureSpan / 1e6 << "\n"
+        << "replay_secs " << secs << "\n"
+        << "bytes_sent " << sent << "\n"
+        << "bytes_received " << received << "\n"
+        << "lines_per_sec " << (secs > 0 ? (double)lines / secs : 0) << "\n"
+        << "latency_samples " << latencies.size() << "\n"
+        << "latency_p50_us " << percentile(latencies, 0.50) << "\n"
+        << "latency_p90_us " << percentile(latencies, 0.90) << "\n"
+        << "latency_p99_us " << percentile(latencies, 0.99) << "\n"
+        << "latency_max_us " << percentile(latencies, 1.0) << "\n";
+    std::cout << rep.str();
+    if (!reportPath.empty())
+    {
+        std::ofstream out(reportPath.c_str());
+        out << rep.str();
+    }
+
+    if (!baselinePath.empty())
+    {
+        std::ifstream base(baselinePath.c_str());
+        std::map<std::string, double> before;
+        std::string key;
+        double v;
+        while (base >> key >> v)
+            before[key] = v;
+        std::istringstream now(rep.str());
+        std::cout << "-- against " << baselinePath << "\n";
+        while (now >> key >> v)
+        {
+            if (before.find(key) == before.end())
+                continue;
+            double b = before[key];
+            std::printf("%-18s %12.1f -> %12.1f  %+7.1f%%\n", key.c_str(), b, v, b != 0 ? (v - b) / b * 100.0 : 0.0);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,127 @@
+// Scan kernel throughput per level, in MB/s.
+//
+//   scanbench [-s seconds_per_case]
+//
+// Every kernel runs over inputs the server really sees: a 16 byte nick, a
+// 512 byte IRC line, and a 64 KiB read buffer of lines (findNewline walks it
+// line by line like Client::popNextCommand). The inputs are all valid, so
+// the validators read every byte. Levels the CPU lacks are skipped.
+
+#include "Scan.hpp"
+#include <time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+    double seconds = 0.2;
+    volatile size_t sink;
+
+    double nowSec()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    enum Kernel { NEWLINE, NICK, CHANNEL, FOLD, MASK, KERNELS };
+    const char *NAMES[KERNELS] = {"findNewline", "validNick", "validChannel", "foldCase", "xorMask"};
+
+    size_t once(Kernel k, char *p, size_t n)
+    {
+        static const unsigned char key[4] = {0x12, 0x34, 0x56, 0x78};
+        switch (k)
+        {
+        case NEWLINE:
+        {
+            size_t lines = 0;
+            for (size_t off = 0; off < n; ++lines)
+                off += Scan::findNewline(p + off, n - off) + 1;
+            return lines;
+        }
+        case NICK:
+            return Scan::validNick(p, n);
+        case CHANNEL:
+            return Scan::validChannelChars(p, n);
+        case FOLD:
+            Scan::foldCase(p, n);
+            return (unsigned char)p[0];
+        default:
+            Scan::xorMask(p, n, key);
+            return (unsigned char)p[0];
+        }
+    }
+
+    double mbPerSec(Kernel k, std::vector<char> &in)
+    {
+        size_t rounds = 0, bytes = 0;
+        double start = nowSec(), end = start;
+        while (end - start < seconds)
+        {
+            for (int i = 0; i < 64; ++i)
+                sink = sink + once(k, &in[0], in.size());
+            rounds += 64;
+            bytes = rounds * in.size();
+            end = nowSec();
+        }
+        return bytes / (end - start) / 1e6;
+    }
+
+    std::vector<char> input(size_t n, bool lines)
+    {
+        std::vector<char> v(n);
+        for (size_t i = 0; i < n; ++i)
+            v[i] = (char)('a' + i % 26);
+        if (lines)
+            for (size_t i = 79; i < n; i += 80)
+                v[i] = '\n';
+        return v;
+    }
+
+    bool cpuHas(Scan::Level l)
+    {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        __builtin_cpu_init();
+        if (l == Scan::AVX2)
+            return __builtin_cpu_supports("avx2");
+        if (l == Scan::SSE2)
+            return __builtin_cpu_supports("sse2");
+#endif
+        return l == Scan::SCALAR;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 3 && std::strcmp(argv[1], "-s") == 0)
+        seconds = std::atof(argv[2]);
+    else if (argc != 1)
+    {
+        std::fprintf(stderr, "usage: scanbench [-s seconds_per_case]\n");
+        return 2;
+    }
+    static const size_t SIZES[] = {16, 512, 65536};
+    std::printf("%-8s %-13s %10s %10s %10s\n", "level", "kernel", "16B", "512B", "64KiB");
+    for (int l = Scan::SCALAR; l <= Scan::AVX2; ++l)
+    {
+        Scan::Level level = (Scan::Level)l;
+        if (!cpuHas(level) || Scan::init(level) != level)
+        {
+            std::printf("%-8s skipped\n", Scan::levelName(level));
+            continue;
+        }
+        for (int k = 0; k < KERNELS; ++k)
+        {
+            std::printf("%-8s %-13s", Scan::levelName(level), NAMES[k]);
+            for (size_t s = 0; s < 3; ++s)
+            {
+                std::vector<char> in = input(SIZES[s], k == NEWLINE);
+                std::printf(" %10.0f", mbPerSec((Kernel)k, in));
+            }
+            std::printf("\n");
+        }
+    }
+    return 0;
+}
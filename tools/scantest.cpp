@@ -0,0 +1,235 @@
+// Checks every Scan kernel level the CPU has against a plain reference.
+//
+//   scantest
+//
+// Runs on crafted input instead of random bytes. Lengths cover 0 to past two
+// AVX2 vectors, and the input starts at every alignment in a 32-byte window.
+// The byte searched for, or the one invalid byte, sits at every position, so
+// every lane boundary and tail case is hit. High-bit bytes and near misses
+// (the target with bit 7 flipped) fill the rest. Every byte value goes
+// through the validators and the case folding. Guard bytes around the input
+// catch kernels that write out of bounds. A level the CPU supports but
+// Scan::init() refuses (its startup self-check failed) is a failure.
+// Exits non-zero on the first failure.
+
+#include "Scan.hpp"
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace
+{
+    const size_t MAX_LEN = 2 * 32 + 17;
+    const size_t MAX_SHIFT = 32;
+    const size_t GUARD = 32;
+
+    /* reference, written for clarity, shares nothing with src/Scan.cpp */
+
+    size_t refFind(const unsigned char *p, size_t n, unsigned char c)
+    {
+        for (size_t i = 0; i < n; ++i)
+            if (p[i] == c)
+                return i;
+        return n;
+    }
+
+    bool refNick(const unsigned char *p, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            if (p[i] < 0x21 || p[i] > 0x7E || p[i] == ',')
+                return false;
+        return true;
+    }
+
+    bool refChannel(const unsigned char *p, size_t n)
+    {
+        static const char bad[] = {0, 7, '\r', '\n', ' ', ',', ':'};
+        for (size_t i = 0; i < n; ++i)
+            if (std::memchr(bad, p[i], sizeof(bad)))
+                return false;
+        return true;
+    }
+
+    unsigned char refFold(unsigned char b)
+    {
+        return (b >= 'A' && b <= '^') ? (unsigned char)(b + 32) : b;
+    }
+
+    struct Run
+    {
+        const char *level;
+        unsigned long checks;
+        bool failed;
+
+        bool expect(bool ok, const char *what, size_t n, size_t shift, size_t pos)
+        {
+            ++checks;
+            if (!ok && !failed)
+                std::printf("FAIL %s: %s len=%lu align=%lu pos=%lu\n", level, what, (unsigned long)n,
+                            (unsigned long)shift, (unsigned long)pos);
+            failed = failed || !ok;
+            return ok;
+        }
+    };
+
+    // the input lives at buf + GUARD + shift, guard bytes all around
+    unsigned char buf[GUARD + MAX_SHIFT + MAX_LEN + GUARD];
+
+    unsigned char *place(size_t shift)
+    {
+        std::memset(buf, 0xA5, sizeof(buf));
+        return buf + GUARD + shift;
+    }
+
+    bool guardsIntact(const unsigned char *p, size_t n)
+    {
+        for (const unsigned char *g = buf; g < p; ++g)
+            if (*g != 0xA5)
+                return false;
+        for (const unsigned char *g = p + n; g < buf + sizeof(buf); ++g)
+            if (*g != 0xA5)
+                return false;
+        return true;
+    }
+
+    void fill(unsigned char *p, size_t n, unsigned char avoid, size_t seed)
+    {
+        // high-bit bytes, near misses of the target and plain text
+        for (size_t i = 0; i < n; ++i)
+        {
+            unsigned char b;
+            if ((i + seed) % 3 == 0)
+                b = (unsigned char)(0x80 | (i * 37 + seed));
+            else if ((i + seed) % 3 == 1)
+                b = (unsigned char)(avoid ^ 0x80);
+            else
+                b = (unsigned char)('a' + (i + seed) % 26);
+            p[i] = b == avoid ? (unsigned char)(b ^ 1) : b;
+        }
+    }
+
+    void findBytes(Run &r)
+    {
+        static const unsigned char targets[] = {'\n', '\r', ' ', ',', 0x00, 0x80, 0xFF};
+        for (size_t t = 0; t < sizeof(targets); ++t)
+            for (size_t shift = 0; shift < MAX_SHIFT; ++shift)
+                for (size_t n = 0; n <= MAX_LEN; ++n)
+                    for (size_t pos = 0; pos <= n; ++pos) // pos == n: absent
+                    {
+                        unsigned char *p = place(shift);
+                        fill(p, n, targets[t], shift + pos);
+                        if (pos < n)
+                            p[pos] = targets[t];
+                        if (pos + 3 < n) // a second hit later must not win
+                            p[n - 1] = targets[t];
+                        size_t want = refFind(p, n, targets[t]);
+                        size_t got = targets[t] == '\n' ? Scan::findNewline((const char *)p, n)
+                                                        : Scan::findByte((const char *)p, n, (char)targets[t]);
+                        if (!r.expect(got == want, "findByte", n, shift, pos))
+                            return;
+                    }
+    }
+
+    void validators(Run &r)
+    {
+        for (size_t shift = 0; shift < MAX_SHIFT; shift += 7)
+            for (size_t n = 0; n <= MAX_LEN; ++n)
+                for (size_t pos = 0; pos <= n; ++pos)
+                    for (unsigned int b = 0; b < 256; ++b)
+                    {
+                        if (pos == n && b > 0)
+                            break; // all valid, once
+                        unsigned char *p = place(shift);
+                        for (size_t i = 0; i < n; ++i)
+                            p[i] = (unsigned char)('A' + i % 58); // A..z incl. [\]^_`
+                        if (pos < n)
+                            p[pos] = (unsigned char)b;
+                        if (!r.expect(Scan::validNick((const char *)p, n) == refNick(p, n), "validNick", n, shift, pos)
+                            || !r.expect(Scan::validChannelChars((const char *)p, n) == refChannel(p, n),
+                                         "validChannelChars", n, shift, pos))
+                            return;
+                    }
+    }
+
+    void folding(Run &r)
+    {
+        unsigned char want[MAX_LEN];
+        for (size_t shift = 0; shift < MAX_SHIFT; ++shift)
+            for (size_t n = 0; n <= MAX_LEN; ++n)
+                for (size_t rot = 0; rot < 256; rot += n ? n : 256) // every byte value lands somewhere
+                {
+                    unsigned char *p = place(shift);
+                    for (size_t i = 0; i < n; ++i)
+                    {
+                        p[i] = (unsigned char)(rot + i);
+                        want[i] = refFold(p[i]);
+                    }
+                    Scan::foldCase((char *)p, n);
+                    if (!r.expect(std::memcmp(p, want, n) == 0 && guardsIntact(p, n), "foldCase", n, shift, rot))
+                        return;
+                }
+        std::string s("NiCk[\\]^~\xC9");
+        r.expect(Scan::folded(s) == "nick{|}~~\xC9", "folded", s.size(), 0, 0);
+    }
+
+    void masking(Run &r)
+    {
+        static const unsigned char keys[][4] = {{0, 0, 0, 0}, {0xFF, 0xFF, 0xFF, 0xFF}, {1, 2, 3, 4}, {0x80, 0x7F, 0x00, 0xC3}};
+        unsigned char want[MAX_LEN];
+        for (size_t k = 0; k < 4; ++k)
+            for (size_t shift = 0; shift < MAX_SHIFT; ++shift)
+                for (size_t n = 0; n <= MAX_LEN; ++n)
+                {
+                    unsigned char *p = place(shift);
+                    for (size_t i = 0; i < n; ++i)
+                    {
+                        p[i] = (unsigned char)(i * 131 + shift);
+                        want[i] = p[i] ^ keys[k][i % 4];
+                    }
+                    Scan::xorMask((char *)p, n, keys[k]);
+                    if (!r.expect(std::memcmp(p, want, n) == 0 && guardsIntact(p, n), "xorMask", n, shift, k))
+                        return;
+                }
+    }
+
+    bool cpuHas(Scan::Level l)
+    {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        __builtin_cpu_init();
+        if (l == Scan::AVX2)
+            return __builtin_cpu_supports("avx2");
+        if (l == Scan::SSE2)
+            return __builtin_cpu_supports("sse2");
+#endif
+        return l == Scan::SCALAR;
+    }
+}
+
+int main()
+{
+    bool failed = false;
+    for (int l = Scan::SCALAR; l <= Scan::AVX2; ++l)
+    {
+        Scan::Level level = (Scan::Level)l;
+        if (!cpuHas(level))
+        {
+            std::printf("%-6s skipped, not on this CPU\n", Scan::levelName(level));
+            continue;
+        }
+        if (Scan::init(level) != level)
+        {
+            std::printf("FAIL %s: supported but refused by the startup self-check\n", Scan::levelName(level));
+            failed = true;
+            continue;
+        }
+        Run r = {Scan::levelName(level), 0, false};
+        findBytes(r);
+        validators(r);
+        folding(r);
+        masking(r);
+        if (!r.failed)
+            std::printf("%-6s ok, %lu checks\n", r.level, r.checks);
+        failed = failed || r.failed;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,306 @@
+// Churn test: starts its own ircserv, then connects, joins, invites, kicks,
+// parts and disconnects clients for a while, and fails if the server does
+// not come back to its baseline afterwards.
+//
+//   soaktest [-t seconds] [-c clients] [-p port] [-r rss_slack_kb] <ircserv>
+//
+// The baseline is taken after two warm-up rounds, so malloc arenas and
+// first-use growth are already in. At the end the live objects per
+// subsystem (STATS A), the open fds and the RSS of the server are compared
+// with it. Exit status 1 means something leaked.
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static const int CHANNELS = 8;
+
+struct Sample
+{
+    std::map<std::string, long> live;  // subsystem => live objects
+    long fds;
+    long rssKb;
+};
+
+static int dial(int port)
+{
+    sockaddr_in sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (sockaddr *)&sa, sizeof(sa)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+static void sendLine(int fd, const std::string &line)
+{
+    std::string s = line + "\r\n";
+    size_t off = 0;
+    for (int tries = 0; off < s.size() && tries < 1000; ++tries)
+    {
+        ssize_t n = send(fd, s.data() + off, s.size() - off, MSG_NOSIGNAL);
+        if (n > 0)
+            off += (size_t)n;
+        else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return;
+        else
+            usleep(100);
+    }
+}
+
+static void drain(int fd)
+{
+    char buf[65536];
+    while (recv(fd, buf, sizeof(buf), 0) > 0)
+        ;
+}
+
+// sends `line` and collects the reply up to `until`
+static std::string ask(int fd, const std::string &line, const std::string &until)
+{
+    sendLine(fd, line);
+    std::string in;
+    for (int i = 0; i < 500 && in.find(until) == std::string::npos; ++i)
+    {
+        pollfd p;
+        p.fd = fd;
+        p.events = POLLIN;
+        p.revents = 0;
+        poll(&p, 1, 10);
+        char buf[4096];
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n > 0)
+            in.append(buf, (size_t)n);
+        else if (n == 0)
+            break;
+    }
+    return in;
+}
+
+static long countFds(pid_t pid)
+{
+    std::ostringstream path;
+    path << "/proc/" << pid << "/fd";
+    DIR *d = opendir(path.str().c_str());
+    if (!d)
+        return -1;
+    long n = 0;
+    while (dirent *e = readdir(d))
+        if (e->d_name[0] != '.')
+            ++n;
+    closedir(d);
+    return n;
+}
+
+static long rssKb(pid_t pid)
+{
+    std::ostringstream path;
+    path << "/proc/" << pid << "/statm";
+    std::ifstream in(path.str().c_str());
+    long size = 0, resident = 0;
+    in >> size >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static Sample sample(int ctl, pid_t pid)
+{
+    Sample s;
+    std::istringstream in(ask(ctl, "STATS A", " 219 "));
+    std::string line;
+    while (std::getline(in, line))
+    {
+        // :localhost 249 soakctl A :client live=1 live_bytes=...
+        size_t colon = line.find(" :");
+        size_t live = line.find(" live=");
+        if (line.find(" 249 ") == std::string::npos || colon == std::string::npos || live == std::string::npos)
+            continue;
+        s.live[line.substr(colon + 2, live - colon - 2)] = std::atol(line.c_str() + live + 6);
+    }
+    s.fds = countFds(pid);
+    s.rssKb = rssKb(pid);
+    return s;
+}
+
+// one round of churn with `n` clients, nicks are unique per round
+static void churn(int port, int n, int round)
+{
+    std::vector<int> fds;
+    std::vector<std::string> nicks;
+    for (int i = 0; i < n; ++i)
+    {
+        int fd = dial(port);
+        if (fd < 0)
+            continue;
+        std::ostringstream nick;
+        nick << "s" << round << "x" << i;
+        fds.push_back(fd);
+        nicks.push_back(nick.str());
+        sendLine(fd, "PASS soakpw");
+        sendLine(fd, "NICK " + nick.str());
+        sendLine(fd, "USER soak 0 * :soak");
+    }
+    for (size_t i = 0; i < fds.size(); ++i)
+    {
+        std::ostringstream join;
+        join << "JOIN #soak" << rand() % CHANNELS << ",#soak" << rand() % CHANNELS;
+        sendLine(fds[i], join.str());
+    }
+    usleep(20000);
+    for (size_t i = 0; i < fds.size(); ++i)
+    {
+        std::ostringstream chan;
+        chan << "#soak" << rand() % CHANNELS;
+        const std::string &other = nicks[(size_t)rand() % nicks.size()];
+        drain(fds[i]);
+        sendLine(fds[i], "PRIVMSG " + chan.str() + " :churning along");
+        sendLine(fds[i], "INVITE " + other + " " + chan.str());
+        if (rand() % 4 == 0)
+            sendLine(fds[i], "MODE " + chan.str() + " +i");
+        sendLine(fds[i], "KICK " + chan.str() + " " + other + " :churn");
+        if (rand() % 2)
+            sendLine(fds[i], "PART " + chan.str());
+    }
+    usleep(20000);
+    for (size_t i = 0; i < fds.size(); ++i)
+    {
+        drain(fds[i]);
+        if (i % 3 == 0)
+            sendLine(fds[i], "QUIT :done");
+        else if (i % 3 == 1)
+            send(fds[i], "PRIVMSG #soak0 :half a li", 25, MSG_NOSIGNAL);
+        close(fds[i]); // the rest just drop
+    }
+}
+
+static bool waitForClients(int ctl, pid_t pid, long want, Sample &s)
+{
+    for (int i = 0; i < 100; ++i)
+    {
+        s = sample(ctl, pid);
+        if (s.live["client"] == want)
+            return true;
+        usleep(50000);
+    }
+    return false;
+}
+
+static void usage()
+{
+    std::cerr << "usage: soaktest [-t seconds] [-c clients] [-p port] [-r rss_slack_kb] <ircserv>\n";
+    std::exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    long seconds = 30, clients = 200, port = 6690, slackKb = 2048;
+    int i = 1;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2)
+    {
+        long v = std::atol(argv[i + 1]);
+        if (std::strcmp(argv[i], "-t") == 0)
+            seconds = v;
+        else if (std::strcmp(argv[i], "-c") == 0)
+            clients = v;
+        else if (std::strcmp(argv[i], "-p") == 0)
+            port = v;
+        else if (std::strcmp(argv[i], "-r") == 0)
+            slackKb = v;
+        else
+            usage();
+    }
+    if (argc - i != 1 || clients < 1)
+        usage();
+
+    std::ostringstream cfgPath, portStr;
+    cfgPath << "/tmp/soaktest." << getpid() << ".conf";
+    portStr << port;
+    {
+        std::ofstream cfg(cfgPath.str().c_str());
+        cfg << "snapshot_file\nhistory_dir\nbuffer_pool_bytes 0\noper soak soakoper\n";
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        dup2(null, 2);
+        execl(argv[i], argv[i], portStr.str().c_str(), "soakpw", cfgPath.str().c_str(), (char *)NULL);
+        _exit(127);
+    }
+    int ctl = -1;
+    for (int t = 0; t < 100 && ctl < 0; ++t)
+    {
+        usleep(50000);
+        ctl = dial((int)port);
+    }
+    bool ok = ctl >= 0;
+    if (!ok)
+        std::cerr << "soak: server did not come up on port " << port << "\n";
+    else
+    {
+        sendLine(ctl, "PASS soakpw");
+        sendLine(ctl, "NICK soakctl");
+        sendLine(ctl, "USER soak 0 * :soak");
+        ask(ctl, "OPER soak soakoper", " 381 ");
+        srand(1);
+        int round = 0;
+        for (; round < 2; ++round)
+            churn((int)port, (int)clients, round);
+        Sample base, end;
+        ok = waitForClients(ctl, pid, 1, base);
+        time_t stopAt = time(NULL) + seconds;
+        while (ok && time(NULL) < stopAt)
+            churn((int)port, (int)clients, round++);
+        ok = waitForClients(ctl, pid, 1, end) && ok;
+
+        std::printf("rounds %d clients_per_round %ld\n", round - 2, clients);
+        for (std::map<std::string, long>::iterator it = base.live.begin(); it != base.live.end(); ++it)
+        {
+            long after = end.live[it->first];
+            bool same = after == it->second;
+            std::printf("%-8s live %6ld -> %6ld %s\n", it->first.c_str(), it->second, after, same ? "ok" : "LEAK");
+            ok = ok && same;
+        }
+        bool fdsOk = end.fds == base.fds;
+        bool rssOk = end.rssKb <= base.rssKb + slackKb;
+        std::printf("fds      %6ld -> %6ld %s\n", base.fds, end.fds, fdsOk ? "ok" : "LEAK");
+        std::printf("rss_kb   %6ld -> %6ld %s (slack %ld)\n", base.rssKb, end.rssKb, rssOk ? "ok" : "GREW", slackKb);
+        ok = ok && fdsOk && rssOk && !base.live.empty();
+        close(ctl);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(cfgPath.str().c_str());
+    std::printf("%s\n", ok ? "soak: pass" : "soak: FAIL");
+    return ok ? 0 : 1;
+}
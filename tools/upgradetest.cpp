@@ -0,0 +1,318 @@
+// Upgrade under load: starts its own ircserv, joins receivers to one
+// channel, streams numbered PRIVMSGs from a sender and sends SIGUSR2
+// halfway through, so the binary upgrade happens mid-stream.
+//
+//   upgradetest [-c receivers] [-m messages] [-p port] <ircserv>
+//
+// Fails unless every receiver gets every message exactly once and in
+// order, no connection drops, a PING on each connection is answered by the
+// new process, and the new process holds no more fds than the old one did
+// (the exec'd binary must not inherit files, pipes or eventfds).
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct Receiver
+{
+    int fd;
+    std::string in;
+    long next;      // next sequence number expected
+    bool broken;    // EOF, error or a message out of order
+};
+
+static int dial(int port)
+{
+    sockaddr_in sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (sockaddr *)&sa, sizeof(sa)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+static bool sendLine(int fd, const std::string &line)
+{
+    std::string s = line + "\r\n";
+    size_t off = 0;
+    for (int tries = 0; off < s.size() && tries < 10000; ++tries)
+    {
+        ssize_t n = send(fd, s.data() + off, s.size() - off, MSG_NOSIGNAL);
+        if (n > 0)
+            off += (size_t)n;
+        else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return false;
+        else
+            usleep(100);
+    }
+    return off == s.size();
+}
+
+// sends `line` and collects the reply up to `until`
+static std::string ask(int fd, const std::string &line, const std::string &until)
+{
+    sendLine(fd, line);
+    std::string in;
+    for (int i = 0; i < 500 && in.find(until) == std::string::npos; ++i)
+    {
+        pollfd p;
+        p.fd = fd;
+        p.events = POLLIN;
+        p.revents = 0;
+        poll(&p, 1, 10);
+        char buf[4096];
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n > 0)
+            in.append(buf, (size_t)n);
+        else if (n == 0)
+            break;
+    }
+    return in;
+}
+
+// reads what is there and checks the sequence numbers
+static void pump(Receiver &r)
+{
+    char buf[65536];
+    for (;;)
+    {
+        ssize_t n = recv(r.fd, buf, sizeof(buf), 0);
+        if (n > 0)
+            r.in.append(buf, (size_t)n);
+        else
+        {
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                r.broken = true;
+            break;
+        }
+    }
+    size_t start = 0, eol;
+    while ((eol = r.in.find("\r\n", start)) != std::string::npos)
+    {
+        std::string line = r.in.substr(start, eol - start);
+        start = eol + 2;
+        size_t seq = line.find(" PRIVMSG #up :seq ");
+        if (seq == std::string::npos)
+            continue;
+        if (std::atol(line.c_str() + seq + 18) != r.next)
+            r.broken = true;
+        ++r.next;
+    }
+    r.in.erase(0, start);
+}
+
+static long slowest(const std::vector<Receiver> &rs)
+{
+    long low = -1;
+    for (size_t i = 0; i < rs.size(); ++i)
+        if (low < 0 || rs[i].next < low)
+            low = rs[i].next;
+    return low;
+}
+
+static void pumpAll(std::vector<Receiver> &rs, int waitMs)
+{
+    std::vector<pollfd> p(rs.size());
+    for (size_t i = 0; i < rs.size(); ++i)
+    {
+        p[i].fd = rs[i].fd;
+        p[i].events = POLLIN;
+        p[i].revents = 0;
+    }
+    poll(&p[0], p.size(), waitMs);
+    for (size_t i = 0; i < rs.size(); ++i)
+        if (!rs[i].broken)
+            pump(rs[i]);
+}
+
+static long countFds(pid_t pid)
+{
+    std::ostringstream path;
+    path << "/proc/" << pid << "/fd";
+    DIR *d = opendir(path.str().c_str());
+    if (!d)
+        return -1;
+    long n = 0;
+    while (dirent *e = readdir(d))
+        if (e->d_name[0] != '.')
+            ++n;
+    closedir(d);
+    return n;
+}
+
+// the old server logs "upgrade: pid N took over"
+static pid_t newPid(const std::string &logPath)
+{
+    std::ifstream in(logPath.c_str());
+    std::string line;
+    while (std::getline(in, line))
+    {
+        size_t at = line.find("upgrade: pid ");
+        if (at != std::string::npos && line.find(" took over") != std::string::npos)
+            return (pid_t)std::atol(line.c_str() + at + 13);
+    }
+    return -1;
+}
+
+static void usage()
+{
+    std::cerr << "usage: upgradetest [-c receivers] [-m messages] [-p port] <ircserv>\n";
+    std::exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    long receivers = 20, messages = 20000, port = 6691;
+    int i = 1;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2)
+    {
+        long v = std::atol(argv[i + 1]);
+        if (std::strcmp(argv[i], "-c") == 0)
+            receivers = v;
+        else if (std::strcmp(argv[i], "-m") == 0)
+            messages = v;
+        else if (std::strcmp(argv[i], "-p") == 0)
+            port = v;
+        else
+            usage();
+    }
+    if (argc - i != 1 || receivers < 1 || messages < 2)
+        usage();
+
+    std::ostringstream cfgPath, logPath, portStr;
+    cfgPath << "/tmp/upgradetest." << getpid() << ".conf";
+    logPath << "/tmp/upgradetest." << getpid() << ".log";
+    portStr << port;
+    {
+        std::ofstream cfg(cfgPath.str().c_str());
+        cfg << "snapshot_file\nhistory_dir\n";
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int log = open(logPath.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        dup2(log, 1);
+        dup2(log, 2);
+        close(log);
+        execl(argv[i], argv[i], portStr.str().c_str(), "uppw", cfgPath.str().c_str(), (char *)NULL);
+        _exit(127);
+    }
+    int sender = -1;
+    for (int t = 0; t < 100 && sender < 0; ++t)
+    {
+        usleep(50000);
+        sender = dial((int)port);
+    }
+    bool ok = sender >= 0;
+    pid_t next = -1;
+    if (!ok)
+        std::cerr << "upgradetest: server did not come up on port " << port << "\n";
+    else
+    {
+        sendLine(sender, "PASS uppw");
+        sendLine(sender, "NICK upsend");
+        sendLine(sender, "USER up 0 * :up");
+        ask(sender, "JOIN #up", " 366 ");
+        std::vector<Receiver> rs;
+        for (long r = 0; r < receivers && ok; ++r)
+        {
+            Receiver rc;
+            rc.fd = dial((int)port);
+            rc.next = 0;
+            rc.broken = rc.fd < 0;
+            ok = !rc.broken;
+            std::ostringstream nick;
+            nick << "uprecv" << r;
+            sendLine(rc.fd, "PASS uppw");
+            sendLine(rc.fd, "NICK " + nick.str());
+            sendLine(rc.fd, "USER up 0 * :up");
+            ok = ok && ask(rc.fd, "JOIN #up", " 366 ").find(" 366 ") != std::string::npos;
+            rs.push_back(rc);
+        }
+
+        long oldFds = -1;
+        char buf[4096];
+        for (long m = 0; ok && m < messages; ++m)
+        {
+            if (m == messages / 2)
+            {
+                oldFds = countFds(pid);
+                kill(pid, SIGUSR2);
+            }
+            std::ostringstream line;
+            line << "PRIVMSG #up :seq " << m;
+            ok = sendLine(sender, line.str());
+            while (recv(sender, buf, sizeof(buf), 0) > 0)
+                ;
+            // stay within a few hundred lines of the slowest receiver
+            pumpAll(rs, 0);
+            for (int t = 0; t < 1000 && m - slowest(rs) > 500; ++t)
+                pumpAll(rs, 10);
+        }
+        for (int t = 0; t < 1000 && slowest(rs) < messages; ++t)
+            pumpAll(rs, 10);
+
+        long got = slowest(rs), broken = 0;
+        for (size_t r = 0; r < rs.size(); ++r)
+            broken += rs[r].broken;
+        next = newPid(logPath.str());
+        long pongs = ask(sender, "PING :after", "PONG").find("PONG") != std::string::npos;
+        for (size_t r = 0; r < rs.size(); ++r)
+            pongs += ask(rs[r].fd, "PING :after", "PONG").find("PONG") != std::string::npos;
+        long newFds = next > 0 ? countFds(next) : -1;
+        for (size_t r = 0; r < rs.size(); ++r)
+            close(rs[r].fd);
+        // the receivers and the sender were connected in both counts
+        bool fdsOk = newFds >= 0 && newFds <= oldFds;
+
+        std::printf("receivers %ld messages %ld\n", receivers, messages);
+        std::printf("old_pid %d new_pid %d\n", (int)pid, (int)next);
+        std::printf("delivered_to_slowest %ld %s\n", got, got == messages ? "ok" : "LOST");
+        std::printf("broken %ld %s\n", broken, broken ? "FAIL" : "ok");
+        std::printf("pongs %ld/%ld %s\n", pongs, receivers + 1, pongs == receivers + 1 ? "ok" : "FAIL");
+        std::printf("fds %ld -> %ld %s\n", oldFds, newFds, fdsOk ? "ok" : "LEAK");
+        ok = ok && next > 0 && next != pid && got == messages && !broken && pongs == receivers + 1 && fdsOk;
+        close(sender);
+    }
+    // the old process exits once the new one has taken over
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    if (next > 0)
+        kill(next, SIGTERM);
+    unlink(cfgPath.str().c_str());
+    if (ok)
+        unlink(logPath.str().c_str());
+    else
+        std::cerr << "upgradetest: server log kept in " << logPath.str() << "\n";
+    std::printf("%s\n", ok ? "upgradetest: pass" : "upgradetest: FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,266 @@
+// Minimal WebSocket to TCP forwarder, the "proxy in front of the plain
+// port" that pingpong compares with a native "listen ws:" endpoint.
+//
+//   wsproxy [-l listen_port] <host> <port>
+//
+// Each WebSocket client gets its own TCP connection to host:port. Uses the
+// server's own WebSocket code, so the framing is the same on both paths and
+// the difference measured is the extra hop: one more poll wakeup, two more
+// socket copies per line. Single threaded, no TLS, no origin checks: a
+// benchmark aid, not something to put in front of real users.
+
+#include "Buffer.hpp"
+#include "WebSocket.hpp"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+struct Pair
+{
+    int client;                        // WebSocket side
+    int upstream;                      // plain IRC side
+    WebSocket ws;
+    std::string toClient;              // frames, 101, pongs, not sent yet
+    std::string toUpstream;            // CRLF lines not sent yet
+    std::string partial;               // upstream bytes after the last '\n'
+    bool closing;                      // close once toClient is out
+};
+
+static void tuned(int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+}
+
+static int dial(const std::string &host, const std::string &port)
+{
+    addrinfo hints, *res = NULL;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res)
+        return -1;
+    int fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0)
+        tuned(fd);
+    return fd;
+}
+
+static int listenOn(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa.sin_port = htons(port);
+    if (bind(fd, (sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, SOMAXCONN) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+// false on EOF or a hard error
+static bool readSome(int fd, std::string &into)
+{
+    char buf[65536];
+    for (;;)
+    {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n > 0)
+            into.append(buf, (size_t)n);
+        else if (n == 0)
+            return false;
+        else
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+}
+
+static bool flush(int fd, std::string &out)
+{
+    while (!out.empty())
+    {
+        ssize_t n = send(fd, out.data(), out.size(), MSG_NOSIGNAL);
+        if (n > 0)
+            out.erase(0, (size_t)n);
+        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return true;
+        else
+            return false;
+    }
+    return true;
+}
+
+// complete upstream lines become one frame each, the rest waits
+static void frameLines(Pair &p, const std::string &bytes)
+{
+    p.partial += bytes;
+    size_t last = p.partial.rfind('\n');
+    if (last == std::string::npos)
+        return;
+    Buffer out;
+    p.ws.frame(p.partial.data(), last + 1, out);
+    p.toClient.append(out.data(), out.size());
+    p.partial.erase(0, last + 1);
+}
+
+static void usage()
+{
+    std::cerr << "usage: wsproxy [-l listen_port] <host> <port>\n";
+    std::exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int listenPort = 8080;
+    int i = 1;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2)
+    {
+        if (std::strcmp(argv[i], "-l") == 0)
+            listenPort = std::atoi(argv[i + 1]);
+        else
+            usage();
+    }
+    if (argc - i != 2)
+        usage();
+    std::string host = argv[i], port = argv[i + 1];
+    signal(SIGPIPE, SIG_IGN);
+
+    int lfd = listenOn(listenPort);
+    if (lfd < 0)
+    {
+        std::cerr << "wsproxy: cannot listen on port " << listenPort << "\n";
+        return 1;
+    }
+    std::cout << "wsproxy: ws:" << listenPort << " -> " << host << ":" << port << std::endl;
+
+    std::map<int, Pair *> byFd;        // both fds of a pair point to it
+    std::vector<pollfd> fds;
+    for (;;)
+    {
+        fds.clear();
+        pollfd l;
+        l.fd = lfd;
+        l.events = POLLIN;
+        l.revents = 0;
+        fds.push_back(l);
+        for (std::map<int, Pair *>::iterator it = byFd.begin(); it != byFd.end(); ++it)
+        {
+            Pair *p = it->second;
+            pollfd e;
+            e.fd = it->first;
+            e.revents = 0;
+            const std::string &pending = e.fd == p->client ? p->toClient : p->toUpstream;
+            e.events = (short)((p->closing ? 0 : POLLIN) | (pending.empty() ? 0 : POLLOUT));
+            fds.push_back(e);
+        }
+        if (poll(&fds[0], fds.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            int cfd;
+            while ((cfd = accept(lfd, NULL, NULL)) >= 0)
+            {
+                int ufd = dial(host, port);
+                if (ufd < 0)
+                {
+                    std::cerr << "wsproxy: cannot connect to " << host << ":" << port << "\n";
+                    close(cfd);
+                    continue;
+                }
+                tuned(cfd);
+                Pair *p = new Pair;
+                p->client = cfd;
+                p->upstream = ufd;
+                p->closing = false;
+                byFd[cfd] = p;
+                byFd[ufd] = p;
+            }
+        }
+
+        std::set<Pair *> dead;        // both fds of a pair may be ready
+        for (size_t k = 1; k < fds.size(); ++k)
+        {
+            if (!fds[k].revents)
+                continue;
+            std::map<int, Pair *>::iterator it = byFd.find(fds[k].fd);
+            if (it == byFd.end())
+                continue;
+            Pair *p = it->second;
+            bool ok = true;
+            std::string in;
+            if (fds[k].fd == p->client)
+            {
+                if (fds[k].revents & (POLLIN | POLLHUP | POLLERR))
+                {
+                    ok = readSome(p->client, in);
+                    std::string text, reply;
+                    if (!in.empty() && !p->ws.receive(in.data(), in.size(), text, reply))
+                        p->closing = true;
+                    p->toUpstream += text;
+                    p->toClient += reply;
+                }
+                ok = ok && flush(p->client, p->toClient);
+                ok = ok && flush(p->upstream, p->toUpstream);
+                if (p->closing && p->toClient.empty())
+                    ok = false;
+            }
+            else
+            {
+                if (fds[k].revents & (POLLIN | POLLHUP | POLLERR))
+                {
+                    ok = readSome(p->upstream, in);
+                    frameLines(*p, in);
+                }
+                ok = ok && flush(p->upstream, p->toUpstream);
+                ok = ok && flush(p->client, p->toClient);
+            }
+            if (!ok)
+                dead.insert(p);
+        }
+        for (std::set<Pair *>::iterator it = dead.begin(); it != dead.end(); ++it)
+        {
+            Pair *p = *it;
+            flush(p->client, p->toClient);
+            byFd.erase(p->client);
+            byFd.erase(p->upstream);
+            close(p->client);
+            close(p->upstream);
+            delete p;
+        }
+    }
+    close(lfd);
+    return 0;
+}